@@ -22,9 +22,7 @@ int main(int ac, char **av)
 		} else if (strlen(av[2])==1 && (av[2][0]=='w' || av[2][0]=='W')) {
 			attr = attr & 0xFB;
 		}
-		setAttr(av[1], attr);
-		
-		updateDirectory();
+		setFileAttr(av[1], attr);
 	    closeFS();
 	} else if (_result == FS_FILE_NOT_FOUND) {
 		printf("FILE NOT FOUND\n");
@@ -0,0 +1,156 @@
+#include "libefs.h"
+
+// Longest command line read from the manifest
+#define MAX_LINE_LEN 512
+
+// Copy a host file into the partition
+void checkinFile(const char *filename)
+{
+	findFile(filename);
+	if (_result == FS_OK) {
+		printf("%s: DUPLICATE FILE\n", filename);
+		return;
+	}
+
+	FILE *fp = fopen(filename, "r");
+	if(fp == NULL)
+	{
+		printf("%s: Unable to open source file\n", filename);
+		return;
+	}
+
+	int fileInEFS = openFile(filename, MODE_CREATE);
+	if(fileInEFS == -1) {
+		printf("%s: Unable to create file\n", filename);
+		fclose(fp);
+		return;
+	}
+
+	streamToFile(fileInEFS, fp);
+	if(_result != FS_OK) {
+		printf("%s: Disk full\n", filename);
+	}
+	fclose(fp);
+
+	closeFile(fileInEFS);
+}
+
+// Copy a file out of the partition into the host file of the same name
+void checkoutFile(const char *filename)
+{
+	findFile(filename);
+	if (_result != FS_OK) {
+		printf("%s: FILE NOT FOUND\n", filename);
+		return;
+	}
+
+	FILE *fp = fopen(filename, "w");
+	if(fp == NULL)
+	{
+		printf("%s: Unable to open target file\n", filename);
+		return;
+	}
+
+	int fileInEFS = openFile(filename, MODE_READ_ONLY);
+	if(fileInEFS == -1) {
+		printf("%s: Unable to open file\n", filename);
+		fclose(fp);
+		return;
+	}
+
+	streamFromFile(fileInEFS, fp, getFileLength(filename));
+	if(_result != FS_OK) {
+		printf("%s: Unable to read the whole file\n", filename);
+	}
+	closeFile(fileInEFS);
+	fclose(fp);
+}
+
+// Delete a file from the partition
+void deleteFile(const char *filename)
+{
+	delFile(filename);
+	if (_result == FS_FILE_NOT_FOUND) {
+		printf("%s: FILE NOT FOUND\n", filename);
+	} else if (_result != FS_OK) {
+		printf("%s: Unknown Error\n", filename);
+	}
+}
+
+// Print a file's attribute, 'R' or 'W'
+void printAttr(const char *filename)
+{
+	unsigned int attr = getAttr(filename);
+	if (_result == FS_OK) {
+		printf("%s: %c\n", filename, (attr & 0x04) ? 'R' : 'W');
+	} else {
+		printf("%s: FILE NOT FOUND\n", filename);
+	}
+}
+
+// Set a file's attribute from 'R' or 'W'
+void changeAttr(const char *filename, const char *value)
+{
+	unsigned int attr = getAttr(filename);
+	if (_result != FS_OK) {
+		printf("%s: FILE NOT FOUND\n", filename);
+		return;
+	}
+
+	if (strlen(value)==1 && (value[0]=='r' || value[0]=='R')) {
+		attr = attr | 0x04;
+	} else if (strlen(value)==1 && (value[0]=='w' || value[0]=='W')) {
+		attr = attr & 0xFB;
+	}
+	setFileAttr(filename, attr);
+}
+
+int main(int ac, char **av)
+{
+	if(ac != 2)
+	{
+		printf("\nUsage: %s <password> < <manifest>\n", av[0]);
+		printf("Manifest lines: checkin <file>, checkout <file>, delete <file>,\n");
+		printf("getattr <file>, setattr <file> <R|W>\n\n");
+		return -1;
+	}
+
+	initFS("part.dsk", av[1]);
+	if (_result == FS_ERROR) {
+		printf("Unknown Error\n");
+		exit(-1);
+	}
+
+	// the directory and free list are written once, at the end
+	beginBatch();
+
+	char line[MAX_LINE_LEN];
+	while(fgets(line, MAX_LINE_LEN, stdin) != NULL) {
+		char command[MAX_LINE_LEN], filename[MAX_LINE_LEN], value[MAX_LINE_LEN];
+		int fields = sscanf(line, "%s %s %s", command, filename, value);
+
+		if(fields < 2) {
+			continue;
+		}
+
+		if(strlen(filename) > MAX_FNAME_LEN) {
+			printf("%s: Filename too long\n", filename);
+		} else if(strcmp(command, "checkin") == 0) {
+			checkinFile(filename);
+		} else if(strcmp(command, "checkout") == 0) {
+			checkoutFile(filename);
+		} else if(strcmp(command, "delete") == 0) {
+			deleteFile(filename);
+		} else if(strcmp(command, "getattr") == 0) {
+			printAttr(filename);
+		} else if(strcmp(command, "setattr") == 0 && fields == 3) {
+			changeAttr(filename, value);
+		} else {
+			printf("Unknown command: %s", line);
+		}
+	}
+
+	endBatch();
+	closeFS();
+	return 0;
+}
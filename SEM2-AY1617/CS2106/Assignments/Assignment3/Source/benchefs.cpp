@@ -0,0 +1,105 @@
+#include "efs.h"
+#include <time.h>
+
+// The reference byte-at-a-time cipher in efs.cpp
+void encdec(char *targetBuffer, const char *message, unsigned int len, const char *key, unsigned int keyLen);
+
+// Number of blocks pushed through the cipher
+#define CIPHER_BENCH_BLOCKS 4096
+
+// Return the current time in seconds
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill every free block in the partition, then release them again so the
+// bitmap written back on unmount is unchanged.
+void benchAllocator()
+{
+	unsigned long freeBlocks = getFreeBlockCount();
+	unsigned long *blocks = (unsigned long *) calloc(sizeof(unsigned long), freeBlocks);
+	unsigned long count = 0;
+
+	double start = now();
+
+	while(1)
+	{
+		unsigned long blockNum = findFreeBlock();
+
+		if(_result == FS_FULL)
+			break;
+
+		markBlockBusy(blockNum);
+		blocks[count++] = blockNum;
+	}
+
+	double elapsed = now() - start;
+
+	printf("Allocator: %lu blocks in %.3f ms (%.1f ns/block)\n", count, elapsed * 1e3,
+		count ? elapsed * 1e9 / count : 0.0);
+
+	for(unsigned long i=0; i<count; i++)
+		markBlockFree(blocks[i]);
+
+	free(blocks);
+}
+
+// Encrypt the same data with encdec and encdecBlock, check that the output
+// matches and report the throughput of each
+void benchCipher(const char *password)
+{
+	unsigned int blockSize = getFSInfo()->blockSize;
+	unsigned long len = (unsigned long) blockSize * CIPHER_BENCH_BLOCKS;
+	char *plain = (char *) malloc(len);
+	char *ref = (char *) malloc(len);
+	char *out = (char *) malloc(len);
+
+	for(unsigned long i=0; i<len; i++)
+		plain[i] = (char) (i * 2654435761u >> 24);
+
+	double start = now();
+	for(unsigned long i=0; i<len; i+=blockSize)
+		encdec(ref + i, plain + i, blockSize, password, strlen(password));
+	double scalar = now() - start;
+
+	start = now();
+	for(unsigned long i=0; i<len; i+=blockSize)
+		encdecBlock(out + i, plain + i, blockSize);
+	double vector = now() - start;
+
+	double mb = len / (1024.0 * 1024.0);
+	printf("Cipher encdec: %.1f MB/s\n", mb / scalar);
+	printf("Cipher encdecBlock: %.1f MB/s (%s)\n", mb / vector,
+		memcmp(ref, out, len) ? "OUTPUT DIFFERS" : "output matches");
+
+	free(plain);
+	free(ref);
+	free(out);
+}
+
+int main(int ac, char **av)
+{
+	if(ac != 2)
+	{
+		printf("\nUsage: %s <password>\n\n", av[0]);
+		printf("Run on a part.dsk created by makefs.\n\n");
+		exit(-1);
+	}
+
+	// Mount the file system
+	mountFS("part.dsk", av[1]);
+
+	TFileSystemStruct *fs = getFSInfo();
+	printf("Partition: %lu bytes, %u blocks of %u bytes, %lu free\n", fs->fsSize, fs->numBlocks,
+		fs->blockSize, getFreeBlockCount());
+
+	benchAllocator();
+	benchCipher(av[1]);
+
+	// Unmount the file system
+	unmountFS();
+	return 0;
+}
@@ -17,30 +17,26 @@ int main(int ac, char **av)
     findFile(av[1]);
 
 	if (_result == FS_FILE_NOT_FOUND) {
-		unsigned int fileInEFS = openFile(av[1], MODE_CREATE);
-		
 		FILE *fp = fopen(av[1], "r");
 		if(fp == NULL)
 		{
 			printf("\nUnable to open source file %s\n\n", av[1]);
 			exit(-1);
 		}
+		
+		int fileInEFS = openFile(av[1], MODE_CREATE);
+		if(fileInEFS == -1) {
+			printf("Unable to create file\n");
+			exit(-1);
+		}
         
-		// get the size of the file
-        fseek(fp, 0, SEEK_END);
-        unsigned long size = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        
-		void *buffer = malloc(size);		
-		fread(buffer, sizeof(char), size, fp);
+		streamToFile(fileInEFS, fp);
 		fclose(fp);
 		
-		writeFile(fileInEFS, (void *) buffer, sizeof(char), size);
 		flushFile(fileInEFS);
 		closeFile(fileInEFS);
 		
 		unmountFS();
-		free(buffer);
     } else if (_result == FS_OK){
         printf("DUPLICATE FILE\n");
         exit(-1);
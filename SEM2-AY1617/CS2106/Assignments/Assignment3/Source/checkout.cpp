@@ -17,7 +17,11 @@ int main(int ac, char **av)
 	findFile(av[1]);
 
 	if (_result == FS_OK) {
-		unsigned int fileInEFS = openFile(av[1], MODE_READ_ONLY);
+		int fileInEFS = openFile(av[1], MODE_READ_ONLY);
+		if(fileInEFS == -1) {
+			printf("Unknown Error\n");
+			exit(-1);
+		}
 		
 		FILE *fp = fopen(av[1], "w");
 		if(fp == NULL)
@@ -26,17 +30,14 @@ int main(int ac, char **av)
 			exit(-1);
 		}
         
-		unsigned long size = getFileLength(av[1]);
-		void *buffer = malloc(size);	
-		
-		readFile(fileInEFS, (void *) buffer, sizeof(char), size);
+		streamFromFile(fileInEFS, fp, getFileLength(av[1]));
+		if(_result != FS_OK) {
+			printf("Unable to read the whole file\n");
+		}
 		closeFile(fileInEFS);
-
-		fwrite(buffer, sizeof(char), size, fp);	
 		fclose(fp);
 
 		unmountFS();
-		free(buffer);
     } else if (_result == FS_FILE_NOT_FOUND){
         printf("FILE NOT FOUND\n");
         exit(-1);
@@ -12,11 +12,15 @@ int main(int ac, char **av)
     delFile(av[1]);
     if (_result == FS_FILE_NOT_FOUND) {
         printf("FILE NOT FOUND\n");
+		closeFS();
 		exit(-1);
     } else if (_result != FS_OK) {
 		printf("Unknown Error\n");
+		closeFS();
 		exit(-1);
 	}
     
+	// commits the journal and finishes zeroing the freed blocks
+	closeFS();
 	return 0;
 }
@@ -1,14 +1,238 @@
 #include "efs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 TFileSystemStruct _fsDescriptor;
 TDirectory *_directory = NULL;
 char *_bitmap = NULL;
-FILE *_fsfp;
+int _fsfd = -1;
+
+// Partition I/O backend selected at mount time, and the mapping of the
+// partition file when it is IO_MMAP
+int _ioMode = IO_PREAD;
+char *_fsMap = NULL;
+unsigned long _fsMapLen = 0;
+
+// Number of free blocks in the bitmap, and the bitmap word where the next
+// free block search starts
+unsigned long _freeBlockCount = 0;
+unsigned long _allocCursor = 0;
+
+char _password[MAX_PWD_LEN + 1];
+
+// The password expanded to one block's worth of key bytes
+char *_keyStream = NULL;
+
+// Header in front of each pooled buffer
+typedef struct poolHeader
+{
+  struct bufferPool *pool; // Pool the buffer belongs to
+  struct poolHeader *next; // Next free buffer
+} TPoolHeader;
+
+// Buffers of one size, carved from slabs of POOL_SLAB_BUFFERS. Slabs are
+// kept for the life of the process.
+typedef struct bufferPool
+{
+  unsigned long size; // Bytes in each buffer
+  TPoolHeader *freeList; // Buffers ready for reuse
+  struct bufferPool *next;
+} TBufferPool;
+
+TBufferPool *_bufferPools = NULL;
+pthread_mutex_t _poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-thread scratch space for the cipher, kept under _scratchKey
+typedef struct scratch
+{
+  char *encBuffer; // One encrypted block
+  char *runBuffer; // Encrypted multi-block runs
+  unsigned long runBufferLen;
+} TScratch;
+
+pthread_key_t _scratchKey;
+
+// Locks. _metaLock guards the directory, its index and the bitmap and is
+// taken by callers through lockMetadata. The caches lock themselves.
+pthread_rwlock_t _metaLock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t _cacheLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t _ptrCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// A range of blocks split into chunks for the I/O workers. fn handles
+// count blocks starting at first.
+typedef struct ioJob
+{
+  void (*fn)(void *arg, unsigned long first, unsigned long count);
+  void *arg;
+  unsigned long count; // Blocks in the job
+  unsigned long chunk; // Blocks handed out at a time
+  unsigned long next; // First block not yet handed out
+  int busy; // Chunks being worked on
+} TIOJob;
+
+// A run of consecutive blocks being read or written by the I/O workers
+typedef struct blockRun
+{
+  char *buffer; // Plain text, one block after another
+  char *encBuffer; // Cipher text when writing with pwrite
+  unsigned long startBlock; // First block of the run
+  int failed; // Set if the transfer of any chunk failed
+} TBlockRun;
+
+// I/O worker pool. Only one job runs on the pool at a time; callers that
+// find it busy do their job themselves.
+pthread_t *_ioWorkers = NULL;
+int _numIOWorkers = 0;
+int _ioStop = 0;
+TIOJob *_ioJob = NULL;
+pthread_mutex_t _ioLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _ioWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t _ioDone = PTHREAD_COND_INITIALIZER;
+
+// Asynchronous block engine. Requests go to an io_uring when the kernel
+// provides one, otherwise to a queue served by emulation threads.
+int _ringFd = -1;
+void *_sqRing = NULL, *_cqRing = NULL;
+size_t _sqRingLen = 0, _cqRingLen = 0, _sqesLen = 0;
+unsigned *_sqHead, *_sqTail, *_sqMask, *_sqArray;
+unsigned *_cqHead, *_cqTail, *_cqMask;
+struct io_uring_sqe *_sqes = NULL;
+struct io_uring_cqe *_cqes = NULL;
+unsigned _ringQueued = 0; // Entries added to the submission queue but not yet submitted
+unsigned _ringInFlight = 0; // Entries submitted and not yet reaped
+unsigned _ringFinishing = 0; // Requests reaped and being completed outside _ringLock
+int _ringWaiting = 0; // Set while a thread waits in the kernel for completions
+pthread_mutex_t _ringLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _ringDone = PTHREAD_COND_INITIALIZER;
+
+pthread_t _aioThreads[AIO_EMULATION_THREADS];
+int _numAIOThreads = 0;
+int _aioStop = 0;
+TIORequest *_aioQueueHead = NULL, *_aioQueueTail = NULL;
+pthread_mutex_t _aioLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _aioWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t _aioDone = PTHREAD_COND_INITIALIZER;
+
+// Blocks with an asynchronous write in flight, one bit per block. Readers
+// and later writers of them wait until the write is done.
+unsigned char *_writeBusy = NULL;
+unsigned long _writesInFlight = 0;
+pthread_mutex_t _flightLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _flightDone = PTHREAD_COND_INITIALIZER;
+
+// Write-back block cache. Slots are chained by block number for lookup
+// and kept on a doubly linked LRU list, most recently used at the head.
+typedef struct cacheEntry
+{
+  unsigned long blockNum; // Block held in this slot. 0 = slot unused
+  char dirty; // Set if the slot is newer than the copy on disk
+  int hashNext; // Next slot in the same hash chain
+  int lruPrev, lruNext; // Neighbours on the LRU list
+  char *data; // Decrypted block contents
+} TCacheEntry;
+
+TCacheEntry *_cache = NULL;
+int *_cacheHash = NULL;
+int _cacheLRUHead = -1, _cacheLRUTail = -1;
+
+// Cache of indirect inode pointer blocks, with the slot of the last hit
+typedef struct pointerBlock
+{
+  unsigned long blockNum; // Pointer block held in this slot. 0 = slot unused
+  char dirty; // Set if the slot is newer than the copy on disk
+  unsigned long lastUsed; // Access stamp for LRU replacement
+  unsigned long *entries; // numInodeEntries block numbers
+} TPointerBlock;
+
+TPointerBlock *_ptrCache = NULL;
+unsigned long _ptrCacheClock = 0;
+int _ptrCacheLastHit = 0;
+
+// Directory index. Live entries are chained by filename hash, and free
+// entries are kept on a stack with the lowest index on top.
+int *_dirHash = NULL;
+int *_dirHashNext = NULL;
+unsigned int _dirHashSize = 0;
+unsigned int *_dirFreeList = NULL;
+unsigned int _dirFreeCount = 0;
+
+// Dirty flags for each directory entry and each BITMAP_PAGE_SIZE bytes of
+// the bitmap. Only dirty parts are written by storeDirectory/storeBitmap.
+char *_dirDirty = NULL;
+unsigned int _dirDirtyCount = 0;
+char *_bitmapDirty = NULL;
+unsigned int _bitmapDirtyCount = 0;
+
+// Metadata journal. The running transaction is built in _jnlBuffer behind
+// room for its TJournalTxn, with the offset of each record in _jnlRecords.
+// Committed transactions are appended at _jnlHead; the space before it is
+// reclaimed by a checkpoint when the journal fills.
+int _jnlEnabled = 0;
+unsigned long _jnlStart = 0, _jnlEnd = 0; // Journal region in the partition
+unsigned long _jnlHead = 0; // Where the next transaction goes
+unsigned long _jnlSeq = 1; // Sequence number of the next transaction
+char *_jnlBuffer = NULL;
+unsigned long _jnlLen = 0, _jnlCap = 0;
+unsigned long *_jnlRecords = NULL;
+unsigned long _jnlCount = 0, _jnlRecordCap = 0;
+int _jnlOps = 0; // Operations open in the running transaction
+int _jnlCommitting = 0; // Set while a commit waits for operations to end
+int _jnlStop = 0;
+pthread_t _jnlThread;
+pthread_mutex_t _jnlLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _jnlKick = PTHREAD_COND_INITIALIZER; // Wakes the commit thread
+pthread_cond_t _jnlIdle = PTHREAD_COND_INITIALIZER; // Signalled as operations end and commits finish
 
-char _password[MAX_PWD_LEN];
-char *_encBuffer = NULL;
+// Blocks freed while the journal is on stay out of the allocator, flagged
+// in _freePending, until the transaction that freed them has committed.
+// Otherwise a block could be reused and overwritten while the committed
+// metadata still points at it. The runs freed in the running transaction
+// are in _jnlFreed; once it commits they move to _jnlReleased for
+// reclaimFreedBlocks, which also queues the ones to be scrubbed. Both
+// lists are guarded by _jnlLock.
+typedef struct freedRun
+{
+  unsigned long startBlock; // First block of the run
+  unsigned long count; // Blocks in the run
+  int scrub; // Set if the blocks are zeroed once the free commits
+} TFreedRun;
+
+unsigned char *_freePending = NULL;
+TFreedRun *_jnlFreed = NULL, *_jnlReleased = NULL;
+unsigned long _jnlFreedCount = 0, _jnlFreedCap = 0;
+unsigned long _jnlReleasedCount = 0, _jnlReleasedCap = 0;
+
+// Depth of the operations this thread has open
+thread_local int _jnlDepth = 0;
+
+// Deferred scrubbing. Freed blocks waiting to be zeroed are flagged in
+// _scrubPending, one bit per block, and zeroed in runs by the scrub
+// thread, which holds _scrubLock while it writes.
+int _scrubPolicy = SCRUB_DEFERRED;
+unsigned char *_scrubPending = NULL;
+unsigned long _scrubCount = 0; // Blocks flagged
+unsigned long _scrubCursor = 1; // Block the next run search starts at
+int _scrubStop = 0;
+pthread_t _scrubThread;
+pthread_mutex_t _scrubLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _scrubWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t _scrubIdle = PTHREAD_COND_INITIALIZER; // Signalled when nothing is left flagged
 
-unsigned long _result;
+thread_local unsigned long _result;
 
 /*
    Private File System functions to load various structures like the file system parameters (descriptor),
@@ -30,433 +254,3848 @@ void encdec(char *targetBuffer, const char *message, unsigned int len, const cha
   }
 }
 
-// Load file system parameters.
+// Encrypt/decrypt len bytes from the start of a block using the keystream.
+// Produces the same bytes as encdec with the mount password, a vector at a time.
+void encdecBlock(char *targetBuffer, const char *message, unsigned int len)
+{
+  unsigned int i = 0;
 
-void loadFSDescriptor()
+#ifdef __AVX2__
+  for(; i + 32 <= len; i += 32)
+  {
+    __m256i data = _mm256_loadu_si256((const __m256i *) (message + i));
+    __m256i key = _mm256_loadu_si256((const __m256i *) (_keyStream + i));
+    _mm256_storeu_si256((__m256i *) (targetBuffer + i), _mm256_xor_si256(data, key));
+  }
+#endif
+
+#ifdef __SSE2__
+  for(; i + 16 <= len; i += 16)
+  {
+    __m128i data = _mm_loadu_si128((const __m128i *) (message + i));
+    __m128i key = _mm_loadu_si128((const __m128i *) (_keyStream + i));
+    _mm_storeu_si128((__m128i *) (targetBuffer + i), _mm_xor_si128(data, key));
+  }
+#endif
+
+  for(; i + 8 <= len; i += 8)
+  {
+    unsigned long long data, key;
+    memcpy(&data, message + i, 8);
+    memcpy(&key, _keyStream + i, 8);
+    data ^= key;
+    memcpy(targetBuffer + i, &data, 8);
+  }
+
+  for(; i < len; i++)
+    targetBuffer[i] = message[i] ^ _keyStream[i];
+}
+
+// Expand the password into the keystream used by encdecBlock. Byte i of the
+// stream is the key byte encdec would use at offset i of a block.
+void buildKeyStream()
 {
-  // Seek to start
-  fseek(_fsfp, 0, SEEK_SET);
-  fread(&_fsDescriptor, sizeof(TFileSystemStruct), 1, _fsfp);
+  unsigned int keyLen = strlen(_password);
+
+  if(_keyStream == NULL)
+    _keyStream = (char *) calloc(sizeof(char), _fsDescriptor.blockSize);
+
+  if(keyLen == 0)
+    return;
+
+  _keyStream[0] = _password[0];
+  for(unsigned int i=1; i<_fsDescriptor.blockSize; i++)
+    _keyStream[i] = _password[(i - 1) % keyLen];
 }
 
-// Load directory
-void loadDirectory()
+/*
+   LZ compression. The output is a series of sequences, each a token byte,
+   a run of literal bytes and a match copied from earlier output. The high
+   nibble of the token is the literal count and the low nibble the match
+   length less LZ_MIN_MATCH; a nibble of 15 is followed by more length
+   bytes, ending at the first one below 255. A match is a two byte offset
+   back into the output. The last sequence has literals only.
+*/
+
+// Hash of the four bytes at p, for the match table
+unsigned int lzHash(const unsigned char *p)
 {
-  // Seek to the right place
-  fseek(_fsfp, _fsDescriptor.dirByteIndex, SEEK_SET);
+  unsigned int word;
+
+  memcpy(&word, p, 4);
+  return (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
 
-  if(_directory == NULL)
-    _directory = (TDirectory *) calloc(sizeof(TDirectory), _fsDescriptor.maxFiles);
+// Append the extra length bytes for a nibble of 15
+unsigned long lzPutLength(unsigned char *out, unsigned long op, unsigned long len)
+{
+  for(; len >= 255; len -= 255)
+    out[op++] = 255;
 
-  fread(_directory, sizeof(TDirectory), _fsDescriptor.maxFiles, _fsfp);
+  out[op++] = len;
+  return op;
 }
 
-// Write directory
-void storeDirectory()
+// Add the extra length bytes that follow a nibble of 15 to len. Returns -1
+// if the input ends first.
+int lzGetLength(const unsigned char *in, unsigned long inLen, unsigned long *ip, unsigned long *len)
 {
-  // Seek to directory place
-  fseek(_fsfp, _fsDescriptor.dirByteIndex, SEEK_SET);
-  fwrite(_directory, sizeof(TDirectory), _fsDescriptor.maxFiles, _fsfp);
+  unsigned char byte;
+
+  do
+  {
+    if(*ip >= inLen)
+      return -1;
+
+    byte = in[(*ip)++];
+    *len += byte;
+  } while(byte == 255);
+
+  return 0;
 }
 
-// Load free list bitmap
-void loadBitmap()
-{ 
-  fseek(_fsfp, _fsDescriptor.bitmapByteIndex, SEEK_SET);
+// Append a sequence of litLen literals followed, if matchLen is nonzero, by
+// a match. Returns 0 if it does not fit in outLen bytes.
+int lzEmit(unsigned char *out, unsigned long *op, unsigned long outLen, const unsigned char *literals,
+           unsigned long litLen, unsigned long offset, unsigned long matchLen)
+{
+  unsigned long matchCode = (matchLen != 0 ? matchLen - LZ_MIN_MATCH : 0);
+
+  // the most a sequence this long can take
+  if(*op + 1 + litLen / 255 + 1 + litLen + 2 + matchCode / 255 + 1 > outLen)
+    return 0;
+
+  out[*op] = (litLen < 15 ? litLen : 15) << 4 | (matchCode < 15 ? matchCode : 15);
+  (*op)++;
 
-  if(_bitmap == NULL)
+  if(litLen >= 15)
+    *op = lzPutLength(out, *op, litLen - 15);
+
+  memcpy(out + *op, literals, litLen);
+  *op += litLen;
+
+  if(matchLen != 0)
   {
-    _bitmap = (char *) calloc(sizeof(char), _fsDescriptor.bitmapLen);
+    out[(*op)++] = offset & 0xff;
+    out[(*op)++] = offset >> 8;
 
-    if(_bitmap == NULL)
-      printf("Bitmap allocation failed\n");
+    if(matchCode >= 15)
+      *op = lzPutLength(out, *op, matchCode - 15);
   }
 
-  fread(_bitmap, sizeof(char), _fsDescriptor.bitmapLen, _fsfp);
+  return 1;
 }
 
-// Store free list bitmap
-void storeBitmap()
+// Compress len bytes of src into dst. Returns the compressed length, or 0 if
+// it does not fit in dstLen bytes.
+unsigned long compressData(const char *src, unsigned long len, char *dst, unsigned long dstLen)
 {
-  fseek(_fsfp, _fsDescriptor.bitmapByteIndex, SEEK_SET);
-  fwrite(_bitmap, sizeof(char), _fsDescriptor.bitmapLen, _fsfp);
+  const unsigned char *in = (const unsigned char *) src;
+  unsigned char *out = (unsigned char *) dst;
+  unsigned int table[1 << LZ_HASH_BITS];
+  unsigned long ip = 0, anchor = 0, op = 0;
+
+  memset(table, 0, sizeof(table));
+
+  while(ip + LZ_MIN_MATCH <= len)
+  {
+    unsigned int h = lzHash(in + ip);
+    unsigned long ref = table[h];
+
+    table[h] = ip;
+
+    if(ref >= ip || ip - ref > 0xffff || memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0)
+    {
+      // step faster through data that is not matching
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    unsigned long matchLen = LZ_MIN_MATCH;
+    while(ip + matchLen < len && in[ref + matchLen] == in[ip + matchLen])
+      matchLen++;
+
+    if(!lzEmit(out, &op, dstLen, in + anchor, ip - anchor, ip - ref, matchLen))
+      return 0;
+
+    ip += matchLen;
+    anchor = ip;
+  }
+
+  if(!lzEmit(out, &op, dstLen, in + anchor, len - anchor, 0, 0))
+    return 0;
+
+  return op;
 }
 
-// Calculate byte offset for a particular block number
-unsigned long locateDataBlock(unsigned long blockNum)
+// Decompress len bytes of src into dst. Returns the decompressed length, or
+// -1 if the data is damaged or more than dstLen bytes long.
+long decompressData(const char *src, unsigned long len, char *dst, unsigned long dstLen)
 {
-  return _fsDescriptor.dataByteIndex + blockNum * _fsDescriptor.blockSize;
-}
+  const unsigned char *in = (const unsigned char *) src;
+  unsigned char *out = (unsigned char *) dst;
+  unsigned long ip = 0, op = 0;
 
+  while(ip < len)
+  {
+    unsigned char token = in[ip++];
+    unsigned long litLen = token >> 4;
 
-/*
+    if(litLen == 15 && lzGetLength(in, len, &ip, &litLen) != 0)
+      return -1;
 
-   Public routines: Use these routines to implement your libraries
+    if(litLen > len - ip || litLen > dstLen - op)
+      return -1;
 
-   */
+    memcpy(out + op, in + ip, litLen);
+    ip += litLen;
+    op += litLen;
 
-/* 
+    // the last sequence has no match
+    if(ip == len)
+      break;
 
-   Mount and unmount file system
+    if(len - ip < 2)
+      return -1;
 
-   */
+    unsigned long offset = in[ip] | (in[ip + 1] << 8);
+    unsigned long matchLen = token & 15;
+    ip += 2;
 
-// Mount the file system. File system is stored on disk in "filename"
-void mountFS(const char *filename, const char *password)
-{
-  _directory=NULL;
-  _bitmap=NULL;
-  _result = FS_OK;
-  _encBuffer=NULL;
+    if(matchLen == 15 && lzGetLength(in, len, &ip, &matchLen) != 0)
+      return -1;
 
-  strncpy(_password, password, MAX_PWD_LEN);
+    matchLen += LZ_MIN_MATCH;
 
-  _fsfp = fopen(filename, "r+");
+    if(offset == 0 || offset > op || matchLen > dstLen - op)
+      return -1;
 
-  if(!_fsfp)
-  {
-    fprintf(stderr, "Unable to open partition file.\n");
-    _result = FS_ERROR;
-    exit(-1);
+    // a match may overlap the bytes it produces
+    if(offset >= matchLen)
+      memcpy(out + op, out + op - offset, matchLen);
+    else
+      for(unsigned long i=0; i<matchLen; i++)
+        out[op + i] = out[op + i - offset];
+
+    op += matchLen;
   }
 
-  // Load descriptor
-  loadFSDescriptor();
+  return op;
+}
 
-  if(_encBuffer == NULL)
-    _encBuffer = (char *) calloc(sizeof(char), _fsDescriptor.blockSize);
+/*
+   Positional I/O on the partition file. No file offset is shared between
+   calls, so each transfer is a single system call with no seek.
+*/
 
-  // Load directory
-  loadDirectory();
+// Read len bytes at byteIndex. Anything past the end of the partition file
+// reads as zeros. Returns 0, or -1 with _result FS_ERROR if the read fails.
+int devRead(void *buffer, unsigned long len, unsigned long byteIndex)
+{
+  char *ptr = (char *) buffer;
 
+  while(len > 0)
+  {
+    ssize_t count = pread(_fsfd, ptr, len, byteIndex);
 
-  // load bitmap
-  loadBitmap();
+    if(count < 0 && errno == EINTR)
+      continue;
 
-  _result = FS_OK;
+    if(count < 0)
+    {
+      _result = FS_ERROR;
+      return -1;
+    }
+
+    if(count == 0)
+    {
+      memset(ptr, 0, len);
+      return 0;
+    }
+
+    ptr += count;
+    byteIndex += count;
+    len -= count;
+  }
+
+  return 0;
 }
 
-// Unmount the file system
-void unmountFS()
+// Write len bytes at byteIndex. Returns 0, or -1 with _result FS_ERROR if
+// the write fails.
+int devWrite(const void *buffer, unsigned long len, unsigned long byteIndex)
 {
-  storeDirectory();
-  storeBitmap();
-  fclose(_fsfp);
+  const char *ptr = (const char *) buffer;
 
-  if(_directory != NULL)
+  while(len > 0)
   {
-    free(_directory);
-    _directory = NULL;
+    ssize_t count = pwrite(_fsfd, ptr, len, byteIndex);
+
+    if(count < 0 && errno == EINTR)
+      continue;
+
+    if(count <= 0)
+    {
+      _result = FS_ERROR;
+      return -1;
+    }
+
+    ptr += count;
+    byteIndex += count;
+    len -= count;
   }
 
-  if(_bitmap != NULL)
+  return 0;
+}
+
+// Load file system parameters.
+
+void loadFSDescriptor()
+{
+  devRead(&_fsDescriptor, sizeof(TFileSystemStruct), 0);
+}
+
+// Check that the descriptor names an inode format this code can read
+int knownInodeFormat()
+{
+  return _fsDescriptor.inodeFormat == INODE_DIRECT || _fsDescriptor.inodeFormat == INODE_BLOCKMAP ||
+      _fsDescriptor.inodeFormat == INODE_BLOCKMAP_LZ || _fsDescriptor.inodeFormat == INODE_EXTENT;
+}
+
+// Calculate byte offset for a particular block number
+unsigned long locateDataBlock(unsigned long blockNum)
+{
+  return _fsDescriptor.dataByteIndex + blockNum * _fsDescriptor.blockSize;
+}
+
+// Map the whole partition file into memory. The file is extended if the
+// last data block would lie past its end.
+int mapPartition()
+{
+  struct stat st;
+
+  if(fstat(_fsfd, &st) != 0)
+    return -1;
+
+  _fsMapLen = locateDataBlock(_fsDescriptor.numBlocks);
+
+  if((unsigned long) st.st_size < _fsMapLen)
   {
-    free(_bitmap);
-    _bitmap = NULL;
+    if(ftruncate(_fsfd, _fsMapLen) != 0)
+      return -1;
   }
+  else
+    _fsMapLen = st.st_size;
 
-  if(_encBuffer != NULL)
+  _fsMap = (char *) mmap(NULL, _fsMapLen, PROT_READ | PROT_WRITE, MAP_SHARED, _fsfd, 0);
+
+  if(_fsMap == MAP_FAILED)
   {
-    free(_encBuffer);
-    _encBuffer = NULL;
+    _fsMap = NULL;
+    return -1;
   }
+
+  return 0;
 }
 
-// Return FS information
-TFileSystemStruct *getFSInfo()
+// Write back a byte range of the mapped partition
+void syncMappedRange(unsigned long byteIndex, unsigned long len)
 {
-  return &_fsDescriptor;
+  unsigned long pageSize = sysconf(_SC_PAGESIZE);
+  unsigned long start = byteIndex - byteIndex % pageSize;
+
+  msync(_fsMap + start, byteIndex + len - start, MS_SYNC);
 }
+
 /*
 
-   Directory Management
+   Deferred scrubbing
 
-   */
+*/
 
+int scrubFlagged(unsigned long blockNum)
+{
+  return (__atomic_load_n(&_scrubPending[(blockNum - 1) / 8], __ATOMIC_RELAXED) & (0x80 >> ((blockNum - 1) % 8))) != 0;
+}
 
-// Return index to next free directory entry
-unsigned int getFreeDirectory()
+// Flag or clear a block. Called with _scrubLock held.
+void setScrubFlag(unsigned long blockNum, int flag)
 {
-  unsigned int i;
+  unsigned char mask = 0x80 >> ((blockNum - 1) % 8);
 
-  for(i=0; i<_fsDescriptor.maxFiles; i++)
-    if(!(_directory[i].attr & 0b1))
-    {
-      _result = FS_OK;
-      return i;
-    }
+  if(flag && !scrubFlagged(blockNum))
+  {
+    _scrubPending[(blockNum - 1) / 8] |= mask;
+    _scrubCount++;
+  }
+  else if(!flag && scrubFlagged(blockNum))
+  {
+    _scrubPending[(blockNum - 1) / 8] &= ~mask;
+    if(--_scrubCount == 0)
+      pthread_cond_broadcast(&_scrubIdle);
+  }
+}
 
-  _result = FS_DIR_FULL;
-  return FS_DIR_FULL;
+// Queue a run of freed blocks to be zeroed
+void deferScrub(unsigned long startBlock, unsigned long count)
+{
+  pthread_mutex_lock(&_scrubLock);
+  for(unsigned long i=0; i<count; i++)
+    setScrubFlag(startBlock + i, 1);
+  pthread_cond_signal(&_scrubWork);
+  pthread_mutex_unlock(&_scrubLock);
 }
 
-// Get length of file
-unsigned long getFileLength(const char *filename)
+// Take a block that is being allocated off the scrub list. If it is being
+// zeroed, wait for that to finish so the zeros cannot land on new data.
+void cancelScrub(unsigned long blockNum)
 {
-	unsigned int ndx = findFile(filename);
-	if(ndx != FS_FILE_NOT_FOUND)
-	{
-		_result = FS_OK;
-		return _directory[ndx].length;
-	}
-	
-	_result = ndx;
-	return -1;
+  if(_scrubPending == NULL || !scrubFlagged(blockNum))
+    return;
+
+  pthread_mutex_lock(&_scrubLock);
+  setScrubFlag(blockNum, 0);
+  pthread_mutex_unlock(&_scrubLock);
 }
 
-// Get inode for filename
-unsigned long getInodeForFile(const char *filename)
+// Find the next run of flagged blocks, up to SCRUB_RUN_BLOCKS long, from
+// the cursor onwards. Called with _scrubLock held and _scrubCount nonzero.
+unsigned long nextScrubRun(unsigned long *runLen)
 {
-  unsigned int ndx = findFile(filename);
+  unsigned long numBlocks = _fsDescriptor.numBlocks;
+  unsigned long blockNum = _scrubCursor;
 
-  if(ndx != FS_FILE_NOT_FOUND)
+  while(!scrubFlagged(blockNum))
   {
-    _result = FS_OK;
-    return _directory[ndx].inode;
+    // whole bytes with nothing flagged are skipped
+    if((blockNum - 1) % 8 == 0 && _scrubPending[(blockNum - 1) / 8] == 0)
+      blockNum += 8;
+    else
+      blockNum++;
+
+    if(blockNum > numBlocks)
+      blockNum = 1;
   }
 
-  _result = FS_FILE_NOT_FOUND;
-  return _result;
+  *runLen = 1;
+  while(*runLen < SCRUB_RUN_BLOCKS && blockNum + *runLen <= numBlocks && scrubFlagged(blockNum + *runLen))
+    (*runLen)++;
+
+  return blockNum;
 }
 
-// Make new directory entry
-unsigned int makeDirectoryEntry(const char *filename, unsigned int attr, unsigned long len)
+// Scrub thread. Zeroes flagged blocks a run at a time until stopped with
+// nothing left to do.
+void *scrubThread(void *arg)
 {
-  unsigned int ndx = findFile(filename);
+  char *zeroRun = (char *) calloc(SCRUB_RUN_BLOCKS, _fsDescriptor.blockSize);
 
-  if(ndx != FS_FILE_NOT_FOUND)
+  pthread_mutex_lock(&_scrubLock);
+  while(1)
   {
-    _result = FS_DUPLICATE_FILE;
-    return _result;
-  }
+    while(_scrubCount == 0 && !_scrubStop)
+      pthread_cond_wait(&_scrubWork, &_scrubLock);
 
-  ndx = getFreeDirectory();
-  if(ndx != FS_DIR_FULL)
-  {
-    strncpy(_directory[ndx].filename, filename, MAX_FNAME_LEN);
+    if(_scrubCount == 0)
+      break;
 
-    // Mark directory entry as taken
-    _directory[ndx].attr = attr |= 0b1;
-    _directory[ndx].length=len;
-    _directory[ndx].inode = ndx;
-    _result = FS_OK;
+    unsigned long runLen;
+    unsigned long startBlock = nextScrubRun(&runLen);
+
+    writeBlockRun(zeroRun, startBlock, runLen);
+
+    for(unsigned long i=0; i<runLen; i++)
+      setScrubFlag(startBlock + i, 0);
+    _scrubCursor = (startBlock + runLen > _fsDescriptor.numBlocks ? 1 : startBlock + runLen);
   }
+  pthread_mutex_unlock(&_scrubLock);
 
-  return ndx;
+  free(zeroRun);
+  return NULL;
 }
 
-// Modify directory entry
-unsigned int updateDirectoryFileLength(const char *filename, unsigned long len)
+// Set up the scrub list and start the scrub thread
+void startScrubber()
 {
-  unsigned int ndx = findFile(filename);
+  const char *policy = getenv("EFS_SCRUB");
 
-  if(ndx != FS_FILE_NOT_FOUND)
-    _directory[ndx].length = len;
+  _scrubPolicy = SCRUB_DEFERRED;
+  if(policy != NULL && !strcmp(policy, "immediate"))
+    _scrubPolicy = SCRUB_IMMEDIATE;
+  else if(policy != NULL && !strcmp(policy, "none"))
+    _scrubPolicy = SCRUB_NONE;
 
-  return ndx;
+  _scrubPending = (unsigned char *) calloc(sizeof(char), _fsDescriptor.numBlocks / 8 + 1);
+  _scrubCount = 0;
+  _scrubCursor = 1;
+  _scrubStop = 0;
+  pthread_create(&_scrubThread, NULL, scrubThread, NULL);
 }
 
-// Remove directory entry
-unsigned int delDirectoryEntry(const char *filename)
+// Choose how freed blocks are scrubbed
+void setScrubPolicy(int policy)
 {
-  unsigned int ndx = findFile(filename);
+  _scrubPolicy = policy;
+}
 
-  if(ndx != FS_FILE_NOT_FOUND)
-  {
-    strcpy(_directory[ndx].filename, "nofile.dat");
-    _directory[ndx].attr &= ~0b1;
-  }
+// Under SCRUB_IMMEDIATE with the journal on, commit the blocks just freed
+// and wait until everything queued has been zeroed
+void waitForScrub()
+{
+  if(_scrubPolicy != SCRUB_IMMEDIATE || !_jnlEnabled)
+    return;
 
-  return ndx;
+  commitJournal();
+
+  // the commit thread may be queueing them; it holds the metadata lock
+  // while it does
+  lockMetadata(1);
+  unlockMetadata();
+
+  pthread_mutex_lock(&_scrubLock);
+  while(_scrubCount > 0)
+    pthread_cond_wait(&_scrubIdle, &_scrubLock);
+  pthread_mutex_unlock(&_scrubLock);
+}
+
+// Zero the blocks still queued and stop the scrub thread
+void stopScrubber()
+{
+  pthread_mutex_lock(&_scrubLock);
+  _scrubStop = 1;
+  pthread_cond_signal(&_scrubWork);
+  pthread_mutex_unlock(&_scrubLock);
+
+  pthread_join(_scrubThread, NULL);
+  free(_scrubPending);
+  _scrubPending = NULL;
+}
+
+/*
+
+   Metadata journal
+
+*/
+
+// Checksum len bytes, a multiple of 8
+unsigned long journalChecksum(const char *data, unsigned long len)
+{
+  unsigned long hash = 14695981039346656037UL;
+  const unsigned long *words = (const unsigned long *) data;
+
+  for(unsigned long i=0; i<len / sizeof(unsigned long); i++)
+    hash = (hash ^ words[i]) * 1099511628211UL;
+
+  return hash;
+}
+
+// Bytes a record takes up in a transaction
+unsigned long journalRecordSize(TJournalRecord *rec)
+{
+  if(rec->type == JOURNAL_REVOKE)
+    return sizeof(TJournalRecord);
+
+  return sizeof(TJournalRecord) + ((rec->len + 7) & ~7UL);
+}
+
+// Record at position i of the running transaction
+TJournalRecord *journalRecord(unsigned long i)
+{
+  return (TJournalRecord *) (_jnlBuffer + _jnlRecords[i]);
+}
+
+int rangesOverlap(unsigned long start1, unsigned long len1, unsigned long start2, unsigned long len2)
+{
+  return start1 < start2 + len2 && start2 < start1 + len1;
+}
+
+// Bytes of transactions the journal holds after a checkpoint
+unsigned long journalCapacity()
+{
+  return _jnlEnd - _jnlStart - _fsDescriptor.blockSize;
+}
+
+// Size at which the running transaction is committed as soon as its
+// operations end. Keeping it to half the journal leaves room for the
+// operations still open to finish.
+unsigned long journalCommitBytes()
+{
+  return journalCapacity() / 2 < JOURNAL_COMMIT_BYTES ? journalCapacity() / 2 : JOURNAL_COMMIT_BYTES;
+}
+
+// Add a run of blocks to a list of freed runs, extending the last run if
+// it ends where this one starts and is scrubbed alike
+void addFreedRun(TFreedRun **runs, unsigned long *count, unsigned long *cap, unsigned long startBlock, unsigned long len, int scrub)
+{
+  if(*count > 0 && (*runs)[*count - 1].startBlock + (*runs)[*count - 1].count == startBlock &&
+      (*runs)[*count - 1].scrub == scrub)
+  {
+    (*runs)[*count - 1].count += len;
+    return;
+  }
+
+  if(*count == *cap)
+  {
+    *cap = (*cap == 0 ? 64 : *cap * 2);
+    *runs = (TFreedRun *) realloc(*runs, sizeof(TFreedRun) * *cap);
+  }
+
+  (*runs)[*count].startBlock = startBlock;
+  (*runs)[*count].count = len;
+  (*runs)[*count].scrub = scrub;
+  (*count)++;
+}
+
+// Append a record with room for len bytes of data to the running
+// transaction. Called with _jnlLock held.
+TJournalRecord *appendJournalRecord(unsigned long type, unsigned long byteIndex, unsigned long len)
+{
+  TJournalRecord header = {type, byteIndex, len};
+  unsigned long size = journalRecordSize(&header);
+
+  if(_jnlLen + size > _jnlCap)
+  {
+    while(_jnlLen + size > _jnlCap)
+      _jnlCap *= 2;
+    _jnlBuffer = (char *) realloc(_jnlBuffer, _jnlCap);
+  }
+
+  if(_jnlCount == _jnlRecordCap)
+  {
+    _jnlRecordCap *= 2;
+    _jnlRecords = (unsigned long *) realloc(_jnlRecords, sizeof(unsigned long) * _jnlRecordCap);
+  }
+
+  TJournalRecord *rec = (TJournalRecord *) (_jnlBuffer + _jnlLen);
+  memset(rec, 0, size);
+  *rec = header;
+  _jnlRecords[_jnlCount++] = _jnlLen;
+  _jnlLen += size;
+
+  return rec;
+}
+
+// Log len bytes bound for byteIndex. A write of the same range that is the
+// latest record touching it is overwritten in place.
+void journalWrite(const void *buffer, unsigned long len, unsigned long byteIndex)
+{
+  pthread_mutex_lock(&_jnlLock);
+
+  TJournalRecord *rec = NULL;
+  for(unsigned long i=_jnlCount; i-- > 0; )
+  {
+    TJournalRecord *old = journalRecord(i);
+
+    if(!rangesOverlap(old->byteIndex, old->len, byteIndex, len))
+      continue;
+
+    if(old->type == JOURNAL_WRITE && old->byteIndex == byteIndex && old->len == len)
+      rec = old;
+    break;
+  }
+
+  if(rec == NULL)
+    rec = appendJournalRecord(JOURNAL_WRITE, byteIndex, len);
+
+  memcpy(rec + 1, buffer, len);
+
+  if(_jnlLen > journalCommitBytes())
+    pthread_cond_signal(&_jnlKick);
+
+  pthread_mutex_unlock(&_jnlLock);
+}
+
+// Write metadata to the partition, through the journal if there is one
+void metaWrite(const void *buffer, unsigned long len, unsigned long byteIndex)
+{
+  if(_jnlEnabled)
+    journalWrite(buffer, len, byteIndex);
+  else
+    devWrite(buffer, len, byteIndex);
+}
+
+// Stop earlier writes to a range that is being freed from reaching it,
+// now or on replay
+void journalRevoke(unsigned long byteIndex, unsigned long len)
+{
+  if(!_jnlEnabled)
+    return;
+
+  pthread_mutex_lock(&_jnlLock);
+  for(unsigned long i=0; i<_jnlCount; i++)
+  {
+    TJournalRecord *rec = journalRecord(i);
+
+    if(rec->type == JOURNAL_WRITE && rangesOverlap(rec->byteIndex, rec->len, byteIndex, len))
+      rec->type = JOURNAL_DEAD;
+  }
+  appendJournalRecord(JOURNAL_REVOKE, byteIndex, len);
+  pthread_mutex_unlock(&_jnlLock);
+}
+
+// Bring len bytes read from byteIndex up to date with the writes logged in
+// the running transaction
+void journalOverlay(void *buffer, unsigned long len, unsigned long byteIndex)
+{
+  if(!_jnlEnabled)
+    return;
+
+  pthread_mutex_lock(&_jnlLock);
+  for(unsigned long i=0; i<_jnlCount; i++)
+  {
+    TJournalRecord *rec = journalRecord(i);
+
+    if(rec->type != JOURNAL_WRITE || !rangesOverlap(rec->byteIndex, rec->len, byteIndex, len))
+      continue;
+
+    unsigned long start = rec->byteIndex > byteIndex ? rec->byteIndex : byteIndex;
+    unsigned long end = rec->byteIndex + rec->len < byteIndex + len ? rec->byteIndex + rec->len : byteIndex + len;
+
+    memcpy((char *) buffer + (start - byteIndex), (char *) (rec + 1) + (start - rec->byteIndex), end - start);
+  }
+  pthread_mutex_unlock(&_jnlLock);
+}
+
+// Make every committed transaction's home writes durable and start the
+// journal afresh
+void checkpointJournal()
+{
+  TJournalHeader header = {JOURNAL_MAGIC, _jnlSeq};
+
+  fdatasync(_fsfd);
+  devWrite(&header, sizeof(header), _jnlStart);
+  fdatasync(_fsfd);
+
+  _jnlHead = _jnlStart + _fsDescriptor.blockSize;
+}
+
+// Write a transaction of len bytes, its TJournalTxn included, to the
+// journal and then to its home locations. len must not be more than
+// journalCapacity. Called with _jnlLock held.
+void logTransaction(char *buffer, unsigned long len)
+{
+  TJournalTxn *txn = (TJournalTxn *) buffer;
+  txn->magic = JOURNAL_TXN_MAGIC;
+  txn->seq = _jnlSeq;
+  txn->len = len;
+  txn->checksum = journalChecksum(buffer + sizeof(TJournalTxn), len - sizeof(TJournalTxn));
+
+  if(_jnlHead + len > _jnlEnd)
+    checkpointJournal();
+
+  devWrite(buffer, len, _jnlHead);
+  fdatasync(_fsfd);
+  _jnlHead += len;
+  _jnlSeq++;
+
+  // Home writes need no sync; the journal holds them until a checkpoint
+  for(unsigned long off = sizeof(TJournalTxn); off < len; )
+  {
+    TJournalRecord *rec = (TJournalRecord *) (buffer + off);
+    off += journalRecordSize(rec);
+
+    if(rec->type == JOURNAL_WRITE)
+      devWrite(rec + 1, rec->len, rec->byteIndex);
+  }
+}
+
+// Write a running transaction larger than the journal as a series of
+// transactions that fit, cutting writes where they must be. Each of them
+// commits as a whole, but the series does not. Transactions are committed
+// once they pass half the journal, so only an operation that logs more
+// than the whole journal by itself ends up here. Called with _jnlLock held.
+void splitTransaction()
+{
+  unsigned long capacity = journalCapacity();
+  char *part = (char *) calloc(sizeof(char), capacity);
+  unsigned long partLen = sizeof(TJournalTxn);
+
+  for(unsigned long i=0; i<_jnlCount; i++)
+  {
+    TJournalRecord *rec = journalRecord(i);
+    unsigned long done = 0;
+
+    if(rec->type == JOURNAL_DEAD)
+      continue;
+
+    do
+    {
+      // a record needs its header and at least a word of data
+      if(partLen + sizeof(TJournalRecord) + 8 > capacity)
+      {
+        logTransaction(part, partLen);
+        memset(part, 0, capacity);
+        partLen = sizeof(TJournalTxn);
+      }
+
+      TJournalRecord *piece = (TJournalRecord *) (part + partLen);
+      *piece = *rec;
+
+      if(rec->type == JOURNAL_WRITE)
+      {
+        unsigned long room = (capacity - partLen - sizeof(TJournalRecord)) & ~7UL;
+
+        piece->byteIndex = rec->byteIndex + done;
+        piece->len = (rec->len - done < room ? rec->len - done : room);
+        memcpy(piece + 1, (char *) (rec + 1) + done, piece->len);
+        done += piece->len;
+      }
+
+      partLen += journalRecordSize(piece);
+    } while(rec->type == JOURNAL_WRITE && done < rec->len);
+  }
+
+  if(partLen > sizeof(TJournalTxn))
+    logTransaction(part, partLen);
+
+  free(part);
+}
+
+// Write the running transaction to the journal, then to its home
+// locations, and hand the blocks it freed to reclaimFreedBlocks. Called
+// with _jnlLock held and no operations open.
+void writeTransaction()
+{
+  if(_jnlCount == 0)
+    return;
+
+  if(_jnlLen <= journalCapacity())
+    logTransaction(_jnlBuffer, _jnlLen);
+  else
+    splitTransaction();
+
+  _jnlLen = sizeof(TJournalTxn);
+  _jnlCount = 0;
+
+  // the frees are durable now
+  for(unsigned long i=0; i<_jnlFreedCount; i++)
+    addFreedRun(&_jnlReleased, &_jnlReleasedCount, &_jnlReleasedCap, _jnlFreed[i].startBlock, _jnlFreed[i].count,
+        _jnlFreed[i].scrub);
+  _jnlFreedCount = 0;
+}
+
+// Return non-zero if a block is free but waiting for a commit
+int freePending(unsigned long blockNum)
+{
+  return _freePending != NULL && (_freePending[(blockNum - 1) / 8] & (0x80 >> ((blockNum - 1) % 8))) != 0;
+}
+
+// Flag or clear a block freed in a transaction that has not committed.
+// Called with the metadata lock held exclusively.
+void setFreePending(unsigned long blockNum, int flag)
+{
+  unsigned char mask = 0x80 >> ((blockNum - 1) % 8);
+
+  if(flag)
+    _freePending[(blockNum - 1) / 8] |= mask;
+  else
+    _freePending[(blockNum - 1) / 8] &= ~mask;
+}
+
+// Note a block freed in the running transaction, to be zeroed once the
+// transaction commits if scrub is set. Called with the metadata lock held
+// exclusively.
+void deferFree(unsigned long blockNum, int scrub)
+{
+  setFreePending(blockNum, 1);
+
+  pthread_mutex_lock(&_jnlLock);
+  addFreedRun(&_jnlFreed, &_jnlFreedCount, &_jnlFreedCap, blockNum, 1, scrub);
+  pthread_mutex_unlock(&_jnlLock);
+}
+
+// Give the blocks freed by committed transactions to the allocator and
+// queue those to be scrubbed. Blocks allocated again in the meantime are
+// no longer flagged and are skipped. Called with no lock held.
+void reclaimFreedBlocks()
+{
+  pthread_mutex_lock(&_jnlLock);
+  unsigned long waiting = _jnlReleasedCount;
+  pthread_mutex_unlock(&_jnlLock);
+
+  if(waiting == 0)
+    return;
+
+  lockMetadata(1);
+  pthread_mutex_lock(&_jnlLock);
+  TFreedRun *runs = _jnlReleased;
+  unsigned long count = _jnlReleasedCount;
+  _jnlReleased = NULL;
+  _jnlReleasedCount = _jnlReleasedCap = 0;
+  pthread_mutex_unlock(&_jnlLock);
+
+  for(unsigned long i=0; i<count; i++)
+    for(unsigned long j=0; j<runs[i].count; j++)
+      if(freePending(runs[i].startBlock + j))
+      {
+        setFreePending(runs[i].startBlock + j, 0);
+        _freeBlockCount++;
+
+        if(runs[i].scrub)
+          deferScrub(runs[i].startBlock + j, 1);
+      }
+  unlockMetadata();
+
+  free(runs);
+}
+
+// Commit the running transaction. Called with _jnlLock held.
+void commitTransaction()
+{
+  while(_jnlCommitting)
+    pthread_cond_wait(&_jnlIdle, &_jnlLock);
+
+  if(_jnlCount == 0)
+    return;
+
+  // keep new operations out until the open ones end
+  _jnlCommitting = 1;
+  while(_jnlOps > 0)
+    pthread_cond_wait(&_jnlIdle, &_jnlLock);
+
+  writeTransaction();
+
+  _jnlCommitting = 0;
+  pthread_cond_broadcast(&_jnlIdle);
+}
+
+// Commit thread. Commits the running transaction every JOURNAL_COMMIT_MS,
+// or sooner once it passes JOURNAL_COMMIT_BYTES.
+void *journalThread(void *arg)
+{
+  pthread_mutex_lock(&_jnlLock);
+
+  while(!_jnlStop)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    while(!_jnlStop && _jnlLen <= journalCommitBytes() &&
+        pthread_cond_timedwait(&_jnlKick, &_jnlLock, &deadline) == 0)
+      ;
+
+    commitTransaction();
+
+    // the metadata lock comes before _jnlLock
+    pthread_mutex_unlock(&_jnlLock);
+    reclaimFreedBlocks();
+    pthread_mutex_lock(&_jnlLock);
+  }
+
+  pthread_mutex_unlock(&_jnlLock);
+  return NULL;
+}
+
+// Replay the transactions committed since the last checkpoint. A write is
+// skipped if a later transaction revoked its range.
+void replayJournal()
+{
+  TJournalHeader header;
+  devRead(&header, sizeof(header), _jnlStart);
+
+  if(header.magic != JOURNAL_MAGIC)
+    return;
+
+  unsigned long logLen = _jnlEnd - _jnlStart - _fsDescriptor.blockSize;
+  char *log = (char *) calloc(sizeof(char), logLen);
+  devRead(log, logLen, _jnlStart + _fsDescriptor.blockSize);
+
+  // find the committed transactions
+  unsigned long seq = header.tailSeq, end = 0;
+  while(end + sizeof(TJournalTxn) <= logLen)
+  {
+    TJournalTxn *txn = (TJournalTxn *) (log + end);
+
+    if(txn->magic != JOURNAL_TXN_MAGIC || txn->seq != seq || txn->len < sizeof(TJournalTxn) ||
+        txn->len > logLen - end || txn->len % 8 != 0 ||
+        txn->checksum != journalChecksum(log + end + sizeof(TJournalTxn), txn->len - sizeof(TJournalTxn)))
+      break;
+
+    end += txn->len;
+    seq++;
+  }
+
+  for(unsigned long pos = 0; pos < end; )
+  {
+    TJournalTxn *txn = (TJournalTxn *) (log + pos);
+
+    for(unsigned long off = sizeof(TJournalTxn); off < txn->len; )
+    {
+      TJournalRecord *rec = (TJournalRecord *) (log + pos + off);
+      off += journalRecordSize(rec);
+
+      if(rec->type != JOURNAL_WRITE)
+        continue;
+
+      // look for a revoke in a later transaction
+      int revoked = 0;
+      for(unsigned long later = pos + txn->len; later < end && !revoked; )
+      {
+        TJournalTxn *next = (TJournalTxn *) (log + later);
+
+        for(unsigned long o = sizeof(TJournalTxn); o < next->len; )
+        {
+          TJournalRecord *r = (TJournalRecord *) (log + later + o);
+          o += journalRecordSize(r);
+
+          if(r->type == JOURNAL_REVOKE && rangesOverlap(r->byteIndex, r->len, rec->byteIndex, rec->len))
+            revoked = 1;
+        }
+        later += next->len;
+      }
+
+      if(!revoked)
+        devWrite(rec + 1, rec->len, rec->byteIndex);
+    }
+    pos += txn->len;
+  }
+
+  free(log);
+  _jnlSeq = seq;
+  checkpointJournal();
+}
+
+// Find the journal region, replay it, and start the commit thread. The
+// journal is only used with pread/pwrite.
+void startJournal()
+{
+  _jnlStart = _fsDescriptor.inodeByteIndex + (unsigned long) _fsDescriptor.blockSize * _fsDescriptor.maxFiles;
+  _jnlEnd = _fsDescriptor.dataByteIndex;
+  _jnlEnabled = 0;
+
+  if(_jnlEnd < _jnlStart + 2 * _fsDescriptor.blockSize)
+    return;
+
+  replayJournal();
+
+  if(_ioMode == IO_MMAP)
+    return;
+
+  _jnlCap = _fsDescriptor.blockSize;
+  _jnlBuffer = (char *) calloc(sizeof(char), _jnlCap);
+  _jnlLen = sizeof(TJournalTxn);
+  _jnlRecordCap = 64;
+  _jnlRecords = (unsigned long *) calloc(sizeof(unsigned long), _jnlRecordCap);
+  _jnlCount = 0;
+  _jnlOps = 0;
+  _jnlCommitting = 0;
+  _jnlStop = 0;
+  _jnlEnabled = 1;
+
+  // padded so that whole words can be loaded
+  _freePending = (unsigned char *) calloc(sizeof(char), (_fsDescriptor.bitmapLen + 7) & ~7UL);
+
+  pthread_create(&_jnlThread, NULL, journalThread, NULL);
+}
+
+// Commit what is left, checkpoint, and stop the commit thread
+void stopJournal()
+{
+  if(!_jnlEnabled)
+    return;
+
+  pthread_mutex_lock(&_jnlLock);
+  _jnlStop = 1;
+  pthread_cond_signal(&_jnlKick);
+  pthread_mutex_unlock(&_jnlLock);
+  pthread_join(_jnlThread, NULL);
+
+  pthread_mutex_lock(&_jnlLock);
+  writeTransaction();
+  checkpointJournal();
+  pthread_mutex_unlock(&_jnlLock);
+  reclaimFreedBlocks();
+
+  _jnlEnabled = 0;
+  free(_jnlBuffer);
+  free(_jnlRecords);
+  free(_jnlFreed);
+  free(_freePending);
+  _jnlBuffer = NULL;
+  _jnlRecords = NULL;
+  _jnlFreed = NULL;
+  _jnlFreedCount = _jnlFreedCap = 0;
+  _freePending = NULL;
+}
+
+// Hash a filename for the directory index
+unsigned int hashFilename(const char *filename)
+{
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+
+  for(int i=0; i<MAX_FNAME_LEN && filename[i]; i++)
+  {
+    hash ^= (unsigned char) filename[i];
+    hash *= 16777619u;
+  }
+
+  return hash & (_dirHashSize - 1);
+}
+
+// Add a live directory entry to the hash chains
+void dirIndexInsert(unsigned int ndx)
+{
+  unsigned int bucket = hashFilename(_directory[ndx].filename);
+  _dirHashNext[ndx] = _dirHash[bucket];
+  _dirHash[bucket] = ndx;
+}
+
+// Remove a directory entry from the hash chains
+void dirIndexRemove(unsigned int ndx)
+{
+  int *link = &_dirHash[hashFilename(_directory[ndx].filename)];
+
+  while(*link != -1 && *link != (int) ndx)
+    link = &_dirHashNext[*link];
+
+  if(*link != -1)
+    *link = _dirHashNext[ndx];
+
+  _dirHashNext[ndx] = -1;
+}
+
+// Build the filename index and free entry stack from the loaded directory
+void buildDirectoryIndex()
+{
+  // Power of two with at least two chains per entry
+  _dirHashSize = 1;
+  while(_dirHashSize < _fsDescriptor.maxFiles * 2)
+    _dirHashSize <<= 1;
+
+  if(_dirHash == NULL)
+  {
+    _dirHash = (int *) calloc(sizeof(int), _dirHashSize);
+    _dirHashNext = (int *) calloc(sizeof(int), _fsDescriptor.maxFiles);
+    _dirFreeList = (unsigned int *) calloc(sizeof(unsigned int), _fsDescriptor.maxFiles);
+  }
+
+  for(unsigned int i=0; i<_dirHashSize; i++)
+    _dirHash[i] = -1;
+
+  _dirFreeCount = 0;
+
+  // Walk backwards so the lowest free entry ends up on top of the stack
+  for(unsigned int i=_fsDescriptor.maxFiles; i>0; i--)
+  {
+    _dirHashNext[i-1] = -1;
+
+    if(_directory[i-1].attr & 0b1)
+      dirIndexInsert(i-1);
+    else
+      _dirFreeList[_dirFreeCount++] = i-1;
+  }
+}
+
+// Release the directory index
+void freeDirectoryIndex()
+{
+  free(_dirHash);
+  free(_dirHashNext);
+  free(_dirFreeList);
+  _dirHash = NULL;
+  _dirHashNext = NULL;
+  _dirFreeList = NULL;
+  _dirFreeCount = 0;
+}
+
+// Flag a directory entry as changed since the last storeDirectory
+void markDirectoryDirty(unsigned int ndx)
+{
+  if(!_dirDirty[ndx])
+  {
+    _dirDirty[ndx] = 1;
+    _dirDirtyCount++;
+  }
+}
+
+// Flag the bitmap page holding byteNum as changed since the last storeBitmap
+void markBitmapDirty(unsigned int byteNum)
+{
+  unsigned int page = byteNum / BITMAP_PAGE_SIZE;
+
+  if(!_bitmapDirty[page])
+  {
+    _bitmapDirty[page] = 1;
+    _bitmapDirtyCount++;
+  }
+}
+
+// Write out each run of flagged items. Item i covers itemLen bytes from
+// memory base + i * itemLen and partition offset byteIndex + i * itemLen,
+// the last item being cut short at totalLen bytes. Flags are cleared.
+void storeDirtyRuns(char *flags, unsigned int numItems, unsigned int itemLen, const char *base,
+    unsigned long byteIndex, unsigned long totalLen)
+{
+  unsigned int i = 0;
+
+  while(i < numItems)
+  {
+    if(!flags[i])
+    {
+      i++;
+      continue;
+    }
+
+    unsigned int run = 0;
+    while(i + run < numItems && flags[i + run])
+      flags[i + run++] = 0;
+
+    unsigned long offset = (unsigned long) i * itemLen;
+    unsigned long len = (unsigned long) run * itemLen;
+
+    if(offset + len > totalLen)
+      len = totalLen - offset;
+
+    if(_ioMode == IO_MMAP)
+      syncMappedRange(byteIndex + offset, len);
+    else
+      metaWrite(base + offset, len, byteIndex + offset);
+
+    i += run;
+  }
+}
+
+// Load directory
+void loadDirectory()
+{
+  if(_ioMode == IO_MMAP)
+    // Work on the directory in place
+    _directory = (TDirectory *) (_fsMap + _fsDescriptor.dirByteIndex);
+  else
+  {
+    if(_directory == NULL)
+      _directory = (TDirectory *) calloc(sizeof(TDirectory), _fsDescriptor.maxFiles);
+
+    devRead(_directory, sizeof(TDirectory) * _fsDescriptor.maxFiles, _fsDescriptor.dirByteIndex);
+  }
+
+  if(_dirDirty == NULL)
+    _dirDirty = (char *) calloc(sizeof(char), _fsDescriptor.maxFiles);
+
+  _dirDirtyCount = 0;
+
+  buildDirectoryIndex();
+}
+
+// Write the directory entries changed since the last store
+void storeDirectory()
+{
+  if(_dirDirtyCount == 0)
+    return;
+
+  storeDirtyRuns(_dirDirty, _fsDescriptor.maxFiles, sizeof(TDirectory), (const char *) _directory,
+      _fsDescriptor.dirByteIndex, sizeof(TDirectory) * _fsDescriptor.maxFiles);
+  _dirDirtyCount = 0;
+}
+
+// Load the 64-bit bitmap word at wordNdx. The final word of a bitmap whose
+// length is not a multiple of 8 is padded with busy bits.
+unsigned long long loadBitmapWord(unsigned long wordNdx)
+{
+  unsigned long long word = 0;
+  unsigned long byteNdx = wordNdx * 8;
+  unsigned long len = _fsDescriptor.bitmapLen - byteNdx < 8 ? _fsDescriptor.bitmapLen - byteNdx : 8;
+
+  memcpy(&word, _bitmap + byteNdx, len);
+  return word;
+}
+
+// Load the bitmap word at wordNdx as the allocator sees it: blocks freed
+// in transactions that have not committed are masked out
+unsigned long long loadFreeWord(unsigned long wordNdx)
+{
+  unsigned long long word = loadBitmapWord(wordNdx);
+
+  if(_freePending != NULL)
+  {
+    unsigned long long pending;
+
+    memcpy(&pending, _freePending + wordNdx * 8, sizeof(pending));
+    word &= ~pending;
+  }
+
+  return word;
+}
+
+// Count the free blocks in the bitmap
+void countFreeBlocks()
+{
+  unsigned long numWords = (_fsDescriptor.bitmapLen + 7) / 8;
+
+  _freeBlockCount = 0;
+  for(unsigned long i=0; i<numWords; i++)
+    _freeBlockCount += __builtin_popcountll(loadBitmapWord(i));
+
+  _allocCursor = 0;
+}
+
+// Load free list bitmap
+void loadBitmap()
+{ 
+  if(_ioMode == IO_MMAP)
+    // Work on the bitmap in place
+    _bitmap = _fsMap + _fsDescriptor.bitmapByteIndex;
+  else
+  {
+    if(_bitmap == NULL)
+    {
+      _bitmap = (char *) calloc(sizeof(char), _fsDescriptor.bitmapLen);
+
+      if(_bitmap == NULL)
+        printf("Bitmap allocation failed\n");
+    }
+
+    devRead(_bitmap, _fsDescriptor.bitmapLen, _fsDescriptor.bitmapByteIndex);
+  }
+
+  if(_bitmapDirty == NULL)
+    _bitmapDirty = (char *) calloc(sizeof(char), _fsDescriptor.bitmapLen / BITMAP_PAGE_SIZE + 1);
+
+  _bitmapDirtyCount = 0;
+
+  countFreeBlocks();
+}
+
+// Store the parts of the free list bitmap changed since the last store
+void storeBitmap()
+{
+  if(_bitmapDirtyCount == 0)
+    return;
+
+  storeDirtyRuns(_bitmapDirty, _fsDescriptor.bitmapLen / BITMAP_PAGE_SIZE + 1, BITMAP_PAGE_SIZE, _bitmap,
+      _fsDescriptor.bitmapByteIndex, _fsDescriptor.bitmapLen);
+  _bitmapDirtyCount = 0;
+}
+
+/*
+
+   Buffer pools. Inode and data buffers come from here rather than the heap
+   so that opening and closing files does no heap allocation once the pool
+   has grown to the working set.
+
+   */
+
+// Return a zeroed buffer of size bytes from the pool for that size
+void *poolAlloc(unsigned long size)
+{
+  pthread_mutex_lock(&_poolLock);
+
+  TBufferPool *pool = _bufferPools;
+  while(pool != NULL && pool->size != size)
+    pool = pool->next;
+
+  if(pool == NULL)
+  {
+    pool = (TBufferPool *) calloc(sizeof(TBufferPool), 1);
+    pool->size = size;
+    pool->next = _bufferPools;
+    _bufferPools = pool;
+  }
+
+  // Carve a new slab into buffers when the pool runs dry
+  if(pool->freeList == NULL)
+  {
+    unsigned long stride = sizeof(TPoolHeader) + size;
+    char *slab = (char *) calloc(POOL_SLAB_BUFFERS, stride);
+
+    for(int i=0; i<POOL_SLAB_BUFFERS; i++)
+    {
+      TPoolHeader *header = (TPoolHeader *) (slab + i * stride);
+
+      header->pool = pool;
+      header->next = pool->freeList;
+      pool->freeList = header;
+    }
+  }
+
+  TPoolHeader *header = pool->freeList;
+  pool->freeList = header->next;
+  pthread_mutex_unlock(&_poolLock);
+
+  memset(header + 1, 0, size);
+  return header + 1;
+}
+
+// Return a buffer from poolAlloc to its pool
+void poolRelease(void *buffer)
+{
+  if(buffer == NULL)
+    return;
+
+  TPoolHeader *header = (TPoolHeader *) buffer - 1;
+
+  pthread_mutex_lock(&_poolLock);
+  header->next = header->pool->freeList;
+  header->pool->freeList = header;
+  pthread_mutex_unlock(&_poolLock);
+}
+
+// Free a thread's scratch space. Called when the thread exits.
+void freeScratch(void *ptr)
+{
+  TScratch *scratch = (TScratch *) ptr;
+
+  free(scratch->encBuffer);
+  free(scratch->runBuffer);
+  free(scratch);
+}
+
+// Return the calling thread's scratch space, allocating it on first use
+TScratch *getScratch()
+{
+  TScratch *scratch = (TScratch *) pthread_getspecific(_scratchKey);
+
+  if(scratch == NULL)
+  {
+    scratch = (TScratch *) calloc(sizeof(TScratch), 1);
+    scratch->encBuffer = (char *) calloc(sizeof(char), _fsDescriptor.blockSize);
+    pthread_setspecific(_scratchKey, scratch);
+  }
+
+  return scratch;
+}
+
+// Return a per-thread buffer of at least len bytes for encrypted runs
+char *getRunBuffer(unsigned long len)
+{
+  TScratch *scratch = getScratch();
+
+  if(scratch->runBufferLen < len)
+  {
+    free(scratch->runBuffer);
+    scratch->runBuffer = (char *) calloc(sizeof(char), len);
+    scratch->runBufferLen = len;
+  }
+
+  return scratch->runBuffer;
+}
+
+/*
+
+   I/O worker pool. Large runs of blocks are split into chunks that are
+   encrypted and transferred on several cores at once.
+
+   */
+
+// Take the next chunk of a job and run it. Called with _ioLock held;
+// returns 0 if the job has no chunks left.
+int runIOChunk(TIOJob *job)
+{
+  if(job->next >= job->count)
+    return 0;
+
+  unsigned long first = job->next;
+  unsigned long count = (job->count - first < job->chunk ? job->count - first : job->chunk);
+
+  job->next += count;
+  job->busy++;
+  pthread_mutex_unlock(&_ioLock);
+
+  job->fn(job->arg, first, count);
+
+  pthread_mutex_lock(&_ioLock);
+  job->busy--;
+
+  if(job->next >= job->count && job->busy == 0)
+    pthread_cond_broadcast(&_ioDone);
+
+  return 1;
+}
+
+// Worker thread body
+void *ioWorker(void *arg)
+{
+  pthread_mutex_lock(&_ioLock);
+
+  while(!_ioStop)
+  {
+    if(_ioJob == NULL || !runIOChunk(_ioJob))
+      pthread_cond_wait(&_ioWork, &_ioLock);
+  }
+
+  pthread_mutex_unlock(&_ioLock);
+  return NULL;
+}
+
+// Start one worker per additional online CPU, up to IO_MAX_WORKERS
+void startIOWorkers()
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  _numIOWorkers = (cpus > 1 ? cpus - 1 : 0);
+  if(_numIOWorkers > IO_MAX_WORKERS)
+    _numIOWorkers = IO_MAX_WORKERS;
+
+  _ioStop = 0;
+  _ioJob = NULL;
+
+  if(_numIOWorkers == 0)
+    return;
+
+  _ioWorkers = (pthread_t *) calloc(sizeof(pthread_t), _numIOWorkers);
+
+  for(int i=0; i<_numIOWorkers; i++)
+    if(pthread_create(&_ioWorkers[i], NULL, ioWorker, NULL) != 0)
+    {
+      _numIOWorkers = i;
+      break;
+    }
+}
+
+// Stop the workers
+void stopIOWorkers()
+{
+  pthread_mutex_lock(&_ioLock);
+  _ioStop = 1;
+  pthread_cond_broadcast(&_ioWork);
+  pthread_mutex_unlock(&_ioLock);
+
+  for(int i=0; i<_numIOWorkers; i++)
+    pthread_join(_ioWorkers[i], NULL);
+
+  free(_ioWorkers);
+  _ioWorkers = NULL;
+  _numIOWorkers = 0;
+}
+
+// Run fn over count blocks, split across the workers and the calling
+// thread. Returns once every block has been handled.
+void runParallel(void (*fn)(void *, unsigned long, unsigned long), void *arg, unsigned long count)
+{
+  TIOJob job;
+
+  if(_numIOWorkers == 0 || count < 2 * PARALLEL_CHUNK_BLOCKS)
+  {
+    fn(arg, 0, count);
+    return;
+  }
+
+  pthread_mutex_lock(&_ioLock);
+
+  if(_ioJob != NULL)
+  {
+    pthread_mutex_unlock(&_ioLock);
+    fn(arg, 0, count);
+    return;
+  }
+
+  // Split evenly over the workers and this thread, in chunks of at least
+  // PARALLEL_CHUNK_BLOCKS
+  job.fn = fn;
+  job.arg = arg;
+  job.count = count;
+  job.chunk = (count + _numIOWorkers) / (_numIOWorkers + 1);
+  if(job.chunk < PARALLEL_CHUNK_BLOCKS)
+    job.chunk = PARALLEL_CHUNK_BLOCKS;
+  job.next = 0;
+  job.busy = 0;
+
+  _ioJob = &job;
+  pthread_cond_broadcast(&_ioWork);
+
+  while(runIOChunk(&job))
+    ;
+
+  while(job.busy > 0)
+    pthread_cond_wait(&_ioDone, &_ioLock);
+
+  _ioJob = NULL;
+  pthread_mutex_unlock(&_ioLock);
+}
+
+// Read and decrypt a data block straight from the partition, bypassing the
+// cache. Returns 0, or -1 with _result FS_ERROR if the read fails.
+int diskReadBlock(char *buffer, unsigned long blockNum)
+{
+  unsigned long byteIndex = locateDataBlock(blockNum-1);
+
+  if(_ioMode == IO_MMAP)
+  {
+    encdecBlock(buffer, _fsMap + byteIndex, _fsDescriptor.blockSize);
+    return 0;
+  }
+
+  char *encBuffer = getScratch()->encBuffer;
+
+  if(devRead(encBuffer, _fsDescriptor.blockSize, byteIndex) != 0)
+    return -1;
+
+  encdecBlock(buffer, encBuffer, _fsDescriptor.blockSize);
+  return 0;
+}
+
+// Encrypt and write a data block straight to the partition, bypassing the cache
+void diskWriteBlock(const char *buffer, unsigned long blockNum)
+{
+  unsigned long byteIndex = locateDataBlock(blockNum-1);
+
+  if(_ioMode == IO_MMAP)
+  {
+    encdecBlock(_fsMap + byteIndex, buffer, _fsDescriptor.blockSize);
+    return;
+  }
+
+  char *encBuffer = getScratch()->encBuffer;
+
+  encdecBlock(encBuffer, buffer, _fsDescriptor.blockSize);
+  devWrite(encBuffer, _fsDescriptor.blockSize, byteIndex);
+}
+
+/*
+   Block cache management. The cache holds decrypted blocks, so a hit costs
+   neither disk I/O nor a pass of the cipher. Dirty blocks are only written
+   back when evicted or when flushBlockCache is called.
+*/
+
+// Allocate the cache slots and hash table. Called from mountFS.
+void initBlockCache()
+{
+  _cache = (TCacheEntry *) calloc(sizeof(TCacheEntry), BLOCK_CACHE_SIZE);
+  _cacheHash = (int *) calloc(sizeof(int), BLOCK_CACHE_HASH);
+
+  for(int i=0; i<BLOCK_CACHE_HASH; i++)
+    _cacheHash[i] = -1;
+
+  // All slots start out empty and chained on the LRU list in index order
+  for(int i=0; i<BLOCK_CACHE_SIZE; i++)
+  {
+    _cache[i].blockNum = 0;
+    _cache[i].dirty = 0;
+    _cache[i].hashNext = -1;
+    _cache[i].lruPrev = i - 1;
+    _cache[i].lruNext = (i + 1 < BLOCK_CACHE_SIZE ? i + 1 : -1);
+    _cache[i].data = (char *) calloc(sizeof(char), _fsDescriptor.blockSize);
+  }
+
+  _cacheLRUHead = 0;
+  _cacheLRUTail = BLOCK_CACHE_SIZE - 1;
+}
+
+// Release the cache. Dirty blocks must have been flushed first.
+void freeBlockCache()
+{
+  if(_cache != NULL)
+  {
+    for(int i=0; i<BLOCK_CACHE_SIZE; i++)
+      free(_cache[i].data);
+
+    free(_cache);
+    _cache = NULL;
+  }
+
+  if(_cacheHash != NULL)
+  {
+    free(_cacheHash);
+    _cacheHash = NULL;
+  }
+}
+
+// Return the cache slot holding blockNum, or -1 if it is not cached
+int cacheLookup(unsigned long blockNum)
+{
+  for(int i = _cacheHash[blockNum % BLOCK_CACHE_HASH]; i != -1; i = _cache[i].hashNext)
+    if(_cache[i].blockNum == blockNum)
+      return i;
+
+  return -1;
+}
+
+// Move a slot to the head of the LRU list
+void cacheTouch(int slot)
+{
+  if(slot == _cacheLRUHead)
+    return;
+
+  // Unlink
+  _cache[_cache[slot].lruPrev].lruNext = _cache[slot].lruNext;
+
+  if(_cache[slot].lruNext != -1)
+    _cache[_cache[slot].lruNext].lruPrev = _cache[slot].lruPrev;
+  else
+    _cacheLRUTail = _cache[slot].lruPrev;
+
+  // Relink at the head
+  _cache[slot].lruPrev = -1;
+  _cache[slot].lruNext = _cacheLRUHead;
+  _cache[_cacheLRUHead].lruPrev = slot;
+  _cacheLRUHead = slot;
+}
+
+// Remove a slot from its hash chain
+void cacheUnhash(int slot)
+{
+  int *link = &_cacheHash[_cache[slot].blockNum % BLOCK_CACHE_HASH];
+
+  while(*link != slot)
+    link = &_cache[*link].hashNext;
+
+  *link = _cache[slot].hashNext;
+  _cache[slot].hashNext = -1;
+}
+
+// Take the least recently used slot for blockNum, writing back its old
+// contents if they are dirty
+int cacheAssign(unsigned long blockNum)
+{
+  int slot = _cacheLRUTail;
+
+  if(_cache[slot].blockNum != 0)
+  {
+    if(_cache[slot].dirty)
+      diskWriteBlock(_cache[slot].data, _cache[slot].blockNum);
+
+    cacheUnhash(slot);
+  }
+
+  unsigned int bucket = blockNum % BLOCK_CACHE_HASH;
+  _cache[slot].blockNum = blockNum;
+  _cache[slot].dirty = 0;
+  _cache[slot].hashNext = _cacheHash[bucket];
+  _cacheHash[bucket] = slot;
+  cacheTouch(slot);
+
+  return slot;
+}
+
+// Forget any cached copy of a block without writing it back
+void cacheDrop(unsigned long blockNum)
+{
+  pthread_mutex_lock(&_cacheLock);
+
+  int slot = cacheLookup(blockNum);
+
+  if(slot != -1)
+  {
+    cacheUnhash(slot);
+    _cache[slot].blockNum = 0;
+    _cache[slot].dirty = 0;
+  }
+
+  pthread_mutex_unlock(&_cacheLock);
+}
+
+// Order dirty slots by block number so write back sweeps the partition once
+int compareCacheSlots(const void *a, const void *b)
+{
+  unsigned long blockA = _cache[*(const int *) a].blockNum;
+  unsigned long blockB = _cache[*(const int *) b].blockNum;
+
+  return (blockA > blockB) - (blockA < blockB);
+}
+
+
+/*
+   Pointer block cache for the indirect blocks of inodes. Pointer blocks
+   are not encrypted, so they bypass the data block cache.
+*/
+
+// Allocate the pointer block cache. Called from mountFS.
+void initPointerCache()
+{
+  _ptrCache = (TPointerBlock *) calloc(sizeof(TPointerBlock), POINTER_CACHE_SIZE);
+
+  for(int i=0; i<POINTER_CACHE_SIZE; i++)
+    _ptrCache[i].entries = (unsigned long *) calloc(sizeof(unsigned long), _fsDescriptor.numInodeEntries);
+
+  _ptrCacheClock = 0;
+  _ptrCacheLastHit = 0;
+}
+
+// Release the pointer block cache. Dirty blocks must have been flushed first.
+void freePointerCache()
+{
+  if(_ptrCache == NULL)
+    return;
+
+  for(int i=0; i<POINTER_CACHE_SIZE; i++)
+    free(_ptrCache[i].entries);
+
+  free(_ptrCache);
+  _ptrCache = NULL;
+}
+
+// Write a cached pointer block back to the partition
+void storePointerBlock(int slot)
+{
+  metaWrite(_ptrCache[slot].entries, sizeof(unsigned long) * _fsDescriptor.numInodeEntries,
+      locateDataBlock(_ptrCache[slot].blockNum - 1));
+  _ptrCache[slot].dirty = 0;
+}
+
+// Return the cached entries of a pointer block, loading it if necessary. A
+// block that has just been allocated (isNew set) starts out all zero.
+unsigned long *getPointerBlock(unsigned long blockNum, int isNew)
+{
+  int slot = _ptrCacheLastHit;
+
+  if(_ptrCache[slot].blockNum != blockNum)
+  {
+    slot = 0;
+
+    for(int i=0; i<POINTER_CACHE_SIZE; i++)
+    {
+      if(_ptrCache[i].blockNum == blockNum)
+      {
+        slot = i;
+        break;
+      }
+
+      if(_ptrCache[i].lastUsed < _ptrCache[slot].lastUsed)
+        slot = i;
+    }
+
+    if(_ptrCache[slot].blockNum != blockNum)
+    {
+      // Replace the least recently used slot
+      if(_ptrCache[slot].blockNum != 0 && _ptrCache[slot].dirty)
+        storePointerBlock(slot);
+
+      _ptrCache[slot].blockNum = blockNum;
+      _ptrCache[slot].dirty = isNew;
+
+      if(isNew)
+        memset(_ptrCache[slot].entries, 0, sizeof(unsigned long) * _fsDescriptor.numInodeEntries);
+      else
+      {
+        devRead(_ptrCache[slot].entries, sizeof(unsigned long) * _fsDescriptor.numInodeEntries,
+            locateDataBlock(blockNum - 1));
+        journalOverlay(_ptrCache[slot].entries, sizeof(unsigned long) * _fsDescriptor.numInodeEntries,
+            locateDataBlock(blockNum - 1));
+      }
+    }
+  }
+
+  _ptrCache[slot].lastUsed = ++_ptrCacheClock;
+  _ptrCacheLastHit = slot;
+  return _ptrCache[slot].entries;
+}
+
+// Flag a cached pointer block as changed
+void markPointerBlockDirty(unsigned long blockNum)
+{
+  for(int i=0; i<POINTER_CACHE_SIZE; i++)
+    if(_ptrCache[i].blockNum == blockNum)
+      _ptrCache[i].dirty = 1;
+}
+
+// Drop a pointer block that is being freed from the cache
+void dropPointerBlock(unsigned long blockNum)
+{
+  journalRevoke(locateDataBlock(blockNum - 1), _fsDescriptor.blockSize);
+
+  for(int i=0; i<POINTER_CACHE_SIZE; i++)
+    if(_ptrCache[i].blockNum == blockNum)
+    {
+      _ptrCache[i].blockNum = 0;
+      _ptrCache[i].dirty = 0;
+      _ptrCache[i].lastUsed = 0;
+    }
+}
+
+// Write all dirty pointer blocks back to the partition
+void flushPointerBlocks()
+{
+  pthread_mutex_lock(&_ptrCacheLock);
+  for(int i=0; i<POINTER_CACHE_SIZE; i++)
+    if(_ptrCache[i].blockNum != 0 && _ptrCache[i].dirty)
+      storePointerBlock(i);
+  pthread_mutex_unlock(&_ptrCacheLock);
+}
+
+/*
+
+   Asynchronous block engine. A request moves a run of consecutive blocks
+   between the partition and a caller's buffer. Writes are encrypted when
+   submitted; reads are decrypted in place when they complete.
+
+   */
+
+// Decrypt count blocks of a completed read in place, starting at block first
+void decryptRunChunk(void *arg, unsigned long first, unsigned long count)
+{
+  char *buffer = ((TIORequest *) arg)->buffer + first * _fsDescriptor.blockSize;
+
+  for(unsigned long i=0; i<count; i++)
+    encdecBlock(buffer + i * _fsDescriptor.blockSize, buffer + i * _fsDescriptor.blockSize, _fsDescriptor.blockSize);
+}
+
+// Check whether any of count blocks from startBlock has a write in flight.
+// Called with _flightLock held.
+int writeInFlight(unsigned long startBlock, unsigned long count)
+{
+  for(unsigned long b = startBlock; b < startBlock + count; b++)
+    if(_writeBusy[(b - 1) / 8] & (0x80 >> ((b - 1) % 8)))
+      return 1;
+
+  return 0;
+}
+
+// Flag or clear the blocks of a write request as in flight
+void setWriteInFlight(TIORequest *req, int flag)
+{
+  pthread_mutex_lock(&_flightLock);
+  for(unsigned long b = req->startBlock; b < req->startBlock + req->count; b++)
+  {
+    if(flag)
+      _writeBusy[(b - 1) / 8] |= 0x80 >> ((b - 1) % 8);
+    else
+      _writeBusy[(b - 1) / 8] &= ~(0x80 >> ((b - 1) % 8));
+  }
+
+  if(flag)
+    _writesInFlight++;
+  else
+  {
+    _writesInFlight--;
+    pthread_cond_broadcast(&_flightDone);
+  }
+  pthread_mutex_unlock(&_flightLock);
+}
+
+// Mark a request complete
+void completeRequest(TIORequest *req, unsigned long result)
+{
+  if(result == FS_OK && !req->isWrite)
+    runParallel(decryptRunChunk, req, req->count);
+
+  // Writes to a mapped partition are done before they are submitted
+  if(req->isWrite && _ioMode != IO_MMAP)
+    setWriteInFlight(req, 0);
+
+  free(req->encBuffer);
+  req->encBuffer = NULL;
+  req->result = result;
+  __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+}
+
+// Bytes moved by a request
+unsigned long requestLength(TIORequest *req)
+{
+  return req->count * _fsDescriptor.blockSize;
+}
+
+// Queue the untransferred part of a request on the ring. Called with
+// _ringLock held and room in the submission queue.
+void queueRingEntry(TIORequest *req)
+{
+  unsigned tail = *_sqTail;
+  unsigned ndx = tail & *_sqMask;
+  struct io_uring_sqe *sqe = &_sqes[ndx];
+  char *data = (req->isWrite ? req->encBuffer : req->buffer);
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = (req->isWrite ? IORING_OP_WRITE : IORING_OP_READ);
+  sqe->fd = _fsfd;
+  sqe->off = locateDataBlock(req->startBlock - 1) + req->transferred;
+  sqe->addr = (unsigned long) (data + req->transferred);
+  sqe->len = requestLength(req) - req->transferred;
+  sqe->user_data = (unsigned long) req;
+
+  _sqArray[ndx] = ndx;
+  __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+  _ringQueued++;
+}
+
+// Hand queued entries to the kernel without waiting. Called with _ringLock
+// held.
+void enterRing()
+{
+  if(_ringQueued == 0)
+    return;
+
+  int ret = syscall(__NR_io_uring_enter, _ringFd, _ringQueued, 0, 0, NULL, 0);
+
+  if(ret >= 0)
+  {
+    _ringInFlight += ret;
+    _ringQueued -= ret;
+  }
+}
+
+// Move a reaped request onto the list of those to complete
+void reapRequest(TIORequest **finished, TIORequest *req, unsigned long result)
+{
+  req->result = result;
+  req->queueNext = *finished;
+  *finished = req;
+}
+
+// Reap finished entries from the completion queue onto *finished, to be
+// completed by finishRing. Short and interrupted transfers are queued again
+// for the remainder. Called with _ringLock held. Returns the number of
+// requests reaped.
+unsigned reapRing(TIORequest **finished)
+{
+  unsigned head = *_cqHead;
+  unsigned count = 0;
+
+  while(head != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+  {
+    struct io_uring_cqe *cqe = &_cqes[head & *_cqMask];
+    TIORequest *req = (TIORequest *) cqe->user_data;
+    int res = cqe->res;
+
+    head++;
+    _ringInFlight--;
+
+    if(res == -EINTR || res == -EAGAIN)
+      queueRingEntry(req);
+    else if(res < 0)
+    {
+      reapRequest(finished, req, FS_ERROR);
+      count++;
+    }
+    else if(res == 0)
+    {
+      // Reads past the end of the partition file see zeros, like devRead
+      if(!req->isWrite)
+        memset(req->buffer + req->transferred, 0, requestLength(req) - req->transferred);
+
+      reapRequest(finished, req, req->isWrite ? FS_ERROR : FS_OK);
+      count++;
+    }
+    else
+    {
+      req->transferred += res;
+
+      if(req->transferred < requestLength(req))
+        queueRingEntry(req);
+      else
+      {
+        reapRequest(finished, req, FS_OK);
+        count++;
+      }
+    }
+  }
+
+  __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+// Complete the requests reaped by reapRing. _ringLock is released meanwhile
+// so that reads are decrypted outside it. Called with _ringLock held.
+void finishRing(TIORequest *finished, unsigned count)
+{
+  if(count == 0)
+    return;
+
+  _ringFinishing += count;
+  pthread_mutex_unlock(&_ringLock);
+
+  while(finished != NULL)
+  {
+    // The owner may free a request as soon as it is done
+    TIORequest *next = finished->queueNext;
+
+    completeRequest(finished, finished->result);
+    finished = next;
+  }
+
+  pthread_mutex_lock(&_ringLock);
+  _ringFinishing -= count;
+  pthread_cond_broadcast(&_ringDone);
+}
+
+// Reap and complete whatever has finished. Completions are left alone while
+// a thread waits for them in the kernel, so that its wakeup is not taken
+// from it. Called with _ringLock held. Returns the number completed.
+unsigned collectRing()
+{
+  TIORequest *finished = NULL;
+
+  if(_ringWaiting)
+    return 0;
+
+  unsigned count = reapRing(&finished);
+  finishRing(finished, count);
+  return count;
+}
+
+// Wait until more requests have finished. One thread at a time blocks in
+// the kernel, without _ringLock; the others wait for it to collect the
+// completions. Called with _ringLock held.
+void waitRing()
+{
+  if(_ringWaiting || _ringFinishing > 0)
+  {
+    pthread_cond_wait(&_ringDone, &_ringLock);
+    return;
+  }
+
+  enterRing();
+
+  if(collectRing() > 0 || _ringInFlight == 0)
+    return;
+
+  _ringWaiting = 1;
+  pthread_mutex_unlock(&_ringLock);
+  syscall(__NR_io_uring_enter, _ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  pthread_mutex_lock(&_ringLock);
+  _ringWaiting = 0;
+
+  if(collectRing() == 0)
+    pthread_cond_broadcast(&_ringDone);
+}
+
+// Wait until none of count blocks from startBlock has a write in flight.
+// On the ring this thread collects completions itself, since no other
+// thread may be waiting for them.
+void waitForWrites(unsigned long startBlock, unsigned long count)
+{
+  if(__atomic_load_n(&_writesInFlight, __ATOMIC_ACQUIRE) == 0)
+    return;
+
+  pthread_mutex_lock(&_flightLock);
+  while(writeInFlight(startBlock, count))
+  {
+    if(_ringFd >= 0)
+    {
+      pthread_mutex_unlock(&_flightLock);
+      pthread_mutex_lock(&_ringLock);
+      waitRing();
+      pthread_mutex_unlock(&_ringLock);
+      pthread_mutex_lock(&_flightLock);
+    }
+    else
+      pthread_cond_wait(&_flightDone, &_flightLock);
+  }
+  pthread_mutex_unlock(&_flightLock);
+}
+
+// Set up an io_uring of IO_RING_DEPTH entries. Returns 0 on success.
+int setupRing()
+{
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  _ringFd = syscall(__NR_io_uring_setup, IO_RING_DEPTH, &params);
+
+  if(_ringFd < 0)
+    return -1;
+
+  _sqRingLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cqRingLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  _sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  // Newer kernels map both rings with one call
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if(_cqRingLen > _sqRingLen)
+      _sqRingLen = _cqRingLen;
+    _cqRingLen = 0;
+  }
+
+  _sqRing = mmap(NULL, _sqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQ_RING);
+  _cqRing = (_cqRingLen == 0 ? _sqRing : mmap(NULL, _cqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_CQ_RING));
+  _sqes = (struct io_uring_sqe *) mmap(NULL, _sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQES);
+
+  if(_sqRing == MAP_FAILED || _cqRing == MAP_FAILED || _sqes == MAP_FAILED)
+  {
+    if(_sqRing != MAP_FAILED)
+      munmap(_sqRing, _sqRingLen);
+    if(_cqRingLen != 0 && _cqRing != MAP_FAILED)
+      munmap(_cqRing, _cqRingLen);
+    if(_sqes != MAP_FAILED)
+      munmap(_sqes, _sqesLen);
+    close(_ringFd);
+    _ringFd = -1;
+    return -1;
+  }
+
+  _sqHead = (unsigned *) ((char *) _sqRing + params.sq_off.head);
+  _sqTail = (unsigned *) ((char *) _sqRing + params.sq_off.tail);
+  _sqMask = (unsigned *) ((char *) _sqRing + params.sq_off.ring_mask);
+  _sqArray = (unsigned *) ((char *) _sqRing + params.sq_off.array);
+  _cqHead = (unsigned *) ((char *) _cqRing + params.cq_off.head);
+  _cqTail = (unsigned *) ((char *) _cqRing + params.cq_off.tail);
+  _cqMask = (unsigned *) ((char *) _cqRing + params.cq_off.ring_mask);
+  _cqes = (struct io_uring_cqe *) ((char *) _cqRing + params.cq_off.cqes);
+
+  _ringQueued = 0;
+  _ringInFlight = 0;
+  return 0;
+}
+
+// Tear down the io_uring
+void closeRing()
+{
+  munmap(_sqes, _sqesLen);
+  if(_cqRingLen != 0)
+    munmap(_cqRing, _cqRingLen);
+  munmap(_sqRing, _sqRingLen);
+  close(_ringFd);
+  _ringFd = -1;
+}
+
+// Emulation thread body. Requests are served in submission order.
+void *aioThread(void *arg)
+{
+  pthread_mutex_lock(&_aioLock);
+
+  while(1)
+  {
+    while(_aioQueueHead == NULL && !_aioStop)
+      pthread_cond_wait(&_aioWork, &_aioLock);
+
+    if(_aioQueueHead == NULL)
+      break;
+
+    TIORequest *req = _aioQueueHead;
+    _aioQueueHead = req->queueNext;
+    if(_aioQueueHead == NULL)
+      _aioQueueTail = NULL;
+    pthread_mutex_unlock(&_aioLock);
+
+    _result = FS_OK;
+    if(req->isWrite)
+      devWrite(req->encBuffer, requestLength(req), locateDataBlock(req->startBlock - 1));
+    else
+      devRead(req->buffer, requestLength(req), locateDataBlock(req->startBlock - 1));
+
+    completeRequest(req, _result);
+
+    pthread_mutex_lock(&_aioLock);
+    pthread_cond_broadcast(&_aioDone);
+  }
+
+  pthread_mutex_unlock(&_aioLock);
+  return NULL;
+}
+
+// Start the asynchronous block engine. Mapped partitions need none; their
+// requests complete as they are submitted.
+void startBlockEngine()
+{
+  _numAIOThreads = 0;
+  _aioStop = 0;
+  _writeBusy = (unsigned char *) calloc(sizeof(char), _fsDescriptor.numBlocks / 8 + 1);
+  _writesInFlight = 0;
+
+  if(_ioMode == IO_MMAP || setupRing() == 0)
+    return;
+
+  for(int i=0; i<AIO_EMULATION_THREADS; i++)
+    if(pthread_create(&_aioThreads[i], NULL, aioThread, NULL) == 0)
+      _numAIOThreads++;
+}
+
+// Stop the asynchronous block engine once outstanding requests are done
+void stopBlockEngine()
+{
+  if(_ringFd >= 0)
+  {
+    pthread_mutex_lock(&_ringLock);
+    while(_ringQueued > 0 || _ringInFlight > 0 || _ringFinishing > 0)
+      waitRing();
+    pthread_mutex_unlock(&_ringLock);
+
+    closeRing();
+  }
+
+  pthread_mutex_lock(&_aioLock);
+  _aioStop = 1;
+  pthread_cond_broadcast(&_aioWork);
+  pthread_mutex_unlock(&_aioLock);
+
+  for(int i=0; i<_numAIOThreads; i++)
+    pthread_join(_aioThreads[i], NULL);
+
+  _numAIOThreads = 0;
+  free(_writeBusy);
+  _writeBusy = NULL;
+}
+
+/*
+
+   Public routines: Use these routines to implement your libraries
+
+   */
+
+/*
+
+   Locking
+
+   */
+
+// Lock the directory and free list bitmap, shared for lookups or exclusive
+// for changes
+void lockMetadata(int exclusive)
+{
+  if(exclusive)
+    pthread_rwlock_wrlock(&_metaLock);
+  else
+    pthread_rwlock_rdlock(&_metaLock);
+}
+
+// Release the lock taken by lockMetadata
+void unlockMetadata()
+{
+  pthread_rwlock_unlock(&_metaLock);
+}
+
+/*
+
+   Metadata journal
+
+   */
+
+// Start an operation whose metadata writes commit together. Only the
+// outermost operation on a thread waits for a commit in progress.
+void beginJournalOp()
+{
+  if(!_jnlEnabled || _jnlDepth++ > 0)
+    return;
+
+  pthread_mutex_lock(&_jnlLock);
+
+  // a transaction past the commit size takes no more operations
+  while(_jnlCommitting || _jnlLen > journalCommitBytes())
+  {
+    pthread_cond_signal(&_jnlKick);
+    pthread_cond_wait(&_jnlIdle, &_jnlLock);
+  }
+  _jnlOps++;
+  pthread_mutex_unlock(&_jnlLock);
+}
+
+// End an operation started by beginJournalOp
+void endJournalOp()
+{
+  if(!_jnlEnabled || --_jnlDepth > 0)
+    return;
+
+  pthread_mutex_lock(&_jnlLock);
+  if(--_jnlOps == 0)
+    pthread_cond_broadcast(&_jnlIdle);
+  pthread_mutex_unlock(&_jnlLock);
+}
+
+// Commit the running transaction now rather than at the next interval
+void commitJournal()
+{
+  if(!_jnlEnabled)
+    return;
+
+  pthread_mutex_lock(&_jnlLock);
+  commitTransaction();
+  pthread_mutex_unlock(&_jnlLock);
+
+  reclaimFreedBlocks();
+}
+
+/* 
+
+   Mount and unmount file system
+
+   */
+
+// Mount the file system. File system is stored on disk in "filename"
+void mountFS(const char *filename, const char *password, int ioMode)
+{
+  _directory=NULL;
+  _bitmap=NULL;
+  _result = FS_OK;
+
+  strncpy(_password, password, MAX_PWD_LEN);
+  _password[MAX_PWD_LEN] = 0;
+
+  _fsfd = open(filename, O_RDWR);
+
+  if(_fsfd < 0)
+  {
+    fprintf(stderr, "Unable to open partition file.\n");
+    _result = FS_ERROR;
+    exit(-1);
+  }
+
+  // Load descriptor
+  loadFSDescriptor();
+
+  if(!knownInodeFormat())
+  {
+    fprintf(stderr, "Unknown inode format in partition file.\n");
+    _result = FS_ERROR;
+    exit(-1);
+  }
+
+  _ioMode = ioMode;
+  if(_ioMode == IO_MMAP && mapPartition() != 0)
+  {
+    fprintf(stderr, "Unable to map partition file, falling back to pread/pwrite.\n");
+    _ioMode = IO_PREAD;
+  }
+
+  // Replay the metadata journal before anything reads the metadata
+  startJournal();
+
+  // Cipher scratch space is allocated per thread
+  pthread_key_create(&_scratchKey, freeScratch);
+
+  buildKeyStream();
+
+  // Set up the block cache and the pointer block cache
+  initBlockCache();
+  initPointerCache();
+
+  startIOWorkers();
+  startBlockEngine();
+  startScrubber();
+
+  // Load directory
+  loadDirectory();
+
+
+  // load bitmap
+  loadBitmap();
+
+  _result = FS_OK;
+}
+
+// Unmount the file system
+void unmountFS()
+{
+  stopBlockEngine();
+
+  flushBlockCache();
+  flushPointerBlocks();
+  storeDirectory();
+  storeBitmap();
+
+  // the last commit queues the blocks it frees for scrubbing, which
+  // writes through the block cache and the I/O workers
+  stopJournal();
+  stopScrubber();
+  stopIOWorkers();
+
+  freeBlockCache();
+  freePointerCache();
+
+  if(_ioMode == IO_MMAP)
+  {
+    munmap(_fsMap, _fsMapLen);
+    _fsMap = NULL;
+
+    // The directory and bitmap lived in the mapping
+    _directory = NULL;
+    _bitmap = NULL;
+  }
+
+  close(_fsfd);
+  _fsfd = -1;
+
+  if(_directory != NULL)
+  {
+    free(_directory);
+    _directory = NULL;
+  }
+
+  freeDirectoryIndex();
+
+  free(_dirDirty);
+  free(_bitmapDirty);
+  _dirDirty = NULL;
+  _bitmapDirty = NULL;
+
+  if(_bitmap != NULL)
+  {
+    free(_bitmap);
+    _bitmap = NULL;
+  }
+
+  if(_keyStream != NULL)
+  {
+    free(_keyStream);
+    _keyStream = NULL;
+  }
+
+  // Release this thread's scratch space; other threads release their own on exit
+  TScratch *scratch = (TScratch *) pthread_getspecific(_scratchKey);
+  if(scratch != NULL)
+    freeScratch(scratch);
+  pthread_setspecific(_scratchKey, NULL);
+  pthread_key_delete(_scratchKey);
+}
+
+// Return FS information
+TFileSystemStruct *getFSInfo()
+{
+  return &_fsDescriptor;
+}
+/*
+
+   Directory Management
+
+   */
+
+
+// Return index to next free directory entry
+unsigned int getFreeDirectory()
+{
+  if(_dirFreeCount > 0)
+  {
+    _result = FS_OK;
+    return _dirFreeList[_dirFreeCount - 1];
+  }
+
+  _result = FS_DIR_FULL;
+  return FS_DIR_FULL;
+}
+
+// Get length of file
+unsigned long getFileLength(const char *filename)
+{
+	unsigned int ndx = findFile(filename);
+	if(ndx != FS_FILE_NOT_FOUND)
+	{
+		_result = FS_OK;
+		return _directory[ndx].length;
+	}
+	
+	_result = ndx;
+	return -1;
+}
+
+// Get inode for filename
+unsigned long getInodeForFile(const char *filename)
+{
+  unsigned int ndx = findFile(filename);
+
+  if(ndx != FS_FILE_NOT_FOUND)
+  {
+    _result = FS_OK;
+    return _directory[ndx].inode;
+  }
+
+  _result = FS_FILE_NOT_FOUND;
+  return _result;
+}
+
+// Make new directory entry
+unsigned int makeDirectoryEntry(const char *filename, unsigned int attr, unsigned long len)
+{
+  unsigned int ndx = findFile(filename);
+
+  if(ndx != FS_FILE_NOT_FOUND)
+  {
+    _result = FS_DUPLICATE_FILE;
+    return _result;
+  }
+
+  ndx = getFreeDirectory();
+  if(ndx != FS_DIR_FULL)
+  {
+    strncpy(_directory[ndx].filename, filename, MAX_FNAME_LEN);
+
+    // Mark directory entry as taken
+    _directory[ndx].attr = attr |= 0b1;
+    _directory[ndx].length=len;
+    _directory[ndx].inode = ndx;
+    markDirectoryDirty(ndx);
+    _dirFreeCount--;
+    dirIndexInsert(ndx);
+    _result = FS_OK;
+  }
+
+  return ndx;
+}
+
+// Modify directory entry
+unsigned int updateDirectoryFileLength(const char *filename, unsigned long len)
+{
+  unsigned int ndx = findFile(filename);
+
+  if(ndx != FS_FILE_NOT_FOUND)
+  {
+    _directory[ndx].length = len;
+    markDirectoryDirty(ndx);
+  }
+
+  return ndx;
+}
+
+// Remove directory entry
+unsigned int delDirectoryEntry(const char *filename)
+{
+  unsigned int ndx = findFile(filename);
+
+  if(ndx != FS_FILE_NOT_FOUND)
+  {
+    dirIndexRemove(ndx);
+    strcpy(_directory[ndx].filename, "nofile.dat");
+    _directory[ndx].attr &= ~0b1;
+    markDirectoryDirty(ndx);
+    _dirFreeList[_dirFreeCount++] = ndx;
+  }
+
+  return ndx;
 }
 
 
 // Search directory for file
 unsigned int findFile(const char *filename)
 {
-  unsigned int i;
+  for(int i = _dirHash[hashFilename(filename)]; i != -1; i = _dirHashNext[i])
+    if(!strncmp(_directory[i].filename, filename, MAX_FNAME_LEN))
+    {
+      _result = FS_OK;
+      return i;
+    }
+
+  _result = FS_FILE_NOT_FOUND;
+  return FS_FILE_NOT_FOUND;
+}
+
+// Change attribute for file
+void setAttr(const char *filename, unsigned int attr)
+{
+  unsigned int ndx = findFile(filename);
+
+  if(ndx != FS_FILE_NOT_FOUND)
+  {
+    _directory[ndx].attr = attr;
+    markDirectoryDirty(ndx);
+
+    // Clearing bit 0 frees the entry
+    if(!(attr & 0b1))
+    {
+      dirIndexRemove(ndx);
+      _dirFreeList[_dirFreeCount++] = ndx;
+    }
+  }
+}
+
+// Get attribute for a file
+unsigned int getAttr(const char *filename)
+{
+  unsigned int ndx = findFile(filename);
+
+    if(ndx != FS_FILE_NOT_FOUND) {
+      return _directory[ndx].attr;
+    }else
+    return ndx;
+}
+
+void updateDirectory()
+{
+	storeDirectory();
+}
+
+/*
+
+   Free List Management
+
+   */
+
+// Return the number of the first free block within a non-zero word loaded
+// by loadFreeWord. Bit 7 of the lowest addressed byte is the first block.
+unsigned long firstFreeInWord(unsigned long wordNdx, unsigned long long word)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  unsigned int byteOffset = __builtin_ctzll(word) / 8;
+#else
+  unsigned int byteOffset = __builtin_clzll(word) / 8;
+#endif
+  unsigned char bits = ((unsigned char *) &word)[byteOffset];
+
+  // Blocks are numbered from 1
+  return wordNdx * 64 + byteOffset * 8 + (__builtin_clz(bits) - 24) + 1;
+}
+
+// Scans the bitmap for a free block. Scanning is done 64 blocks at a time
+// and resumes from where the last free block was found.
+unsigned long findFreeBlock()
+{
+  unsigned long numWords = (_fsDescriptor.bitmapLen + 7) / 8;
+  unsigned long wordNdx = _allocCursor;
+
+  if(_freeBlockCount > 0)
+    for(unsigned long i = 0; i<numWords; i++)
+    {
+      unsigned long long word = loadFreeWord(wordNdx);
+
+      if(word)
+      {
+        _allocCursor = wordNdx;
+        _result = FS_OK;
+        return firstFreeInWord(wordNdx, word);
+      }
+
+      if(++wordNdx == numWords)
+        wordNdx = 0;
+    }
+
+  // Return 999999999 as full flag
+  _result = FS_FULL;
+  return FS_FULL;
+}
+
+// Return non-zero if a block is marked free in the bitmap and can be
+// allocated
+int isBlockFree(unsigned long blockNum)
+{
+  return (_bitmap[(blockNum - 1) / 8] & (0x80 >> ((blockNum - 1) % 8))) != 0 && !freePending(blockNum);
+}
+
+// Return the first block from blockNum to limit that is free (wantFree set)
+// or busy (wantFree clear), or limit+1 if there is none. Whole words that
+// cannot match are skipped.
+unsigned long scanBitmap(unsigned long blockNum, int wantFree, unsigned long limit)
+{
+  while(blockNum <= limit)
+  {
+    if((blockNum - 1) % 64 == 0)
+    {
+      unsigned long long word = loadFreeWord((blockNum - 1) / 64);
+
+      if(wantFree ? word == 0 : word == ~0ULL)
+      {
+        blockNum += 64;
+        continue;
+      }
+    }
+
+    if(isBlockFree(blockNum) == wantFree)
+      return blockNum;
+
+    blockNum++;
+  }
+
+  return limit + 1;
+}
+
+// Find a run of count contiguous free blocks, starting the search at the
+// allocation cursor. If there is no run that long, the longest run found is
+// returned instead. Returns the first block of the run and its length in
+// runLen, or FS_FULL if there are no free blocks.
+unsigned long findFreeExtent(unsigned long count, unsigned long *runLen)
+{
+  unsigned long maxBlockNum = _fsDescriptor.bitmapLen * 8;
+  unsigned long cursorBlock = _allocCursor * 64 + 1;
+  unsigned long bestStart = 0, bestLen = 0;
+
+  if(count == 0)
+    count = 1;
+
+  *runLen = 0;
+
+  // Search from the cursor to the end of the bitmap, then from the start
+  // of the bitmap up to the cursor
+  for(int pass = 0; pass < 2 && bestLen < count && _freeBlockCount > 0; pass++)
+  {
+    unsigned long blockNum = (pass == 0 ? cursorBlock : 1);
+    unsigned long limit = (pass == 0 ? maxBlockNum : cursorBlock - 1);
+
+    while(blockNum <= limit)
+    {
+      blockNum = scanBitmap(blockNum, 1, limit);
+      if(blockNum > limit)
+        break;
+
+      unsigned long runEnd = blockNum + count - 1 < maxBlockNum ? blockNum + count - 1 : maxBlockNum;
+      unsigned long nextBusy = scanBitmap(blockNum, 0, runEnd);
+
+      if(nextBusy - blockNum > bestLen)
+      {
+        bestStart = blockNum;
+        bestLen = nextBusy - blockNum;
+
+        if(bestLen >= count)
+          break;
+      }
+
+      blockNum = nextBusy;
+    }
+  }
+
+  if(bestLen == 0)
+  {
+    _result = FS_FULL;
+    return FS_FULL;
+  }
+
+  _allocCursor = (bestStart - 1) / 64;
+  *runLen = bestLen;
+  _result = FS_OK;
+  return bestStart;
+}
+
+// Return the number of free blocks
+unsigned long getFreeBlockCount()
+{
+  return _freeBlockCount;
+}
+
+// Return the byte number and bit offset for a block within the free bitmap
+// Used by markBlockBusy and markBlockFree
+void findBlockIndex(unsigned long blockNum, unsigned int *byteNum, unsigned char *bitNum)
+{
+  *byteNum = blockNum / 8;
+  *bitNum = blockNum % 8;
+}
+
+// Mark a block as being used.
+void markBlockBusy(unsigned long blockNum)
+{
+  unsigned int byteNum;
+  unsigned char bitNum;
+
+  findBlockIndex(blockNum-1, &byteNum, &bitNum);
+
+  unsigned char testFlag = 0x80;
+  testFlag = testFlag >> bitNum;
+
+  // a reused block must not be zeroed later
+  cancelScrub(blockNum);
+
+  // a block waiting for its free to commit was never counted as free
+  if(freePending(blockNum))
+    setFreePending(blockNum, 0);
+  else if(_bitmap[byteNum] & testFlag)
+    _freeBlockCount--;
+
+  _bitmap[byteNum] &= ~testFlag;
+  markBitmapDirty(byteNum);
+}
+
+// Mark a block as being unused and free, and have it zeroed if scrub is
+// set. With the journal on, the block is only allocated again, and zeroed,
+// once the running transaction has committed.
+void freeBlock(unsigned long blockNum, int scrub)
+{
+  unsigned int byteNum;
+  unsigned char bitNum;
+  unsigned char testFlag = 0x80;
+
+  findBlockIndex(blockNum-1, &byteNum, &bitNum);
+  testFlag = testFlag >> bitNum;
+
+  if(_bitmap[byteNum] & testFlag)
+    ;
+  else if(_jnlEnabled)
+    deferFree(blockNum, scrub);
+  else
+  {
+    _freeBlockCount++;
+
+    if(scrub)
+      deferScrub(blockNum, 1);
+  }
+
+  _bitmap[byteNum] |= testFlag;
+  markBitmapDirty(byteNum);
+}
+
+// Mark a block as being unused and free. With the journal on it can only
+// be allocated again once the running transaction has committed.
+void markBlockFree(unsigned long blockNum)
+{
+  freeBlock(blockNum, 0);
+}
+
+// Mark a run of len blocks starting at startBlock as used
+void allocateRun(unsigned long startBlock, unsigned long len)
+{
+  for(unsigned long i=0; i<len; i++)
+    markBlockBusy(startBlock + i);
+}
+
+// Mark a run of len blocks starting at startBlock as free
+void freeRun(unsigned long startBlock, unsigned long len)
+{
+  for(unsigned long i=0; i<len; i++)
+    markBlockFree(startBlock + i);
+}
+
+// Update the free list
+void updateFreeList()
+{
+	storeBitmap();
+}
+
+/*
+   inode Management
+
+   */
+
+// Allocate an inode buffer for a single inode
+unsigned long *makeInodeBuffer()
+{
+	unsigned long *buffer = (unsigned long *) poolAlloc(sizeof(unsigned long) * _fsDescriptor.numInodeEntries);
+	return buffer;
+}
+
+// Return an inode buffer to the pool
+void releaseInodeBuffer(unsigned long *buffer)
+{
+	poolRelease(buffer);
+}
+
+// Load a particular inode
+void loadInode(unsigned long *inode, unsigned int inodeNumber)
+{
+  unsigned long inodeIndex = _fsDescriptor.inodeByteIndex + inodeNumber * _fsDescriptor.blockSize;
+
+  if(_ioMode == IO_MMAP)
+  {
+    memcpy(inode, _fsMap + inodeIndex, sizeof(unsigned long) * _fsDescriptor.numInodeEntries);
+    return;
+  }
+
+  devRead(inode, sizeof(unsigned long) * _fsDescriptor.numInodeEntries, inodeIndex);
+  journalOverlay(inode, sizeof(unsigned long) * _fsDescriptor.numInodeEntries, inodeIndex);
+}
+
+// Write an inode
+void saveInode(unsigned long *inode, unsigned int inodeNumber)
+{
+  unsigned long inodeIndex = _fsDescriptor.inodeByteIndex + inodeNumber * _fsDescriptor.blockSize;
+
+  // Pointer blocks go out before the inode that refers to them
+  flushPointerBlocks();
+
+  if(_ioMode == IO_MMAP)
+  {
+    memcpy(_fsMap + inodeIndex, inode, sizeof(unsigned long) * _fsDescriptor.numInodeEntries);
+    syncMappedRange(inodeIndex, sizeof(unsigned long) * _fsDescriptor.numInodeEntries);
+    return;
+  }
+
+  metaWrite(inode, sizeof(unsigned long) * _fsDescriptor.numInodeEntries, inodeIndex);
+}
+
+/*
+   Indirect blocks. In INODE_BLOCKMAP and INODE_BLOCKMAP_LZ inodes the last
+   two entries point to a single indirect and a double indirect block.
+   Pointer blocks hold numInodeEntries block numbers each. INODE_DIRECT
+   inodes have none.
+*/
+
+// Number of direct block entries in an inode
+unsigned long numDirectEntries()
+{
+  if(_fsDescriptor.inodeFormat == INODE_DIRECT)
+    return _fsDescriptor.numInodeEntries;
+
+  return _fsDescriptor.numInodeEntries - 2;
+}
+
+// Allocate a fresh, zeroed pointer block. Returns 0 if the disk is full.
+unsigned long allocPointerBlock()
+{
+  unsigned long blockNum = findFreeBlock();
+
+  if(_result == FS_FULL)
+    return 0;
+
+  markBlockBusy(blockNum);
+  cacheDrop(blockNum);
+  getPointerBlock(blockNum, 1);
+  return blockNum;
+}
+
+// Return a pointer to the entry holding the block number for a file
+// block, either in the inode or in a cached pointer block. holder is set
+// to the pointer block, or 0 for the inode. Missing pointer blocks are
+// allocated if create is set, otherwise NULL is returned.
+unsigned long *locateInodeEntry(unsigned long *inode, unsigned long fileBlock, int create, unsigned long *holder)
+{
+  unsigned long numEntries = _fsDescriptor.numInodeEntries;
+  unsigned long direct = numDirectEntries();
+
+  *holder = 0;
+
+  if(fileBlock < direct)
+    return &inode[fileBlock];
+
+  if(_fsDescriptor.inodeFormat == INODE_DIRECT)
+    return NULL;
+
+  fileBlock -= direct;
+
+  // Single indirect
+  if(fileBlock < numEntries)
+  {
+    if(inode[direct] == 0)
+    {
+      if(!create || (inode[direct] = allocPointerBlock()) == 0)
+        return NULL;
+    }
+
+    *holder = inode[direct];
+    return &getPointerBlock(inode[direct], 0)[fileBlock];
+  }
+
+  fileBlock -= numEntries;
+
+  // Double indirect
+  if(fileBlock >= numEntries * numEntries)
+    return NULL;
+
+  if(inode[direct + 1] == 0)
+  {
+    if(!create || (inode[direct + 1] = allocPointerBlock()) == 0)
+      return NULL;
+  }
+
+  unsigned long outer = inode[direct + 1];
+  unsigned long inner = getPointerBlock(outer, 0)[fileBlock / numEntries];
+
+  if(inner == 0)
+  {
+    if(!create || (inner = allocPointerBlock()) == 0)
+      return NULL;
+
+    getPointerBlock(outer, 0)[fileBlock / numEntries] = inner;
+    markPointerBlockDirty(outer);
+  }
+
+  *holder = inner;
+  return &getPointerBlock(inner, 0)[fileBlock % numEntries];
+}
+
+/*
+   Extent inodes. Entry 0 holds the number of extents and the extents
+   follow as TExtent records sorted by file block.
+*/
+
+// Return the extent table of an inode
+TExtent *inodeExtents(unsigned long *inode)
+{
+  return (TExtent *) (inode + 1);
+}
+
+// Maximum number of extents in an inode
+unsigned long maxExtents()
+{
+  return (_fsDescriptor.numInodeEntries - 1) * sizeof(unsigned long) / sizeof(TExtent);
+}
+
+// Return the index of the last extent starting at or before fileBlock, or
+// -1 if there is none
+long searchExtents(unsigned long *inode, unsigned long fileBlock)
+{
+  TExtent *extents = inodeExtents(inode);
+  long low = 0, high = (long) inode[0] - 1, found = -1;
+
+  while(low <= high)
+  {
+    long mid = (low + high) / 2;
+
+    if(extents[mid].fileBlock <= fileBlock)
+    {
+      found = mid;
+      low = mid + 1;
+    }
+    else
+      high = mid - 1;
+  }
+
+  return found;
+}
+
+// Return the block storing fileBlock in an extent inode, or 0
+unsigned long extentLookup(unsigned long *inode, unsigned long fileBlock)
+{
+  long ndx = searchExtents(inode, fileBlock);
+  TExtent *extents = inodeExtents(inode);
+
+  if(ndx < 0 || fileBlock >= extents[ndx].fileBlock + extents[ndx].length)
+    return 0;
+
+  return extents[ndx].startBlock + (fileBlock - extents[ndx].fileBlock);
+}
+
+// Open a gap of one extent at index ndx. Returns -1 if the inode is full.
+int insertExtentSlot(unsigned long *inode, long ndx)
+{
+  TExtent *extents = inodeExtents(inode);
+
+  if(inode[0] >= maxExtents())
+    return -1;
+
+  memmove(&extents[ndx + 1], &extents[ndx], (inode[0] - ndx) * sizeof(TExtent));
+  inode[0]++;
+  return 0;
+}
+
+// Map fileBlock to blockNum in an extent inode, or unmap it if blockNum is
+// 0. Extents are split and merged as needed. Returns -1 if the inode has
+// no room for another extent, leaving the inode as it was.
+int extentSet(unsigned long *inode, unsigned long fileBlock, unsigned long blockNum)
+{
+  TExtent *extents = inodeExtents(inode);
+  long ndx = searchExtents(inode, fileBlock);
+
+  // The extent the old mapping is cut from, to put back if the new one
+  // does not fit
+  long oldNdx = -1;
+  unsigned long oldCount = inode[0];
+  TExtent old;
+
+  // Remove any existing mapping of fileBlock
+  if(ndx >= 0 && fileBlock < extents[ndx].fileBlock + extents[ndx].length)
+  {
+    if(extentLookup(inode, fileBlock) == blockNum)
+      return 0;
+
+    old = extents[ndx];
+    oldNdx = ndx;
+    unsigned long before = fileBlock - old.fileBlock;
+    unsigned long after = old.length - before - 1;
+
+    if(before > 0 && after > 0)
+    {
+      // Split the extent around fileBlock
+      if(insertExtentSlot(inode, ndx + 1) != 0)
+        return -1;
+
+      extents[ndx].length = before;
+      extents[ndx + 1].fileBlock = fileBlock + 1;
+      extents[ndx + 1].startBlock = old.startBlock + before + 1;
+      extents[ndx + 1].length = after;
+    }
+    else if(before > 0)
+      extents[ndx].length = before;
+    else if(after > 0)
+    {
+      extents[ndx].fileBlock++;
+      extents[ndx].startBlock++;
+      extents[ndx].length--;
+      ndx--;
+    }
+    else
+    {
+      memmove(&extents[ndx], &extents[ndx + 1], (inode[0] - ndx - 1) * sizeof(TExtent));
+      inode[0]--;
+      ndx--;
+    }
+  }
+
+  if(blockNum == 0)
+    return 0;
+
+  // Extend the previous extent if fileBlock follows on from it
+  if(ndx >= 0 && extents[ndx].fileBlock + extents[ndx].length == fileBlock &&
+      extents[ndx].startBlock + extents[ndx].length == blockNum)
+  {
+    extents[ndx].length++;
+
+    // The next extent may now continue this one
+    if(ndx + 1 < (long) inode[0] && extents[ndx + 1].fileBlock == fileBlock + 1 &&
+        extents[ndx + 1].startBlock == blockNum + 1)
+    {
+      extents[ndx].length += extents[ndx + 1].length;
+      memmove(&extents[ndx + 1], &extents[ndx + 2], (inode[0] - ndx - 2) * sizeof(TExtent));
+      inode[0]--;
+    }
+
+    return 0;
+  }
+
+  // Or prepend it to the next extent
+  if(ndx + 1 < (long) inode[0] && extents[ndx + 1].fileBlock == fileBlock + 1 &&
+      extents[ndx + 1].startBlock == blockNum + 1)
+  {
+    extents[ndx + 1].fileBlock--;
+    extents[ndx + 1].startBlock--;
+    extents[ndx + 1].length++;
+    return 0;
+  }
+
+  if(insertExtentSlot(inode, ndx + 1) != 0)
+  {
+    // Only the old extent changed, with a slot added after it by a split
+    // or taken out where it was removed
+    if(oldNdx >= 0)
+    {
+      if(inode[0] > oldCount)
+      {
+        memmove(&extents[oldNdx + 1], &extents[oldNdx + 2], (inode[0] - oldNdx - 2) * sizeof(TExtent));
+        inode[0]--;
+      }
+      else if(inode[0] < oldCount)
+        insertExtentSlot(inode, oldNdx);
+
+      extents[oldNdx] = old;
+    }
+
+    return -1;
+  }
+
+  extents[ndx + 1].fileBlock = fileBlock;
+  extents[ndx + 1].startBlock = blockNum;
+  extents[ndx + 1].length = 1;
+  return 0;
+}
+
+// Free every run in an extent inode and clear it. Runs are zeroed now or
+// later as policy says.
+void releaseExtents(unsigned long *inode, int policy)
+{
+  TExtent *extents = inodeExtents(inode);
+  char *zeroRun = NULL;
+  int now = (policy == SCRUB_IMMEDIATE && !_jnlEnabled);
+
+  // with the journal on, zeroing waits for the delete to commit as in
+  // releaseInodeBlocks
+  if(now)
+    zeroRun = (char *) calloc(SCRUB_RUN_BLOCKS, _fsDescriptor.blockSize);
+
+  for(unsigned long i=0; i<inode[0]; i++)
+  {
+    for(unsigned long done = 0; zeroRun != NULL && done < extents[i].length; done += SCRUB_RUN_BLOCKS)
+    {
+      unsigned long count = extents[i].length - done < SCRUB_RUN_BLOCKS ? extents[i].length - done : SCRUB_RUN_BLOCKS;
+      writeBlockRun(zeroRun, extents[i].startBlock + done, count);
+    }
+
+    // cached copies of the old contents must not be written back
+    for(unsigned long j=0; zeroRun == NULL && j<extents[i].length; j++)
+      cacheDrop(extents[i].startBlock + j);
+
+    for(unsigned long j=0; j<extents[i].length; j++)
+      freeBlock(extents[i].startBlock + j, policy != SCRUB_NONE && !now);
+  }
+
+  memset(inode, 0, sizeof(unsigned long) * _fsDescriptor.numInodeEntries);
+  free(zeroRun);
+}
+
+// Return the number of blocks an inode can address
+unsigned long getMaxFileBlocks()
+{
+  unsigned long numEntries = _fsDescriptor.numInodeEntries;
+
+  // An extent inode is only limited by the size of the partition
+  if(_fsDescriptor.inodeFormat == INODE_EXTENT)
+    return _fsDescriptor.numBlocks;
+
+  if(_fsDescriptor.inodeFormat == INODE_DIRECT)
+    return numEntries;
+
+  return numDirectEntries() + numEntries + numEntries * numEntries;
+}
+
+// Set block number in an inode given a byte offset. Pointer blocks are
+// allocated as needed; _result is FS_FULL if that fails.
+void setBlockNumInInode(unsigned long *inode, unsigned long byteNumber, unsigned long blockNumber)
+{
+  unsigned long holder;
+
+  if(_fsDescriptor.inodeFormat == INODE_EXTENT)
+  {
+    // FS_FULL here means the inode has run out of extents
+    _result = (extentSet(inode, byteNumber / _fsDescriptor.blockSize, blockNumber) == 0 ? FS_OK : FS_FULL);
+    return;
+  }
+
+  pthread_mutex_lock(&_ptrCacheLock);
+
+  unsigned long *entry = locateInodeEntry(inode, byteNumber / _fsDescriptor.blockSize, 1, &holder);
+
+  if(entry == NULL)
+    _result = FS_FULL;
+  else
+  {
+    *entry = blockNumber;
+
+    if(holder != 0)
+      markPointerBlockDirty(holder);
+
+    _result = FS_OK;
+  }
+
+  pthread_mutex_unlock(&_ptrCacheLock);
+}
+
+// Get a block number from inode given a byte offset
+unsigned long returnBlockNumFromInode(unsigned long *inode, unsigned long byteNumber)
+{
+  unsigned long holder;
+
+  if(_fsDescriptor.inodeFormat == INODE_EXTENT)
+    return extentLookup(inode, byteNumber / _fsDescriptor.blockSize);
+
+  pthread_mutex_lock(&_ptrCacheLock);
+
+  unsigned long *entry = locateInodeEntry(inode, byteNumber / _fsDescriptor.blockSize, 0, &holder);
+  unsigned long blockNum = (entry == NULL ? 0 : *entry & BLOCK_NUM_MASK);
+
+  pthread_mutex_unlock(&_ptrCacheLock);
+  return blockNum;
+}
+
+// Fill blockNums with the block numbers of count file blocks starting at
+// fileBlock. Unallocated blocks are returned as 0.
+void getBlockNumsFromInode(unsigned long *inode, unsigned long fileBlock, unsigned int count, unsigned long *blockNums)
+{
+  unsigned long direct = numDirectEntries();
+  unsigned long holder;
+  unsigned int i = 0;
+
+  if(_fsDescriptor.inodeFormat == INODE_EXTENT)
+  {
+    TExtent *extents = inodeExtents(inode);
+    long ndx = searchExtents(inode, fileBlock);
 
-  for(i=0; i<_fsDescriptor.maxFiles; i++)
-    if(!strcmp(_directory[i].filename, filename))
+    // Walk forward through the extents from the first one that applies
+    for(; i < count; i++)
     {
-      _result = FS_OK;
-      return i;
+      unsigned long block = fileBlock + i;
+
+      while(ndx + 1 < (long) inode[0] && extents[ndx + 1].fileBlock <= block)
+        ndx++;
+
+      if(ndx >= 0 && block < extents[ndx].fileBlock + extents[ndx].length)
+        blockNums[i] = extents[ndx].startBlock + (block - extents[ndx].fileBlock);
+      else
+        blockNums[i] = 0;
     }
 
-  _result = FS_FILE_NOT_FOUND;
-  return FS_FILE_NOT_FOUND;
+    return;
+  }
+
+  // Direct entries can be copied straight out of the inode
+  for(; i < count && fileBlock + i < direct; i++)
+    blockNums[i] = inode[fileBlock + i] & BLOCK_NUM_MASK;
+
+  if(i == count)
+    return;
+
+  pthread_mutex_lock(&_ptrCacheLock);
+  for(; i < count; i++)
+  {
+    unsigned long *entry = locateInodeEntry(inode, fileBlock + i, 0, &holder);
+    blockNums[i] = (entry == NULL ? 0 : *entry & BLOCK_NUM_MASK);
+  }
+  pthread_mutex_unlock(&_ptrCacheLock);
 }
 
-// Change attribute for file
-void setAttr(const char *filename, unsigned int attr)
+// Get the compressed length of a cluster, 0 if it is stored as it is
+unsigned long getClusterLength(unsigned long *inode, unsigned long cluster)
 {
-  unsigned int ndx = findFile(filename);
+  unsigned long holder;
 
-  if(ndx != FS_FILE_NOT_FOUND)
-    _directory[ndx].attr = attr;
+  if(_fsDescriptor.inodeFormat != INODE_BLOCKMAP_LZ)
+    return 0;
+
+  pthread_mutex_lock(&_ptrCacheLock);
+
+  unsigned long *entry = locateInodeEntry(inode, cluster * COMPRESS_CLUSTER_BLOCKS, 0, &holder);
+  unsigned long len = (entry == NULL ? 0 : *entry >> CLUSTER_LEN_SHIFT);
+
+  pthread_mutex_unlock(&_ptrCacheLock);
+  return len;
 }
 
-// Get attribute for a file
-unsigned int getAttr(const char *filename)
+// Set the compressed length of a cluster, kept beside the block number in
+// the entry for its first block
+void setClusterLength(unsigned long *inode, unsigned long cluster, unsigned long len)
 {
-  unsigned int ndx = findFile(filename);
+  unsigned long holder;
 
-    if(ndx != FS_FILE_NOT_FOUND) {
-      return _directory[ndx].attr;
-    }else
-    return ndx;
+  pthread_mutex_lock(&_ptrCacheLock);
+
+  unsigned long *entry = locateInodeEntry(inode, cluster * COMPRESS_CLUSTER_BLOCKS, 0, &holder);
+
+  if(entry != NULL)
+  {
+    *entry = (*entry & BLOCK_NUM_MASK) | (len << CLUSTER_LEN_SHIFT);
+
+    if(holder != 0)
+      markPointerBlockDirty(holder);
+  }
+
+  pthread_mutex_unlock(&_ptrCacheLock);
 }
 
-void updateDirectory()
+// Free the data blocks in a list of numEntries block numbers, writing
+// zeroBlock over them first if it is given or queueing them to be zeroed
+// if defer is set. The list is cleared.
+void releaseBlockList(unsigned long *blockNums, unsigned long numEntries, char *zeroBlock, int defer)
 {
-	storeDirectory();
+  for(unsigned long i=0; i<numEntries; i++)
+    if((blockNums[i] &= BLOCK_NUM_MASK) != 0)
+    {
+      if(zeroBlock != NULL)
+        writeBlock(zeroBlock, blockNums[i]);
+      else
+        cacheDrop(blockNums[i]);
+
+      freeBlock(blockNums[i], defer);
+      blockNums[i] = 0;
+    }
+}
+
+// Free every block owned by an inode, including its pointer blocks, and
+// clear the inode. If scrub is set data blocks are zeroed now or later as
+// the scrub policy says.
+void releaseInodeBlocks(unsigned long *inode, int scrub)
+{
+  unsigned long numEntries = _fsDescriptor.numInodeEntries;
+  unsigned long direct = numDirectEntries();
+  int policy = (scrub ? _scrubPolicy : SCRUB_NONE);
+
+  if(_fsDescriptor.inodeFormat == INODE_EXTENT)
+  {
+    releaseExtents(inode, policy);
+    return;
+  }
+
+  // with the journal on, blocks are zeroed only once the delete has
+  // committed, and waitForScrub waits for them under SCRUB_IMMEDIATE
+  int now = (policy == SCRUB_IMMEDIATE && !_jnlEnabled);
+  char *zeroBlock = (now ? makeDataBuffer() : NULL);
+  int defer = (policy != SCRUB_NONE && !now);
+
+  releaseBlockList(inode, direct, zeroBlock, defer);
+
+  if(_fsDescriptor.inodeFormat == INODE_DIRECT)
+  {
+    releaseDataBuffer(zeroBlock);
+    return;
+  }
+
+  pthread_mutex_lock(&_ptrCacheLock);
+  if(inode[direct] != 0)
+  {
+    releaseBlockList(getPointerBlock(inode[direct], 0), numEntries, zeroBlock, defer);
+    dropPointerBlock(inode[direct]);
+    markBlockFree(inode[direct]);
+    inode[direct] = 0;
+  }
+
+  if(inode[direct + 1] != 0)
+  {
+    unsigned long outer = inode[direct + 1];
+
+    for(unsigned long i=0; i<numEntries; i++)
+    {
+      unsigned long inner = getPointerBlock(outer, 0)[i];
+
+      if(inner != 0)
+      {
+        releaseBlockList(getPointerBlock(inner, 0), numEntries, zeroBlock, defer);
+        dropPointerBlock(inner);
+        markBlockFree(inner);
+      }
+    }
+
+    dropPointerBlock(outer);
+    markBlockFree(outer);
+    inode[direct + 1] = 0;
+  }
+  pthread_mutex_unlock(&_ptrCacheLock);
+
+  releaseDataBuffer(zeroBlock);
 }
 
 /*
 
-   Free List Management
+   Read/write data block. Block numbers start from 1, not 0.
 
    */
 
-// Scans the bitmap for a free block. 
-unsigned long findFreeBlock()
+// Create a data buffer
+char *makeDataBuffer()
 {
-  unsigned long maxBlockNum = _fsDescriptor.bitmapLen * 8;
-  char testFlag = 0x80;
-  unsigned int byteNdx=0;
-  char bitPos = 0;
+	char *buffer = (char *) poolAlloc(_fsDescriptor.blockSize);
+	return buffer;
+}
+
+// Return a data buffer to the pool
+void releaseDataBuffer(char *buffer)
+{
+	poolRelease(buffer);
+}
+
+// Read a data block, from the block cache if possible
+void readBlock(char *buffer, unsigned long blockNum)
+{
+  pthread_mutex_lock(&_cacheLock);
+
+  int slot = cacheLookup(blockNum);
+
+  if(slot == -1)
+  {
+    // A block being written has no cached copy until the write is done
+    waitForWrites(blockNum, 1);
+    slot = cacheAssign(blockNum);
 
-  for(unsigned long i = 0; i<maxBlockNum; i++)
-    if(_bitmap[byteNdx] & testFlag)
+    // A block that could not be read is not cached
+    if(diskReadBlock(_cache[slot].data, blockNum) != 0)
     {
-      _result = FS_OK;
-			return i+1;
+      cacheUnhash(slot);
+      _cache[slot].blockNum = 0;
+      memset(buffer, 0, _fsDescriptor.blockSize);
+      pthread_mutex_unlock(&_cacheLock);
+      return;
     }
+  }
+  else
+    cacheTouch(slot);
+
+  memcpy(buffer, _cache[slot].data, _fsDescriptor.blockSize);
+  pthread_mutex_unlock(&_cacheLock);
+}
+
+// Write a data block. The block is only written to disk when it is evicted
+// from the cache or when flushBlockCache is called.
+void writeBlock(char *buffer, unsigned long blockNum)
+{
+  pthread_mutex_lock(&_cacheLock);
+
+  // The copy written back later must not land before a write in flight
+  waitForWrites(blockNum, 1);
+
+  int slot = cacheLookup(blockNum);
+
+  if(slot == -1)
+    slot = cacheAssign(blockNum);
+  else
+    cacheTouch(slot);
+
+  memcpy(_cache[slot].data, buffer, _fsDescriptor.blockSize);
+  _cache[slot].dirty = 1;
+  pthread_mutex_unlock(&_cacheLock);
+}
+
+// Encrypt and write count blocks of a run, starting at block first
+void writeRunChunk(void *arg, unsigned long first, unsigned long count)
+{
+  TBlockRun *run = (TBlockRun *) arg;
+  unsigned long offset = first * _fsDescriptor.blockSize;
+
+  for(unsigned long i=0; i<count; i++)
+  {
+    const char *block = run->buffer + offset + i * _fsDescriptor.blockSize;
+
+    if(_ioMode == IO_MMAP)
+      encdecBlock(_fsMap + locateDataBlock(run->startBlock - 1 + first + i), block, _fsDescriptor.blockSize);
     else
+      encdecBlock(run->encBuffer + offset + i * _fsDescriptor.blockSize, block, _fsDescriptor.blockSize);
+  }
+
+  if(_ioMode != IO_MMAP &&
+      devWrite(run->encBuffer + offset, count * _fsDescriptor.blockSize, locateDataBlock(run->startBlock - 1 + first)) != 0)
+    __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+}
+
+// Write count consecutive blocks starting at startBlock straight to disk
+// with a single write. Cached copies of the blocks are kept in step.
+void writeBlockRun(const char *buffer, unsigned long startBlock, unsigned long count)
+{
+  unsigned long len = count * _fsDescriptor.blockSize;
+  char *runBuffer = (_ioMode == IO_MMAP ? NULL : getRunBuffer(len));
+
+  waitForWrites(startBlock, count);
+
+  pthread_mutex_lock(&_cacheLock);
+  for(unsigned long i=0; i<count; i++)
+  {
+    int slot = cacheLookup(startBlock + i);
+
+    if(slot != -1)
     {
-      bitPos = (bitPos + 1) % 8;
-      if(bitPos)
-        testFlag = testFlag >> 1;
-      else
-      {
-        byteNdx++;
-        testFlag = 0x80;
-      }
+      memcpy(_cache[slot].data, buffer + i * _fsDescriptor.blockSize, _fsDescriptor.blockSize);
+      _cache[slot].dirty = 0;
     }
+  }
+  pthread_mutex_unlock(&_cacheLock);
 
-  // Return 999999999 as full flag
-  _result = FS_FULL;
-  return FS_FULL;
+  TBlockRun run = {(char *) buffer, runBuffer, startBlock};
+
+  runParallel(writeRunChunk, &run, count);
+
+  // The chunks may have run on other threads
+  if(run.failed)
+    _result = FS_ERROR;
 }
 
-// Return the byte number and bit offset for a block within the free bitmap
-// Used by markBlockBusy and markBlockFree
-void findBlockIndex(unsigned long blockNum, unsigned int *byteNum, unsigned char *bitNum)
+// Read and decrypt count blocks of a run in place, starting at block first
+void readRunChunk(void *arg, unsigned long first, unsigned long count)
 {
-//  *byteNum = blockNum / 8;
-  *bitNum = blockNum % 8;
+  TBlockRun *run = (TBlockRun *) arg;
+  char *target = run->buffer + first * _fsDescriptor.blockSize;
+
+  if(devRead(target, count * _fsDescriptor.blockSize, locateDataBlock(run->startBlock - 1 + first)) != 0)
+    __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+
+  for(unsigned long i=0; i<count; i++)
+    encdecBlock(target + i * _fsDescriptor.blockSize, target + i * _fsDescriptor.blockSize, _fsDescriptor.blockSize);
 }
 
-// Mark a block as being used.
-void markBlockBusy(unsigned long blockNum)
+// Read count blocks, numbered in blockNums, into consecutive blocks of
+// buffer. Adjacent block numbers that are not cached are fetched with a
+// single pread and decrypted in place. Block number 0 reads as zeros.
+void readBlocks(char *buffer, const unsigned long *blockNums, unsigned int count)
 {
-  unsigned int byteNum;
-  unsigned char bitNum;
+  unsigned int blockSize = _fsDescriptor.blockSize;
+  unsigned int i = 0;
 
-  findBlockIndex(blockNum-1, &byteNum, &bitNum);
+  while(i < count)
+  {
+    char *target = buffer + (unsigned long) i * blockSize;
 
-  unsigned char testFlag = 0x80;
-  testFlag = testFlag >> bitNum;
-  _bitmap[byteNum] &= ~testFlag;
+    pthread_mutex_lock(&_cacheLock);
+    int slot = (blockNums[i] != 0 ? cacheLookup(blockNums[i]) : -1);
+
+    if(slot != -1)
+      memcpy(target, _cache[slot].data, blockSize);
+    pthread_mutex_unlock(&_cacheLock);
+
+    if(blockNums[i] == 0)
+      memset(target, 0, blockSize);
+    else if(slot != -1)
+      ;
+    else if(_ioMode == IO_MMAP)
+      diskReadBlock(target, blockNums[i]);
+    else
+    {
+      unsigned int run = 1;
+
+      pthread_mutex_lock(&_cacheLock);
+      while(i + run < count && blockNums[i + run] == blockNums[i] + run && cacheLookup(blockNums[i + run]) == -1)
+        run++;
+      pthread_mutex_unlock(&_cacheLock);
+
+      TBlockRun blockRun = {target, NULL, blockNums[i]};
+
+      waitForWrites(blockNums[i], run);
+      runParallel(readRunChunk, &blockRun, run);
+      if(blockRun.failed)
+        _result = FS_ERROR;
+
+      i += run;
+      continue;
+    }
+
+    i++;
+  }
 }
 
-// Mark a block as being unused and free
-void markBlockFree(unsigned long blockNum)
+// Copy a block out of the block cache. Returns 1 if it was cached, 0 if not.
+int readCachedBlock(char *buffer, unsigned long blockNum)
 {
-  unsigned int byteNum;
-  unsigned char bitNum;
-  unsigned char testFlag = 0x80;
+  pthread_mutex_lock(&_cacheLock);
 
-  findBlockIndex(blockNum-1, &byteNum, &bitNum);
-  testFlag = testFlag >> bitNum;
-  _bitmap[byteNum] |= testFlag;
+  int slot = cacheLookup(blockNum);
+
+  if(slot != -1)
+  {
+    memcpy(buffer, _cache[slot].data, _fsDescriptor.blockSize);
+    cacheTouch(slot);
+  }
+
+  pthread_mutex_unlock(&_cacheLock);
+  return slot != -1;
 }
 
-// Update the free list
-void updateFreeList()
+// Write count blocks from consecutive blocks of buffer to the blocks
+// numbered in blockNums. Adjacent block numbers go out in a single write.
+void writeBlocks(const char *buffer, const unsigned long *blockNums, unsigned int count)
 {
-	storeBitmap();
+  unsigned int blockSize = _fsDescriptor.blockSize;
+  unsigned int i = 0;
+
+  while(i < count)
+  {
+    unsigned int run = 1;
+
+    // Block number 0 is not a block
+    if(blockNums[i] == 0)
+    {
+      i++;
+      continue;
+    }
+
+    while(i + run < count && blockNums[i + run] == blockNums[i] + run)
+      run++;
+
+    writeBlockRun(buffer + (unsigned long) i * blockSize, blockNums[i], run);
+    i += run;
+  }
+}
+
+// Write all dirty cached blocks to disk
+void flushBlockCache()
+{
+  int dirtySlots[BLOCK_CACHE_SIZE];
+  int count = 0;
+
+  pthread_mutex_lock(&_cacheLock);
+
+  for(int i=0; i<BLOCK_CACHE_SIZE; i++)
+    if(_cache[i].blockNum != 0 && _cache[i].dirty)
+      dirtySlots[count++] = i;
+
+  qsort(dirtySlots, count, sizeof(int), compareCacheSlots);
+
+  for(int i=0; i<count; i++)
+  {
+    diskWriteBlock(_cache[dirtySlots[i]].data, _cache[dirtySlots[i]].blockNum);
+    _cache[dirtySlots[i]].dirty = 0;
+  }
+  pthread_mutex_unlock(&_cacheLock);
+
+  if(_ioMode == IO_MMAP)
+    syncMappedRange(_fsDescriptor.dataByteIndex, _fsMapLen - _fsDescriptor.dataByteIndex);
 }
 
 /*
-   inode Management
+
+   Asynchronous block requests
 
    */
 
-// Allocate an inode buffer for a single inode
-unsigned long *makeInodeBuffer()
+// Encrypt count blocks of a request into its cipher text buffer
+void encryptRunChunk(void *arg, unsigned long first, unsigned long count)
 {
-	unsigned long *buffer = (unsigned long *) calloc(sizeof(unsigned long), _fsDescriptor.numInodeEntries);
-	return buffer;
+  TIORequest *req = (TIORequest *) arg;
+  unsigned long offset = first * _fsDescriptor.blockSize;
+
+  for(unsigned long i=0; i<count; i++)
+    encdecBlock(req->encBuffer + offset + i * _fsDescriptor.blockSize,
+                req->buffer + offset + i * _fsDescriptor.blockSize, _fsDescriptor.blockSize);
 }
 
-// Load a particular inode
-void loadInode(unsigned long *inode, unsigned int inodeNumber)
+// Hand a prepared request to the engine
+void queueRequest(TIORequest *req)
 {
-  unsigned long inodeIndex = _fsDescriptor.inodeByteIndex + inodeNumber * _fsDescriptor.blockSize;
-  fseek(_fsfp, inodeIndex, SEEK_SET);
-  fread(inode, sizeof(unsigned long), _fsDescriptor.numInodeEntries, _fsfp);
+  if(_ringFd >= 0)
+  {
+    pthread_mutex_lock(&_ringLock);
+
+    // Keep the rings from overflowing
+    while(_ringQueued + _ringInFlight >= IO_RING_DEPTH)
+      waitRing();
+
+    queueRingEntry(req);
+    pthread_mutex_unlock(&_ringLock);
+    return;
+  }
+
+  pthread_mutex_lock(&_aioLock);
+  if(_aioQueueTail == NULL)
+    _aioQueueHead = req;
+  else
+    _aioQueueTail->queueNext = req;
+  _aioQueueTail = req;
+  pthread_cond_signal(&_aioWork);
+  pthread_mutex_unlock(&_aioLock);
 }
 
-// Write an inode
-void saveInode(unsigned long *inode, unsigned int inodeNumber)
+// Reset the bookkeeping fields of a request
+void initRequest(TIORequest *req, int isWrite)
 {
-  unsigned long inodeIndex = _fsDescriptor.inodeByteIndex + inodeNumber * _fsDescriptor.blockSize;
-  fseek(_fsfp, inodeIndex, SEEK_SET);
-  fwrite(inode, sizeof(unsigned long), _fsDescriptor.numInodeEntries, _fsfp);
+  req->isWrite = isWrite;
+  req->encBuffer = NULL;
+  req->transferred = 0;
+  req->result = FS_OK;
+  req->done = 0;
+  req->queueNext = NULL;
 }
 
-// Set block number in an inode given a byte offset
-void setBlockNumInInode(unsigned long *inode, unsigned long byteNumber, unsigned long blockNumber)
+// Start reading a run of blocks. Dirty cached copies are written back first
+// so the partition holds the latest data.
+void submitBlockRead(TIORequest *req)
 {
-  unsigned int index = byteNumber / _fsDescriptor.blockSize;
-  inode[index] = blockNumber;
+  initRequest(req, 0);
+  waitForWrites(req->startBlock, req->count);
+
+  pthread_mutex_lock(&_cacheLock);
+  for(unsigned long i=0; i<req->count; i++)
+  {
+    int slot = cacheLookup(req->startBlock + i);
+
+    if(slot != -1 && _cache[slot].dirty)
+    {
+      diskWriteBlock(_cache[slot].data, _cache[slot].blockNum);
+      _cache[slot].dirty = 0;
+    }
+  }
+  pthread_mutex_unlock(&_cacheLock);
+
+  // The cipher text of the run is contiguous in the mapping
+  if(_ioMode == IO_MMAP)
+  {
+    memcpy(req->buffer, _fsMap + locateDataBlock(req->startBlock - 1), requestLength(req));
+    completeRequest(req, FS_OK);
+    return;
+  }
+
+  queueRequest(req);
 }
 
-// Get a block number from inode given a byte offset
-unsigned long returnBlockNumFromInode(unsigned long *inode, unsigned long byteNumber)
+// Start writing a run of blocks. The data is encrypted before this returns,
+// but the caller's buffer must stay valid until the request is done.
+void submitBlockWrite(TIORequest *req)
 {
-  unsigned int index = byteNumber / _fsDescriptor.blockSize;
-  return inode[index];
-}
+  initRequest(req, 1);
 
-/*
+  if(_ioMode == IO_MMAP)
+  {
+    writeBlockRun(req->buffer, req->startBlock, req->count);
+    completeRequest(req, FS_OK);
+    return;
+  }
 
-   Read/write data block. Block numbers start from 1, not 0.
+  // An earlier write of the same blocks must land first. Cached copies are
+  // dropped rather than updated, so readers find the blocks on disk once
+  // the write is done and not before.
+  pthread_mutex_lock(&_cacheLock);
+  waitForWrites(req->startBlock, req->count);
+  setWriteInFlight(req, 1);
+  for(unsigned long i=0; i<req->count; i++)
+  {
+    int slot = cacheLookup(req->startBlock + i);
 
-   */
+    if(slot != -1)
+    {
+      cacheUnhash(slot);
+      _cache[slot].blockNum = 0;
+      _cache[slot].dirty = 0;
+    }
+  }
+  pthread_mutex_unlock(&_cacheLock);
 
-// Create a data buffer
-char *makeDataBuffer()
-{
-	char *buffer = (char *) calloc(sizeof(char), _fsDescriptor.blockSize);
-	return buffer;
+  req->encBuffer = (char *) calloc(sizeof(char), requestLength(req));
+  runParallel(encryptRunChunk, req, req->count);
+
+  queueRequest(req);
 }
 
-// Read a data block from disk
-void readBlock(char *buffer, unsigned long blockNum)
+// Submit queued requests to the kernel and reap any that have finished,
+// without waiting
+void pollBlockRequests()
 {
-  unsigned long byteIndex = locateDataBlock(blockNum-1);
-  fseek(_fsfp, byteIndex, SEEK_SET);
-  fread(_encBuffer, sizeof(char), _fsDescriptor.blockSize, _fsfp);
-  encdec(buffer, _encBuffer, _fsDescriptor.blockSize, _password, strlen(_password));
+  if(_ringFd < 0)
+    return;
+
+  pthread_mutex_lock(&_ringLock);
+  enterRing();
+  collectRing();
+  pthread_mutex_unlock(&_ringLock);
 }
 
-// Write a data block to disk
-void writeBlock(char *buffer, unsigned long blockNum)
+// Wait for a request to finish
+void waitBlockRequest(TIORequest *req)
 {
-  unsigned long byteIndex = locateDataBlock(blockNum-1);
-  fseek(_fsfp, byteIndex, SEEK_SET);
-  encdec(_encBuffer, buffer, _fsDescriptor.blockSize, _password, strlen(_password));
-  fwrite(_encBuffer, sizeof(char), _fsDescriptor.blockSize, _fsfp);
+  if(_ringFd >= 0)
+  {
+    pthread_mutex_lock(&_ringLock);
+    while(!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE))
+      waitRing();
+    pthread_mutex_unlock(&_ringLock);
+    return;
+  }
+
+  pthread_mutex_lock(&_aioLock);
+  while(!req->done)
+    pthread_cond_wait(&_aioDone, &_aioLock);
+  pthread_mutex_unlock(&_aioLock);
 }
@@ -9,6 +9,71 @@
 // Maximum filename length
 #define MAX_FNAME_LEN 32
 
+// Number of data blocks held in the write-back block cache
+#ifndef BLOCK_CACHE_SIZE
+#define BLOCK_CACHE_SIZE 256
+#endif
+
+// Number of hash chains in the block cache
+#define BLOCK_CACHE_HASH (BLOCK_CACHE_SIZE * 2)
+
+// Number of indirect inode pointer blocks held in memory
+#ifndef POINTER_CACHE_SIZE
+#define POINTER_CACHE_SIZE 64
+#endif
+
+// Number of blocks zeroed per write when scrubbing an extent or a run of deferred blocks
+#define SCRUB_RUN_BLOCKS 64
+
+// Most I/O worker threads started at mount, one per extra online CPU
+#ifndef IO_MAX_WORKERS
+#define IO_MAX_WORKERS 32
+#endif
+
+// Fewest blocks in a chunk of a run handed to an I/O worker
+#define PARALLEL_CHUNK_BLOCKS 32
+
+// Entries in the io_uring used for asynchronous block requests
+#define IO_RING_DEPTH 64
+
+// Threads serving asynchronous block requests when io_uring is unavailable
+#define AIO_EMULATION_THREADS 4
+
+// Inode and data buffers allocated together when a buffer pool grows
+#define POOL_SLAB_BUFFERS 16
+
+// Granularity in bytes of dirty tracking for the free list bitmap
+#define BITMAP_PAGE_SIZE 512
+
+// Longest a journal transaction stays open before it is committed
+#define JOURNAL_COMMIT_MS 50
+
+// A transaction this large commits as soon as the operations in it end
+#define JOURNAL_COMMIT_BYTES (1024 * 1024)
+
+// Journal blocks makefs adds by default beyond two copies of the directory and bitmap
+#define JOURNAL_SPARE_BLOCKS 64
+
+// Logical blocks in a compression cluster. A cluster whose data compresses
+// into fewer blocks is stored in that many and the rest are freed.
+#define COMPRESS_CLUSTER_BLOCKS 8
+
+// Entries in the compressor's match table, as a power of two
+#define LZ_HASH_BITS 12
+
+// Shortest match the compressor encodes
+#define LZ_MIN_MATCH 4
+
+// A block map entry holds a block number in its low 32 bits. The first
+// entry of a compressed cluster holds the length of the compressed data in
+// its high 32 bits.
+#define BLOCK_NUM_MASK 0xffffffffUL
+#define CLUSTER_LEN_SHIFT 32
+
+// Magic numbers of the journal header and of each committed transaction
+#define JOURNAL_MAGIC 0x4c4e524aUL
+#define JOURNAL_TXN_MAGIC 0x314e5854UL
+
 
 enum
 {
@@ -20,6 +85,39 @@ enum
   FS_DUPLICATE_FILE=6666666
 };
 
+/* Partition I/O backends, selected when mounting */
+enum
+{
+  IO_PREAD = 0, // pread/pwrite on the partition file
+  IO_MMAP = 1 // Partition file mapped into memory, written back with msync
+};
+
+/* Scrub policies for the blocks of deleted files */
+enum
+{
+  SCRUB_IMMEDIATE = 0, // Zero the blocks before the delete returns
+  SCRUB_DEFERRED = 1, // Queue the blocks for a background thread to zero
+  SCRUB_NONE = 2 // Leave the old contents in place
+};
+
+/* Inode formats, recorded in the file system descriptor by makefs. Older
+   partitions have 0 there and are INODE_DIRECT. */
+enum
+{
+  INODE_DIRECT = 0, // One entry per block and no indirect blocks
+  INODE_BLOCKMAP = 0x424d5031, // One entry per block, with single and double indirect blocks
+  INODE_BLOCKMAP_LZ = 0x424d5a31, // INODE_BLOCKMAP, with clusters compressed by a built-in LZ coder
+  INODE_EXTENT = 0x45585431 // Runs of contiguous blocks, see TExtent
+};
+
+/* Journal record types */
+enum
+{
+  JOURNAL_WRITE = 1, // Bytes to write at byteIndex
+  JOURNAL_REVOKE = 2, // Earlier writes to the range must not be replayed
+  JOURNAL_DEAD = 3 // A write revoked within its own transaction
+};
+
 /*
 
    Data structure definitions for the file system
@@ -40,6 +138,7 @@ typedef struct fs
   unsigned int bitmapByteIndex; // Index to the bitmap entry
   unsigned int inodeByteIndex; // Index to inode table
   unsigned int dataByteIndex; // Index to first data block
+  unsigned int inodeFormat; // INODE_DIRECT, INODE_BLOCKMAP, INODE_BLOCKMAP_LZ or INODE_EXTENT
 } TFileSystemStruct;
 
 typedef struct dir
@@ -50,7 +149,60 @@ typedef struct dir
   unsigned long inode;
 } TDirectory;
 
-extern unsigned long _result; // Result of file system operation
+// An extent inode holds a count of extents in entry 0 followed by the
+// extents, sorted by fileBlock
+typedef struct extent
+{
+  unsigned long fileBlock; // First block of the file covered
+  unsigned long startBlock; // Block it is stored in
+  unsigned long length; // Number of blocks in the run
+} TExtent;
+
+// The metadata journal lies between the inode table and the first data
+// block. Its first block holds the header; committed transactions follow,
+// each a TJournalTxn and its records. Partitions with no gap there have no
+// journal.
+typedef struct journalHeader
+{
+  unsigned long magic; // JOURNAL_MAGIC
+  unsigned long tailSeq; // Sequence number of the first transaction to replay
+} TJournalHeader;
+
+typedef struct journalTxn
+{
+  unsigned long magic; // JOURNAL_TXN_MAGIC
+  unsigned long seq; // Sequence number, one more than the previous transaction
+  unsigned long len; // Bytes in the transaction, this header included
+  unsigned long checksum; // Of the records, to catch a torn write
+} TJournalTxn;
+
+// A record, followed for JOURNAL_WRITE by len bytes padded to a multiple of 8
+typedef struct journalRecord
+{
+  unsigned long type; // JOURNAL_WRITE, JOURNAL_REVOKE or JOURNAL_DEAD
+  unsigned long byteIndex; // Partition offset of the range
+  unsigned long len; // Bytes in the range
+} TJournalRecord;
+
+// An asynchronous request to move a run of consecutive blocks. The caller
+// fills in the first three fields and keeps the request and its buffer
+// valid until done is set.
+typedef struct ioRequest
+{
+  char *buffer; // Plain text, count blocks long
+  unsigned long startBlock; // First block of the run
+  unsigned long count; // Number of blocks
+
+  int isWrite; // Set for writes
+  char *encBuffer; // Cipher text of a write in flight
+  unsigned long transferred; // Bytes moved so far
+  unsigned long result; // FS_OK or FS_ERROR once done
+  int done; // Set when the request has completed
+  struct ioRequest *queueNext; // Engine queue link
+  struct ioRequest *next; // Free for the caller's use
+} TIORequest;
+
+extern thread_local unsigned long _result; // Result of file system operation, per thread
 
 /*
 
@@ -65,8 +217,8 @@ extern unsigned long _result; // Result of file system operation
    */
 
 // Mount the file system. File system is stored on disk in "filename", password to 
-// encrypt decrypt given in password
-void mountFS(const char *filename, const char *password);
+// encrypt decrypt given in password. ioMode selects the partition I/O backend.
+void mountFS(const char *filename, const char *password, int ioMode = IO_PREAD);
 
 // Unmount the file system
 void unmountFS();
@@ -74,6 +226,52 @@ void unmountFS();
 // Return FS information
 TFileSystemStruct *getFSInfo();
 
+/*
+
+   Locking. The directory and bitmap routines do not lock; threaded callers
+   hold the metadata lock around them, exclusive when making changes. The
+   block and pointer caches lock themselves.
+
+   */
+
+// Lock the directory and bitmap. exclusive is nonzero for changes.
+void lockMetadata(int exclusive);
+
+// Release the metadata lock
+void unlockMetadata();
+
+/*
+
+   Metadata journal. Directory, bitmap, inode and pointer block writes are
+   logged and reach their home locations once the transaction holding them
+   commits. Transactions commit every JOURNAL_COMMIT_MS, so the writes of
+   many operations share one journal write and one sync. Operations that
+   must commit as a whole are bracketed by beginJournalOp/endJournalOp. The
+   journal is off for mapped partitions, whose metadata is written in place.
+
+   Blocks freed while the journal is on are not allocated again until the
+   transaction that freed them has committed. A free that drops a reference
+   held by committed metadata must therefore be made in the same operation
+   as the metadata write that drops it. Likewise a pointer block naming
+   newly allocated blocks must not commit before the free list that marks
+   them used, so allocation happens inside an operation that stores it.
+
+   A transaction commits once it passes half the journal. One that still
+   does not fit, which takes a single operation larger than the journal,
+   is logged in parts that are each atomic but not atomic as a whole.
+
+   */
+
+// Start an operation. Call before taking any lock. Operations nest.
+void beginJournalOp();
+
+// End an operation
+void endJournalOp();
+
+// Commit the running transaction once the operations in it end, and make the
+// blocks it freed available. Do not call inside an operation or with a lock held.
+void commitJournal();
+
 /*
 
    Directory Management
@@ -117,12 +315,26 @@ void updateDirectory();
 // Scans the bitmap for a free block. 
 unsigned long findFreeBlock();
 
+// Scans the bitmap for count contiguous free blocks. Returns the first block
+// of the longest run found, up to count blocks, and its length in runLen.
+unsigned long findFreeExtent(unsigned long count, unsigned long *runLen);
+
+// Return the number of free blocks
+unsigned long getFreeBlockCount();
+
 // Mark a block as being used.
 void markBlockBusy(unsigned long blockNum);
 
-// Mark a block as being unused and free
+// Mark a block as being unused and free. With the journal on, the block is only
+// allocated again once the running transaction has committed.
 void markBlockFree(unsigned long blockNum);
 
+// Mark a run of blocks as being used
+void allocateRun(unsigned long startBlock, unsigned long len);
+
+// Mark a run of blocks as being unused and free
+void freeRun(unsigned long startBlock, unsigned long len);
+
 // Update the free list
 void updateFreeList();
 /*
@@ -133,18 +345,49 @@ void updateFreeList();
 // Allocate an inode buffer for a single inode
 unsigned long *makeInodeBuffer();
 
+// Release an inode buffer from makeInodeBuffer. Do not free() it.
+void releaseInodeBuffer(unsigned long *buffer);
+
 // Load a particular inode
 void loadInode(unsigned long *inode, unsigned int inodeNumber);
 
 // Write an inode
 void saveInode(unsigned long *inode, unsigned int inodeNumber);
 
-// Set block number in an inode given a byte offset
+// Set block number in an inode given a byte offset. Indirect blocks are
+// allocated as needed.
 void setBlockNumInInode(unsigned long *inode, unsigned long byteNumber, unsigned long blockNumber);
 
 // Get a block number from inode given a byte offset
 unsigned long returnBlockNumFromInode(unsigned long *inode, unsigned long byteNumber);
 
+// Get the block numbers for count consecutive file blocks starting at fileBlock
+void getBlockNumsFromInode(unsigned long *inode, unsigned long fileBlock, unsigned int count, unsigned long *blockNums);
+
+// Return the maximum number of blocks in a file
+unsigned long getMaxFileBlocks();
+
+// Get the compressed length of a cluster of COMPRESS_CLUSTER_BLOCKS file blocks.
+// 0 means the cluster is stored as it is. Always 0 unless the partition is compressed.
+unsigned long getClusterLength(unsigned long *inode, unsigned long cluster);
+
+// Set the compressed length of a cluster. Its first block must be allocated.
+void setClusterLength(unsigned long *inode, unsigned long cluster, unsigned long len);
+
+// Free all blocks held by an inode and clear it. If scrub is set the blocks are
+// zeroed as the scrub policy says.
+void releaseInodeBlocks(unsigned long *inode, int scrub);
+
+// Choose how freed blocks are scrubbed. The policy at mount is SCRUB_DEFERRED,
+// unless the EFS_SCRUB environment variable names another: "immediate",
+// "deferred" or "none". Blocks still queued are zeroed before unmountFS returns.
+// With the journal on, freed blocks are only queued once their free has committed.
+void setScrubPolicy(int policy);
+
+// Under SCRUB_IMMEDIATE with the journal on, commit and wait until the freed blocks
+// have been zeroed. Call after the operation that freed them, with no lock held.
+void waitForScrub();
+
 /*
 
    Read/write data block
@@ -154,8 +397,69 @@ unsigned long returnBlockNumFromInode(unsigned long *inode, unsigned long byteNu
 // Create a data buffer
 char *makeDataBuffer();
 
+// Release a data buffer from makeDataBuffer. Do not free() it.
+void releaseDataBuffer(char *buffer);
+
 // Read a data block from disk
 void readBlock(char *buffer, unsigned long blockNum);
 
-// Write a data block to disk
+// Write a data block. Goes to the block cache; see flushBlockCache.
 void writeBlock(char *buffer, unsigned long blockNum);
+
+// Write a run of consecutive blocks to disk with a single write
+void writeBlockRun(const char *buffer, unsigned long startBlock, unsigned long count);
+
+// Read a list of blocks into consecutive blocks of buffer. Adjacent block
+// numbers are read together with one system call.
+void readBlocks(char *buffer, const unsigned long *blockNums, unsigned int count);
+
+// Copy a block from the block cache. Returns 0 without reading if it is not cached.
+int readCachedBlock(char *buffer, unsigned long blockNum);
+
+// Write consecutive blocks of buffer to a list of blocks. Adjacent block
+// numbers are written together with one system call.
+void writeBlocks(const char *buffer, const unsigned long *blockNums, unsigned int count);
+
+// Write all dirty blocks in the block cache to disk
+void flushBlockCache();
+
+// Forget any cached copy of a block without writing it back. For blocks being freed.
+void cacheDrop(unsigned long blockNum);
+
+/*
+
+   Asynchronous block requests. Requests go to an io_uring where the kernel
+   supports it and to a small pool of I/O threads otherwise.
+
+   */
+
+// Start reading a run of blocks into req->buffer
+void submitBlockRead(TIORequest *req);
+
+// Start writing a run of blocks from req->buffer. Reads and writes of the blocks
+// that start before it is done wait for it.
+void submitBlockWrite(TIORequest *req);
+
+// Send queued requests to the device and collect finished ones without blocking
+void pollBlockRequests();
+
+// Wait for a request to finish
+void waitBlockRequest(TIORequest *req);
+
+/*
+
+   Compression. Data is compressed before it is encrypted, since the cipher
+   text does not compress.
+
+   */
+
+// Compress len bytes of src into dst, which holds dstLen bytes. Returns the
+// compressed length, or 0 if it does not fit.
+unsigned long compressData(const char *src, unsigned long len, char *dst, unsigned long dstLen);
+
+// Decompress len bytes of src into dst, which holds dstLen bytes. Returns the
+// decompressed length, or -1 if the data is damaged or does not fit.
+long decompressData(const char *src, unsigned long len, char *dst, unsigned long dstLen);
+
+// Encrypt/decrypt up to one block of data with the mount password
+void encdecBlock(char *targetBuffer, const char *message, unsigned int len);
@@ -0,0 +1,621 @@
+#include "efs.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Inodes read from the inode table at a time by each scan thread
+#define SCAN_CHUNK_INODES 64
+
+// Most scan threads, one per online CPU
+#define MAX_SCAN_THREADS 32
+
+/*
+
+   efsck reads the metadata straight from the partition file. It needs no
+   password: only file data is encrypted. The first pass counts the owners
+   of every block from all live inodes, in parallel. With -r a second pass
+   walks the inodes again in directory order, giving each block to its
+   first owner and copying it for the others, dropping block numbers that
+   are out of range or past the end of the file, and cutting lengths back
+   to the blocks held. The bitmap is then rebuilt from the owners. A
+   compressed cluster stands for all of its file blocks, however few it
+   holds.
+
+   */
+
+// What the scan found for one directory entry
+typedef struct fileCheck
+{
+	unsigned long dataBlocks; // Data blocks held
+	unsigned long leadingBlocks; // Data blocks held before the first hole
+	unsigned long badRefs; // Block numbers outside the partition
+} TFileCheck;
+
+// A reference to blockCount blocks from startBlock, made by file block
+// fileBlock. The block number is stored at entryIndex in the partition.
+typedef struct blockRef
+{
+	unsigned long startBlock;
+	unsigned long blockCount;
+	unsigned long fileBlock;
+	unsigned long entryIndex;
+	int isPointer; // Set for an indirect pointer block
+	unsigned long clusterLen; // Compressed length kept in the entry, 0 if none
+} TBlockRef;
+
+TFileSystemStruct _fs;
+int _fd = -1;
+TDirectory *_dir = NULL;
+unsigned char *_bitmapCopy = NULL;
+int *_inodeOwner = NULL; // Directory entry using each inode, -1 if none
+TFileCheck *_checks = NULL;
+
+// Owners of each block, indexed by block number, from the first pass and
+// from the repair pass
+unsigned short *_owners = NULL;
+unsigned short *_repairOwners = NULL;
+
+// Next chunk of the inode table for a scan thread
+unsigned long _nextChunk = 0;
+pthread_mutex_t _chunkLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Called for each reference an inode makes. Returns 0 to keep walking or 1
+// if the reference was cut off and the rest of the inode is to be skipped.
+typedef int (*TRefVisitor)(int file, TBlockRef *ref, void *arg);
+
+// Read len bytes at byteIndex. Anything past the end of the partition file reads as zeros.
+void readPartition(void *buffer, unsigned long len, unsigned long byteIndex)
+{
+	char *ptr = (char *) buffer;
+
+	while(len > 0) {
+		ssize_t count = pread(_fd, ptr, len, byteIndex);
+
+		if(count <= 0) {
+			memset(ptr, 0, len);
+			return;
+		}
+		ptr += count;
+		byteIndex += count;
+		len -= count;
+	}
+}
+
+// Write len bytes at byteIndex
+void writePartition(const void *buffer, unsigned long len, unsigned long byteIndex)
+{
+	if(pwrite(_fd, buffer, len, byteIndex) != (ssize_t) len) {
+		printf("Write to partition failed\n");
+		exit(-1);
+	}
+}
+
+unsigned long dataBlockIndex(unsigned long blockNum)
+{
+	return _fs.dataByteIndex + (blockNum - 1) * _fs.blockSize;
+}
+
+unsigned long inodeIndex(unsigned long inode)
+{
+	return _fs.inodeByteIndex + inode * _fs.blockSize;
+}
+
+int validRun(unsigned long startBlock, unsigned long count)
+{
+	return startBlock >= 1 && count <= _fs.numBlocks && startBlock <= _fs.numBlocks - count + 1;
+}
+
+int isFree(const unsigned char *bitmap, unsigned long blockNum)
+{
+	return (bitmap[(blockNum - 1) / 8] & (0x80 >> ((blockNum - 1) % 8))) != 0;
+}
+
+void setFree(unsigned char *bitmap, unsigned long blockNum, int free)
+{
+	if(free) {
+		bitmap[(blockNum - 1) / 8] |= 0x80 >> ((blockNum - 1) % 8);
+	} else {
+		bitmap[(blockNum - 1) / 8] &= ~(0x80 >> ((blockNum - 1) % 8));
+	}
+}
+
+// Separate the compressed length of a cluster from the block number in a
+// data block entry
+void splitEntry(TBlockRef *ref)
+{
+	if(_fs.inodeFormat == INODE_BLOCKMAP_LZ) {
+		ref->clusterLen = ref->startBlock >> CLUSTER_LEN_SHIFT;
+		ref->startBlock &= BLOCK_NUM_MASK;
+	}
+}
+
+// Visit a pointer block, then the references in it. depth is 1 for a
+// block of data block numbers and 2 for a block of pointer block numbers.
+int walkPointerBlock(int file, TBlockRef ref, int depth, TRefVisitor visit, void *arg)
+{
+	if(visit(file, &ref, arg)) {
+		return 1;
+	}
+
+	// the visitor clears or moves bad and shared blocks
+	if(!validRun(ref.startBlock, 1)) {
+		return 0;
+	}
+
+	unsigned long *entries = (unsigned long *) malloc(_fs.blockSize);
+	unsigned long span = (depth == 1 ? 1 : _fs.numInodeEntries);
+	int stop = 0;
+
+	readPartition(entries, _fs.blockSize, dataBlockIndex(ref.startBlock));
+	for(unsigned long i = 0; i < _fs.numInodeEntries && !stop; i++) {
+		if(entries[i] == 0) {
+			continue;
+		}
+
+		TBlockRef child = {entries[i], 1, ref.fileBlock + i * span,
+		                   dataBlockIndex(ref.startBlock) + i * sizeof(unsigned long), depth > 1, 0};
+		if(depth == 1) {
+			splitEntry(&child);
+		}
+		stop = (depth > 1 ? walkPointerBlock(file, child, depth - 1, visit, arg) : visit(file, &child, arg));
+	}
+
+	free(entries);
+	return stop;
+}
+
+// Visit every block an inode refers to, in file order. Pointer blocks are
+// visited before the blocks they point to.
+void walkInode(int file, unsigned long *inode, TRefVisitor visit, void *arg)
+{
+	unsigned long numEntries = _fs.numInodeEntries;
+	unsigned long base = inodeIndex(_dir[file].inode);
+
+	if(_fs.inodeFormat == INODE_EXTENT) {
+		TExtent *extents = (TExtent *) (inode + 1);
+		unsigned long maxExtents = (numEntries - 1) * sizeof(unsigned long) / sizeof(TExtent);
+		unsigned long count = inode[0] < maxExtents ? inode[0] : maxExtents;
+
+		for(unsigned long i = 0; i < count; i++) {
+			unsigned long offset = sizeof(unsigned long) + i * sizeof(TExtent) + sizeof(unsigned long);
+			TBlockRef ref = {extents[i].startBlock, extents[i].length, extents[i].fileBlock, base + offset, 0, 0};
+			if(visit(file, &ref, arg)) {
+				return;
+			}
+		}
+		return;
+	}
+
+	unsigned long direct = (_fs.inodeFormat == INODE_DIRECT ? numEntries : numEntries - 2);
+	for(unsigned long i = 0; i < direct; i++) {
+		if(inode[i] == 0) {
+			continue;
+		}
+
+		TBlockRef ref = {inode[i], 1, i, base + i * sizeof(unsigned long), 0, 0};
+		splitEntry(&ref);
+		if(visit(file, &ref, arg)) {
+			return;
+		}
+	}
+
+	if(_fs.inodeFormat == INODE_DIRECT) {
+		return;
+	}
+
+	// single and double indirect
+	TBlockRef single = {inode[direct], 1, direct, base + direct * sizeof(unsigned long), 1, 0};
+	TBlockRef dbl = {inode[direct + 1], 1, direct + numEntries, base + (direct + 1) * sizeof(unsigned long), 1, 0};
+
+	if(single.startBlock != 0 && walkPointerBlock(file, single, 1, visit, arg)) {
+		return;
+	}
+	if(dbl.startBlock != 0) {
+		walkPointerBlock(file, dbl, 2, visit, arg);
+	}
+}
+
+// Count a data reference towards the file's blocks
+void countData(TFileCheck *check, TBlockRef *ref)
+{
+	unsigned long span = (ref->clusterLen != 0 ? COMPRESS_CLUSTER_BLOCKS : ref->blockCount);
+
+	if(ref->fileBlock == check->leadingBlocks) {
+		check->leadingBlocks += span;
+	}
+	check->dataBlocks += ref->blockCount;
+}
+
+// First pass visitor. Counts owners and the file's data blocks.
+int countRef(int file, TBlockRef *ref, void *arg)
+{
+	TFileCheck *check = &_checks[file];
+
+	if(!validRun(ref->startBlock, ref->blockCount)) {
+		check->badRefs++;
+		return 0;
+	}
+
+	for(unsigned long i = 0; i < ref->blockCount; i++) {
+		__atomic_fetch_add(&_owners[ref->startBlock + i], 1, __ATOMIC_RELAXED);
+	}
+
+	if(!ref->isPointer) {
+		countData(check, ref);
+	}
+	return 0;
+}
+
+// Scan thread. Reads the inode table a chunk at a time and walks the live
+// inodes in it.
+void *scanInodes(void *arg)
+{
+	unsigned long chunkLen = (unsigned long) SCAN_CHUNK_INODES * _fs.blockSize;
+	char *chunk = (char *) malloc(chunkLen);
+
+	while(1) {
+		pthread_mutex_lock(&_chunkLock);
+		unsigned long first = _nextChunk;
+		_nextChunk += SCAN_CHUNK_INODES;
+		pthread_mutex_unlock(&_chunkLock);
+
+		if(first >= _fs.maxFiles) {
+			break;
+		}
+
+		unsigned long count = _fs.maxFiles - first < SCAN_CHUNK_INODES ? _fs.maxFiles - first : SCAN_CHUNK_INODES;
+
+		// skip chunks with no live inodes
+		int live = 0;
+		for(unsigned long i = first; i < first + count && !live; i++) {
+			live = (_inodeOwner[i] >= 0);
+		}
+		if(!live) {
+			continue;
+		}
+
+		readPartition(chunk, count * _fs.blockSize, inodeIndex(first));
+		for(unsigned long i = first; i < first + count; i++) {
+			if(_inodeOwner[i] >= 0) {
+				walkInode(_inodeOwner[i], (unsigned long *) (chunk + (i - first) * _fs.blockSize), countRef, NULL);
+			}
+		}
+	}
+
+	free(chunk);
+	return NULL;
+}
+
+// Blocks needed to hold len bytes
+unsigned long blocksForLength(unsigned long len)
+{
+	return (len + _fs.blockSize - 1) / _fs.blockSize;
+}
+
+// Find count consecutive blocks owned by nobody, for a copy. Returns 0 if
+// there are none.
+unsigned long findUnownedRun(unsigned long count)
+{
+	unsigned long run = 0;
+
+	for(unsigned long b = 1; b <= _fs.numBlocks; b++) {
+		run = (_owners[b] == 0 && _repairOwners[b] == 0) ? run + 1 : 0;
+		if(run == count) {
+			return b - count + 1;
+		}
+	}
+	return 0;
+}
+
+// Drop a reference in the repair pass. An extent is dropped with all the
+// extents after it, as they are sorted by file block. Returns 1 if the
+// rest of the inode is to be skipped.
+int dropRef(int file, TBlockRef *ref)
+{
+	if(_fs.inodeFormat == INODE_EXTENT) {
+		unsigned long base = inodeIndex(_dir[file].inode);
+		unsigned long count = (ref->entryIndex - base - sizeof(unsigned long)) / sizeof(TExtent);
+
+		writePartition(&count, sizeof(unsigned long), base);
+		return 1;
+	}
+
+	unsigned long zero = 0;
+	writePartition(&zero, sizeof(unsigned long), ref->entryIndex);
+	ref->startBlock = 0;
+	return 0;
+}
+
+// Repair pass visitor. Gives each block to its first owner, copies blocks
+// already taken, and drops references outside the partition or past the
+// file's length.
+int repairRef(int file, TBlockRef *ref, void *arg)
+{
+	TFileCheck *check = &_checks[file];
+	unsigned long needed = *(unsigned long *) arg;
+
+	if(!validRun(ref->startBlock, ref->blockCount)) {
+		printf("%s: dropped block number %lu\n", _dir[file].filename, ref->startBlock);
+		return dropRef(file, ref);
+	}
+
+	if(!ref->isPointer && ref->fileBlock >= needed) {
+		printf("%s: freed blocks past the end of the file\n", _dir[file].filename);
+		return dropRef(file, ref);
+	}
+
+	// an extent running past the end of the file is cut short
+	if(!ref->isPointer && ref->fileBlock + ref->blockCount > needed) {
+		ref->blockCount = needed - ref->fileBlock;
+		writePartition(&ref->blockCount, sizeof(unsigned long), ref->entryIndex + sizeof(unsigned long));
+		printf("%s: freed blocks past the end of the file\n", _dir[file].filename);
+	}
+
+	int taken = 0;
+	for(unsigned long i = 0; i < ref->blockCount; i++) {
+		taken |= (_repairOwners[ref->startBlock + i] > 0);
+	}
+
+	if(taken) {
+		unsigned long copy = findUnownedRun(ref->blockCount);
+
+		if(copy == 0) {
+			printf("%s: no free blocks to copy shared block %lu, dropped\n", _dir[file].filename, ref->startBlock);
+			return dropRef(file, ref);
+		}
+
+		// blocks are encrypted the same way wherever they are, so the
+		// cipher text is copied as it is
+		char *block = (char *) malloc(_fs.blockSize);
+		for(unsigned long i = 0; i < ref->blockCount; i++) {
+			readPartition(block, _fs.blockSize, dataBlockIndex(ref->startBlock + i));
+			writePartition(block, _fs.blockSize, dataBlockIndex(copy + i));
+		}
+		free(block);
+
+		printf("%s: copied shared block %lu to %lu\n", _dir[file].filename, ref->startBlock, copy);
+		unsigned long entry = copy | (ref->clusterLen << CLUSTER_LEN_SHIFT);
+		writePartition(&entry, sizeof(unsigned long), ref->entryIndex);
+		ref->startBlock = copy;
+	}
+
+	for(unsigned long i = 0; i < ref->blockCount; i++) {
+		_repairOwners[ref->startBlock + i]++;
+	}
+
+	if(!ref->isPointer) {
+		countData(check, ref);
+	}
+	return 0;
+}
+
+// Report length problems. Returns the number found.
+unsigned long checkLengths()
+{
+	unsigned long problems = 0;
+
+	for(unsigned int i = 0; i < _fs.maxFiles; i++) {
+		if(!(_dir[i].attr & 0b1) || _dir[i].inode >= _fs.maxFiles) {
+			continue;
+		}
+
+		TFileCheck *check = &_checks[i];
+		unsigned long needed = blocksForLength(_dir[i].length);
+
+		if(check->badRefs > 0) {
+			printf("%s: %lu block numbers outside the partition\n", _dir[i].filename, check->badRefs);
+			problems++;
+		}
+		if(check->leadingBlocks < needed) {
+			printf("%s: length %lu needs %lu blocks but only %lu are held\n", _dir[i].filename,
+			       _dir[i].length, needed, check->leadingBlocks);
+			problems++;
+		} else if(check->dataBlocks > needed) {
+			printf("%s: holds %lu blocks past its length %lu\n", _dir[i].filename,
+			       check->dataBlocks - needed, _dir[i].length);
+			problems++;
+		}
+	}
+
+	return problems;
+}
+
+// Report blocks owned more than once and bitmap disagreements. Returns the
+// number found.
+unsigned long checkBitmap()
+{
+	unsigned long shared = 0, leaked = 0, markedFree = 0;
+
+	for(unsigned long b = 1; b <= _fs.numBlocks; b++) {
+		if(_owners[b] > 1) {
+			shared++;
+		}
+		if(_owners[b] == 0 && !isFree(_bitmapCopy, b)) {
+			leaked++;
+		}
+		if(_owners[b] > 0 && isFree(_bitmapCopy, b)) {
+			markedFree++;
+		}
+	}
+
+	if(shared > 0) {
+		printf("%lu blocks are held by more than one file\n", shared);
+	}
+	if(leaked > 0) {
+		printf("%lu blocks are marked in use but held by no file\n", leaked);
+	}
+	if(markedFree > 0) {
+		printf("%lu blocks are held by a file but marked free\n", markedFree);
+	}
+
+	return shared + leaked + markedFree;
+}
+
+// Check whether the journal holds transactions that have not been replayed
+int journalPending()
+{
+	unsigned long start = _fs.inodeByteIndex + (unsigned long) _fs.blockSize * _fs.maxFiles;
+
+	if(_fs.dataByteIndex < start + 2 * _fs.blockSize) {
+		return 0;
+	}
+
+	TJournalHeader header;
+	TJournalTxn txn;
+	readPartition(&header, sizeof(header), start);
+	readPartition(&txn, sizeof(txn), start + _fs.blockSize);
+
+	return header.magic == JOURNAL_MAGIC && txn.magic == JOURNAL_TXN_MAGIC && txn.seq == header.tailSeq;
+}
+
+// Repair everything found: references, lengths and the bitmap
+void repair()
+{
+	_repairOwners = (unsigned short *) calloc(sizeof(unsigned short), _fs.numBlocks + 1);
+	unsigned long *inode = (unsigned long *) malloc(_fs.blockSize);
+
+	for(unsigned int i = 0; i < _fs.maxFiles; i++) {
+		if(!(_dir[i].attr & 0b1)) {
+			continue;
+		}
+
+		if(_dir[i].inode >= _fs.maxFiles || _inodeOwner[_dir[i].inode] != (int) i) {
+			printf("%s: inode %lu is invalid or in use by another file, entry removed\n",
+			       _dir[i].filename, _dir[i].inode);
+			_dir[i].attr &= ~0b1;
+			continue;
+		}
+
+		unsigned long needed = blocksForLength(_dir[i].length);
+		memset(&_checks[i], 0, sizeof(TFileCheck));
+		readPartition(inode, _fs.blockSize, inodeIndex(_dir[i].inode));
+		walkInode(i, inode, repairRef, &needed);
+
+		// cut the length back to the blocks held
+		if(blocksForLength(_dir[i].length) > _checks[i].leadingBlocks) {
+			_dir[i].length = _checks[i].leadingBlocks * _fs.blockSize;
+			printf("%s: length cut to %lu\n", _dir[i].filename, _dir[i].length);
+		}
+	}
+
+	// rebuild the bitmap from the owners
+	for(unsigned long b = 1; b <= _fs.numBlocks; b++) {
+		setFree(_bitmapCopy, b, _repairOwners[b] == 0);
+	}
+
+	writePartition(_dir, sizeof(TDirectory) * _fs.maxFiles, _fs.dirByteIndex);
+	writePartition(_bitmapCopy, _fs.bitmapLen, _fs.bitmapByteIndex);
+	fdatasync(_fd);
+
+	free(inode);
+	free(_repairOwners);
+}
+
+int main(int ac, char **av)
+{
+	int doRepair = (ac > 1 && strcmp(av[1], "-r") == 0);
+	const char *partition = (ac > 1 + doRepair ? av[1 + doRepair] : "part.dsk");
+
+	if(ac > 2 + doRepair) {
+		printf("\nUsage: %s [-r] [partition file]\n", av[0]);
+		printf("Checks the partition, and repairs it with -r.\n\n");
+		return -1;
+	}
+
+	// replay the journal through a mount first so the metadata is current
+	if(doRepair) {
+		mountFS(partition, "efsck");
+		unmountFS();
+	}
+
+	_fd = open(partition, doRepair ? O_RDWR : O_RDONLY);
+	if(_fd < 0) {
+		printf("Unable to open partition file\n");
+		return -1;
+	}
+
+	readPartition(&_fs, sizeof(_fs), 0);
+	if(_fs.inodeFormat != INODE_DIRECT && _fs.inodeFormat != INODE_BLOCKMAP &&
+	   _fs.inodeFormat != INODE_BLOCKMAP_LZ && _fs.inodeFormat != INODE_EXTENT) {
+		printf("Unknown inode format %#x\n", _fs.inodeFormat);
+		close(_fd);
+		return -1;
+	}
+	if(journalPending()) {
+		printf("The journal holds changes that have not been replayed; results may be out of date\n");
+	}
+
+	_dir = (TDirectory *) calloc(sizeof(TDirectory), _fs.maxFiles);
+	_bitmapCopy = (unsigned char *) calloc(sizeof(char), _fs.bitmapLen + 1);
+	readPartition(_dir, sizeof(TDirectory) * _fs.maxFiles, _fs.dirByteIndex);
+	readPartition(_bitmapCopy, _fs.bitmapLen, _fs.bitmapByteIndex);
+
+	// blocks past the end of the bitmap cannot be tracked
+	if(_fs.numBlocks > _fs.bitmapLen * 8) {
+		_fs.numBlocks = _fs.bitmapLen * 8;
+	}
+
+	// map live inodes to their directory entries
+	unsigned long problems = 0, files = 0;
+	_inodeOwner = (int *) malloc(sizeof(int) * _fs.maxFiles);
+	for(unsigned int i = 0; i < _fs.maxFiles; i++) {
+		_inodeOwner[i] = -1;
+	}
+	for(unsigned int i = 0; i < _fs.maxFiles; i++) {
+		if(!(_dir[i].attr & 0b1)) {
+			continue;
+		}
+		files++;
+
+		if(_dir[i].inode >= _fs.maxFiles) {
+			printf("%s: inode %lu out of range\n", _dir[i].filename, _dir[i].inode);
+			problems++;
+		} else if(_inodeOwner[_dir[i].inode] >= 0) {
+			printf("%s: inode %lu is also used by %s\n", _dir[i].filename, _dir[i].inode,
+			       _dir[_inodeOwner[_dir[i].inode]].filename);
+			problems++;
+		} else {
+			_inodeOwner[_dir[i].inode] = i;
+		}
+	}
+
+	// first pass
+	_checks = (TFileCheck *) calloc(sizeof(TFileCheck), _fs.maxFiles);
+	_owners = (unsigned short *) calloc(sizeof(unsigned short), _fs.numBlocks + 1);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int numThreads = cpus < 1 ? 1 : (cpus > MAX_SCAN_THREADS ? MAX_SCAN_THREADS : cpus);
+	pthread_t threads[MAX_SCAN_THREADS];
+
+	for(int i = 1; i < numThreads; i++) {
+		pthread_create(&threads[i], NULL, scanInodes, NULL);
+	}
+	scanInodes(NULL);
+	for(int i = 1; i < numThreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	problems += checkLengths();
+	problems += checkBitmap();
+
+	unsigned long used = 0;
+	for(unsigned long b = 1; b <= _fs.numBlocks; b++) {
+		used += (_owners[b] > 0);
+	}
+	printf("%lu files, %lu of %u blocks in use, %lu problems\n", files, used, _fs.numBlocks, problems);
+
+	if(problems > 0 && doRepair) {
+		repair();
+		printf("Repaired\n");
+		problems = 0;
+	}
+
+	close(_fd);
+	free(_dir);
+	free(_bitmapCopy);
+	free(_inodeOwner);
+	free(_checks);
+	free(_owners);
+
+	return problems > 0 ? 1 : 0;
+}
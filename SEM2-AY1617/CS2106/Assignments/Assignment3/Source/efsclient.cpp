@@ -0,0 +1,207 @@
+#include "efsclient.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Connect to efsd. Returns the socket or -1.
+int efsConnect(const char *socketPath)
+{
+	struct sockaddr_un addr;
+
+	if(strlen(socketPath) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+
+	if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+// Close a connection
+void efsDisconnect(int sock)
+{
+	close(sock);
+}
+
+// Send exactly len bytes
+int efsSendAll(int sock, const void *buffer, unsigned long len)
+{
+	const char *ptr = (const char *) buffer;
+
+	while(len > 0) {
+		ssize_t count = send(sock, ptr, len, MSG_NOSIGNAL);
+
+		if(count <= 0) {
+			return -1;
+		}
+		ptr += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+// Receive exactly len bytes
+int efsRecvAll(int sock, void *buffer, unsigned long len)
+{
+	char *ptr = (char *) buffer;
+
+	while(len > 0) {
+		ssize_t count = recv(sock, ptr, len, 0);
+
+		if(count <= 0) {
+			return -1;
+		}
+		ptr += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+// Send a request without waiting for its reply
+unsigned long efsSend(int sock, unsigned int op, int fp, unsigned int arg, const char *filename,
+                      const void *data, unsigned int len)
+{
+	TEFSRequest req;
+
+	memset(&req, 0, sizeof(req));
+	req.op = op;
+	req.fp = fp;
+	req.arg = arg;
+	req.len = len;
+	if(filename != NULL) {
+		strncpy(req.filename, filename, MAX_FNAME_LEN);
+	}
+
+	if(efsSendAll(sock, &req, sizeof(req)) != 0) {
+		return FS_ERROR;
+	}
+
+	if(op == EFS_OP_WRITE && efsSendAll(sock, data, len) != 0) {
+		return FS_ERROR;
+	}
+
+	return FS_OK;
+}
+
+// Receive the reply to the oldest outstanding request
+unsigned long efsReceive(int sock, TEFSReply *reply, void *data)
+{
+	if(efsRecvAll(sock, reply, sizeof(TEFSReply)) != 0) {
+		return FS_ERROR;
+	}
+
+	if(reply->len > 0 && efsRecvAll(sock, data, reply->len) != 0) {
+		return FS_ERROR;
+	}
+
+	return reply->result;
+}
+
+// Send a request and wait for its reply
+unsigned long efsCall(int sock, unsigned int op, int fp, unsigned int arg, const char *filename,
+                      void *data, unsigned int len, long *value)
+{
+	TEFSReply reply;
+
+	if(efsSend(sock, op, fp, arg, filename, data, len) != FS_OK) {
+		return FS_ERROR;
+	}
+
+	unsigned long result = efsReceive(sock, &reply, data);
+	if(value != NULL) {
+		*value = reply.value;
+	}
+
+	return result;
+}
+
+// Open a file. Returns the file handle or -1.
+int efsOpen(int sock, const char *filename, unsigned char mode, unsigned long *result)
+{
+	long fp = -1;
+
+	*result = efsCall(sock, EFS_OP_OPEN, -1, mode, filename, NULL, 0, &fp);
+	return *result == FS_OK ? (int) fp : -1;
+}
+
+// Read len bytes at the file pointer
+unsigned long efsRead(int sock, int fp, void *buffer, unsigned int len)
+{
+	return efsCall(sock, EFS_OP_READ, fp, 0, NULL, buffer, len, NULL);
+}
+
+// Write len bytes at the file pointer
+unsigned long efsWrite(int sock, int fp, const void *buffer, unsigned int len)
+{
+	return efsCall(sock, EFS_OP_WRITE, fp, 0, NULL, (void *) buffer, len, NULL);
+}
+
+// Flush an open file
+unsigned long efsFlush(int sock, int fp)
+{
+	return efsCall(sock, EFS_OP_FLUSH, fp, 0, NULL, NULL, 0, NULL);
+}
+
+// Close an open file
+unsigned long efsClose(int sock, int fp)
+{
+	return efsCall(sock, EFS_OP_CLOSE, fp, 0, NULL, NULL, 0, NULL);
+}
+
+// Delete a file
+unsigned long efsDelete(int sock, const char *filename)
+{
+	return efsCall(sock, EFS_OP_DELETE, -1, 0, filename, NULL, 0, NULL);
+}
+
+// Get a file's attribute
+unsigned long efsGetAttr(int sock, const char *filename, unsigned int *attr)
+{
+	long value = 0;
+	unsigned long result = efsCall(sock, EFS_OP_GETATTR, -1, 0, filename, NULL, 0, &value);
+
+	*attr = (unsigned int) value;
+	return result;
+}
+
+// Set a file's attribute
+unsigned long efsSetAttr(int sock, const char *filename, unsigned int attr)
+{
+	return efsCall(sock, EFS_OP_SETATTR, -1, attr, filename, NULL, 0, NULL);
+}
+
+// Get a file's length
+unsigned long efsGetLength(int sock, const char *filename, unsigned long *len)
+{
+	long value = 0;
+	unsigned long result = efsCall(sock, EFS_OP_LENGTH, -1, 0, filename, NULL, 0, &value);
+
+	*len = (unsigned long) value;
+	return result;
+}
+
+// Start a batch on the server
+unsigned long efsBeginBatch(int sock)
+{
+	return efsCall(sock, EFS_OP_BEGIN_BATCH, -1, 0, NULL, NULL, 0, NULL);
+}
+
+// End a batch on the server
+unsigned long efsEndBatch(int sock)
+{
+	return efsCall(sock, EFS_OP_END_BATCH, -1, 0, NULL, NULL, 0, NULL);
+}
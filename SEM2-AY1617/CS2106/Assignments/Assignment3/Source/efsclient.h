@@ -0,0 +1,100 @@
+#include "libefs.h"
+
+// Socket efsd listens on unless told otherwise
+#define EFS_SOCKET_PATH "efs.sock"
+
+// Largest read or write carried by one request
+#define EFS_MAX_TRANSFER (1024 * 1024)
+
+// Most requests efscmd keeps in flight on a connection
+#define EFS_PIPELINE_DEPTH 64
+
+/* Requests understood by efsd */
+enum
+{
+  EFS_OP_OPEN = 1, // Open filename in mode arg. Reply value is the file handle
+  EFS_OP_READ = 2, // Read len bytes from fp. Reply carries the data
+  EFS_OP_WRITE = 3, // Write the len bytes that follow the request to fp
+  EFS_OP_FLUSH = 4, // Flush fp
+  EFS_OP_CLOSE = 5, // Close fp
+  EFS_OP_DELETE = 6, // Delete filename
+  EFS_OP_GETATTR = 7, // Reply value is the attribute of filename
+  EFS_OP_SETATTR = 8, // Set the attribute of filename to arg
+  EFS_OP_LENGTH = 9, // Reply value is the length of filename
+  EFS_OP_BEGIN_BATCH = 10, // Start a batch, see beginBatch in libefs.h
+  EFS_OP_END_BATCH = 11 // End a batch
+};
+
+/*
+
+   Wire format. Every request gets exactly one reply, in the order the
+   requests were sent, so clients may send several requests before reading
+   any replies. Data follows the header for writes and read replies.
+
+   */
+
+typedef struct efsRequest
+{
+  unsigned int op; // One of EFS_OP_*
+  int fp; // File handle from EFS_OP_OPEN
+  unsigned int arg; // Open mode or attribute
+  unsigned int len; // Bytes to read or write
+  char filename[MAX_FNAME_LEN + 1];
+} TEFSRequest;
+
+typedef struct efsReply
+{
+  unsigned long result; // _result after the operation
+  long value; // File handle, attribute or length
+  unsigned int len; // Bytes of data following the reply
+} TEFSReply;
+
+/*
+
+   Client library. Calls return the file system result code (FS_OK etc.),
+   or FS_ERROR if the connection fails.
+
+   */
+
+// Connect to efsd. Returns the socket or -1.
+int efsConnect(const char *socketPath);
+
+// Close a connection. efsd closes any files left open on it.
+void efsDisconnect(int sock);
+
+// Send or receive exactly len bytes. Return 0 on success, -1 on failure.
+int efsSendAll(int sock, const void *buffer, unsigned long len);
+int efsRecvAll(int sock, void *buffer, unsigned long len);
+
+// Send a request without waiting for its reply. data holds len bytes for writes.
+unsigned long efsSend(int sock, unsigned int op, int fp, unsigned int arg, const char *filename,
+                      const void *data, unsigned int len);
+
+// Receive the reply to the oldest request still outstanding. Any data is stored
+// in data, which must be large enough for the len that was requested.
+unsigned long efsReceive(int sock, TEFSReply *reply, void *data);
+
+// Open a file. Returns the file handle, or -1 with the reason in *result.
+int efsOpen(int sock, const char *filename, unsigned char mode, unsigned long *result);
+
+// Read or write len bytes at the file pointer
+unsigned long efsRead(int sock, int fp, void *buffer, unsigned int len);
+unsigned long efsWrite(int sock, int fp, const void *buffer, unsigned int len);
+
+// Flush or close an open file
+unsigned long efsFlush(int sock, int fp);
+unsigned long efsClose(int sock, int fp);
+
+// Delete a file
+unsigned long efsDelete(int sock, const char *filename);
+
+// Get or set a file's attribute
+unsigned long efsGetAttr(int sock, const char *filename, unsigned int *attr);
+unsigned long efsSetAttr(int sock, const char *filename, unsigned int attr);
+
+// Get a file's length
+unsigned long efsGetLength(int sock, const char *filename, unsigned long *len);
+
+// Start or end a batch on the server
+unsigned long efsBeginBatch(int sock);
+unsigned long efsEndBatch(int sock);
@@ -0,0 +1,204 @@
+#include "efsclient.h"
+
+// Longest command line read from the manifest
+#define MAX_LINE_LEN 512
+
+// Bytes carried by each pipelined read or write
+#define EFSCMD_CHUNK (64 * 1024)
+
+// Copy a host file to the server. The writes are pipelined, with up to
+// EFS_PIPELINE_DEPTH of them in flight.
+void checkinFile(int sock, const char *filename)
+{
+	unsigned long size;
+	if(efsGetLength(sock, filename, &size) == FS_OK) {
+		printf("%s: DUPLICATE FILE\n", filename);
+		return;
+	}
+
+	FILE *fp = fopen(filename, "r");
+	if(fp == NULL)
+	{
+		printf("%s: Unable to open source file\n", filename);
+		return;
+	}
+
+	unsigned long result;
+	int fileInEFS = efsOpen(sock, filename, MODE_CREATE, &result);
+	if(fileInEFS == -1) {
+		printf("%s: Unable to create file\n", filename);
+		fclose(fp);
+		return;
+	}
+
+	char *buffer = (char *) malloc(EFSCMD_CHUNK);
+	unsigned long failed = FS_OK;
+	int inFlight = 0;
+	size_t len;
+	TEFSReply reply;
+
+	while((len = fread(buffer, sizeof(char), EFSCMD_CHUNK, fp)) > 0) {
+		if(inFlight == EFS_PIPELINE_DEPTH) {
+			result = efsReceive(sock, &reply, NULL);
+			if(result != FS_OK) {
+				failed = result;
+			}
+			inFlight--;
+		}
+
+		if(efsSend(sock, EFS_OP_WRITE, fileInEFS, 0, NULL, buffer, len) != FS_OK) {
+			failed = FS_ERROR;
+			break;
+		}
+		inFlight++;
+	}
+	fclose(fp);
+
+	while(inFlight-- > 0) {
+		result = efsReceive(sock, &reply, NULL);
+		if(result != FS_OK) {
+			failed = result;
+		}
+	}
+
+	if(failed == FS_FULL) {
+		printf("%s: Disk full\n", filename);
+	} else if(failed != FS_OK) {
+		printf("%s: Unknown Error\n", filename);
+	}
+
+	efsClose(sock, fileInEFS);
+	free(buffer);
+}
+
+// Copy a file from the server into the host file of the same name. The
+// reads are pipelined, with up to EFS_PIPELINE_DEPTH of them in flight.
+void checkoutFile(int sock, const char *filename)
+{
+	unsigned long size;
+	if(efsGetLength(sock, filename, &size) != FS_OK) {
+		printf("%s: FILE NOT FOUND\n", filename);
+		return;
+	}
+
+	FILE *fp = fopen(filename, "w");
+	if(fp == NULL)
+	{
+		printf("%s: Unable to open target file\n", filename);
+		return;
+	}
+
+	unsigned long result;
+	int fileInEFS = efsOpen(sock, filename, MODE_READ_ONLY, &result);
+	if(fileInEFS == -1) {
+		printf("%s: Unknown Error\n", filename);
+		fclose(fp);
+		return;
+	}
+
+	char *buffer = (char *) malloc(EFSCMD_CHUNK);
+	unsigned long sent = 0, received = 0;
+	int inFlight = 0;
+	TEFSReply reply;
+
+	while(received < size) {
+		// keep the pipeline full
+		while(sent < size && inFlight < EFS_PIPELINE_DEPTH) {
+			unsigned int len = size - sent < EFSCMD_CHUNK ? size - sent : EFSCMD_CHUNK;
+
+			if(efsSend(sock, EFS_OP_READ, fileInEFS, 0, NULL, NULL, len) != FS_OK) {
+				break;
+			}
+			sent += len;
+			inFlight++;
+		}
+
+		if(inFlight == 0 || efsReceive(sock, &reply, buffer) != FS_OK) {
+			printf("%s: Unknown Error\n", filename);
+			break;
+		}
+		inFlight--;
+
+		fwrite(buffer, sizeof(char), reply.len, fp);
+		received += reply.len;
+	}
+
+	// replies to requests that were sent before an error
+	while(inFlight-- > 0) {
+		efsReceive(sock, &reply, buffer);
+	}
+
+	efsClose(sock, fileInEFS);
+	fclose(fp);
+	free(buffer);
+}
+
+int main(int ac, char **av)
+{
+	if(ac != 1 && ac != 2)
+	{
+		printf("\nUsage: %s [socket path] < <manifest>\n", av[0]);
+		printf("Manifest lines: checkin <file>, checkout <file>, delete <file>,\n");
+		printf("getattr <file>, setattr <file> <R|W>\n\n");
+		return -1;
+	}
+
+	int sock = efsConnect(ac == 2 ? av[1] : EFS_SOCKET_PATH);
+	if(sock < 0) {
+		printf("Unable to connect to efsd\n");
+		exit(-1);
+	}
+
+	// the server writes the directory and free list once, at the end
+	efsBeginBatch(sock);
+
+	char line[MAX_LINE_LEN];
+	while(fgets(line, MAX_LINE_LEN, stdin) != NULL) {
+		char command[MAX_LINE_LEN], filename[MAX_LINE_LEN], value[MAX_LINE_LEN];
+		int fields = sscanf(line, "%s %s %s", command, filename, value);
+		unsigned long result;
+		unsigned int attr;
+
+		if(fields < 2) {
+			continue;
+		}
+
+		if(strlen(filename) > MAX_FNAME_LEN) {
+			printf("%s: Filename too long\n", filename);
+		} else if(strcmp(command, "checkin") == 0) {
+			checkinFile(sock, filename);
+		} else if(strcmp(command, "checkout") == 0) {
+			checkoutFile(sock, filename);
+		} else if(strcmp(command, "delete") == 0) {
+			result = efsDelete(sock, filename);
+			if(result == FS_FILE_NOT_FOUND) {
+				printf("%s: FILE NOT FOUND\n", filename);
+			} else if(result != FS_OK) {
+				printf("%s: Unknown Error\n", filename);
+			}
+		} else if(strcmp(command, "getattr") == 0) {
+			if(efsGetAttr(sock, filename, &attr) == FS_OK) {
+				printf("%s: %c\n", filename, (attr & 0x04) ? 'R' : 'W');
+			} else {
+				printf("%s: FILE NOT FOUND\n", filename);
+			}
+		} else if(strcmp(command, "setattr") == 0 && fields == 3) {
+			if(efsGetAttr(sock, filename, &attr) != FS_OK) {
+				printf("%s: FILE NOT FOUND\n", filename);
+			} else {
+				if (strlen(value)==1 && (value[0]=='r' || value[0]=='R')) {
+					attr = attr | 0x04;
+				} else if (strlen(value)==1 && (value[0]=='w' || value[0]=='W')) {
+					attr = attr & 0xFB;
+				}
+				efsSetAttr(sock, filename, attr);
+			}
+		} else {
+			printf("Unknown command: %s", line);
+		}
+	}
+
+	efsEndBatch(sock);
+	efsDisconnect(sock);
+	return 0;
+}
@@ -0,0 +1,323 @@
+#include "efsclient.h"
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* A client connection, served by its own thread */
+typedef struct connection
+{
+	int sock;
+	pthread_t thread;
+	char *owned; // owned[fp] is set for files opened on this connection
+	int ownedSize; // Entries in owned
+	int batchDepth; // Batches started on this connection and not yet ended
+	int finished; // Set by the thread when the client has gone
+	struct connection *next;
+} TConnection;
+
+// Live connections
+TConnection *_connections = NULL;
+pthread_mutex_t _connLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Listening socket
+int _listener = -1;
+
+// Set once SIGINT or SIGTERM arrives
+volatile sig_atomic_t _stop = 0;
+
+// Signal thread. The signals are blocked everywhere else; when one arrives
+// the listening socket is shut down to wake accept.
+void *waitForSignal(void *arg)
+{
+	int sig;
+
+	sigwait((sigset_t *) arg, &sig);
+	_stop = 1;
+	shutdown(_listener, SHUT_RDWR);
+	return NULL;
+}
+
+// Check that fp is a file opened on this connection
+int ownsFile(TConnection *conn, int fp)
+{
+	return fp >= 0 && fp < conn->ownedSize && conn->owned[fp];
+}
+
+// Record fp as opened on this connection. The open file table grows on
+// demand, so owned grows with it.
+void claimFile(TConnection *conn, int fp)
+{
+	if(fp >= conn->ownedSize) {
+		int size = conn->ownedSize;
+
+		while(size <= fp) {
+			size *= 2;
+		}
+		conn->owned = (char *) realloc(conn->owned, size);
+		memset(conn->owned + conn->ownedSize, 0, size - conn->ownedSize);
+		conn->ownedSize = size;
+	}
+	conn->owned[fp] = 1;
+}
+
+// Carry out one request. data holds the bytes of a write and receives the
+// bytes of a read.
+void serveRequest(TConnection *conn, TEFSRequest *req, char *data, TEFSReply *reply)
+{
+	reply->result = FS_OK;
+	reply->value = 0;
+	reply->len = 0;
+	req->filename[MAX_FNAME_LEN] = 0;
+
+	switch(req->op) {
+		case EFS_OP_OPEN:
+			reply->value = openFile(req->filename, req->arg);
+			reply->result = _result;
+			if(reply->value >= 0) {
+				claimFile(conn, reply->value);
+			} else if(reply->result == FS_OK) {
+				reply->result = FS_ERROR;
+			}
+			break;
+		case EFS_OP_READ:
+			if(!ownsFile(conn, req->fp)) {
+				reply->result = FS_ERROR;
+				break;
+			}
+			readFile(req->fp, data, sizeof(char), req->len);
+			reply->result = _result;
+			if(_result == FS_OK) {
+				reply->value = req->len;
+				reply->len = req->len;
+			}
+			break;
+		case EFS_OP_WRITE:
+			if(!ownsFile(conn, req->fp)) {
+				reply->result = FS_ERROR;
+				break;
+			}
+			writeFile(req->fp, data, sizeof(char), req->len);
+			reply->result = _result;
+			break;
+		case EFS_OP_FLUSH:
+			if(!ownsFile(conn, req->fp)) {
+				reply->result = FS_ERROR;
+				break;
+			}
+			flushFile(req->fp);
+			reply->result = _result;
+			break;
+		case EFS_OP_CLOSE:
+			if(!ownsFile(conn, req->fp)) {
+				reply->result = FS_ERROR;
+				break;
+			}
+			closeFile(req->fp);
+			conn->owned[req->fp] = 0;
+			reply->result = _result;
+			break;
+		case EFS_OP_DELETE:
+			delFile(req->filename);
+			reply->result = _result;
+			break;
+		case EFS_OP_GETATTR:
+			lockMetadata(0);
+			reply->value = getAttr(req->filename);
+			reply->result = _result;
+			unlockMetadata();
+			break;
+		case EFS_OP_SETATTR:
+			setFileAttr(req->filename, req->arg);
+			reply->result = _result;
+			break;
+		case EFS_OP_LENGTH:
+			lockMetadata(0);
+			findFile(req->filename);
+			if(_result == FS_OK) {
+				reply->value = getFileLength(req->filename);
+			}
+			reply->result = _result;
+			unlockMetadata();
+			break;
+		case EFS_OP_BEGIN_BATCH:
+			beginBatch();
+			conn->batchDepth++;
+			break;
+		case EFS_OP_END_BATCH:
+			if(conn->batchDepth > 0) {
+				endBatch();
+				conn->batchDepth--;
+			}
+			break;
+		default:
+			reply->result = FS_ERROR;
+	}
+}
+
+// Connection thread. Requests are served in the order they arrive.
+void *serveConnection(void *arg)
+{
+	TConnection *conn = (TConnection *) arg;
+	char *data = (char *) malloc(EFS_MAX_TRANSFER);
+	TEFSRequest req;
+	TEFSReply reply;
+
+	while(efsRecvAll(conn->sock, &req, sizeof(req)) == 0) {
+		// a request too large to buffer leaves the stream out of step
+		if((req.op == EFS_OP_READ || req.op == EFS_OP_WRITE) && req.len > EFS_MAX_TRANSFER) {
+			break;
+		}
+
+		if(req.op == EFS_OP_WRITE && efsRecvAll(conn->sock, data, req.len) != 0) {
+			break;
+		}
+
+		serveRequest(conn, &req, data, &reply);
+
+		if(efsSendAll(conn->sock, &reply, sizeof(reply)) != 0 ||
+		   efsSendAll(conn->sock, data, reply.len) != 0) {
+			break;
+		}
+	}
+
+	// tidy up after the client
+	for(int fp = 0; fp < conn->ownedSize; fp++) {
+		if(conn->owned[fp]) {
+			closeFile(fp);
+		}
+	}
+	while(conn->batchDepth-- > 0) {
+		endBatch();
+	}
+
+	free(data);
+	shutdown(conn->sock, SHUT_RDWR);
+
+	pthread_mutex_lock(&_connLock);
+	conn->finished = 1;
+	pthread_mutex_unlock(&_connLock);
+	return NULL;
+}
+
+// Join and free connections whose clients have gone, or all of them if
+// all is set
+void reapConnections(int all)
+{
+	TConnection **link = &_connections;
+
+	pthread_mutex_lock(&_connLock);
+	while(*link != NULL) {
+		TConnection *conn = *link;
+
+		if(!conn->finished && !all) {
+			link = &conn->next;
+			continue;
+		}
+
+		*link = conn->next;
+		pthread_mutex_unlock(&_connLock);
+
+		pthread_join(conn->thread, NULL);
+		close(conn->sock);
+		free(conn->owned);
+		free(conn);
+
+		pthread_mutex_lock(&_connLock);
+	}
+	pthread_mutex_unlock(&_connLock);
+}
+
+int main(int ac, char **av)
+{
+	if(ac != 2 && ac != 3)
+	{
+		printf("\nUsage: %s <password> [socket path]\n\n", av[0]);
+		return -1;
+	}
+
+	const char *socketPath = (ac == 3 ? av[2] : EFS_SOCKET_PATH);
+	struct sockaddr_un addr;
+
+	if(strlen(socketPath) >= sizeof(addr.sun_path)) {
+		printf("Socket path too long\n");
+		exit(-1);
+	}
+
+	// every thread started from here on inherits the blocked signals
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	initFS("part.dsk", av[1]);
+	if (_result == FS_ERROR) {
+		printf("Unknown Error\n");
+		exit(-1);
+	}
+
+	_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+	unlink(socketPath);
+
+	if(_listener < 0 || bind(_listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(_listener, SOMAXCONN) < 0) {
+		printf("Unable to listen on %s\n", socketPath);
+		closeFS();
+		exit(-1);
+	}
+
+	pthread_t signalThread;
+	pthread_create(&signalThread, NULL, waitForSignal, &signals);
+	pthread_detach(signalThread);
+
+	while(!_stop) {
+		int sock = accept(_listener, NULL, NULL);
+
+		reapConnections(0);
+
+		if(sock < 0) {
+			if(!_stop && (errno == EINTR || errno == ECONNABORTED)) {
+				continue;
+			}
+			break;
+		}
+
+		TConnection *conn = (TConnection *) calloc(sizeof(TConnection), 1);
+		conn->sock = sock;
+		conn->ownedSize = OFT_PAGE_ENTRIES;
+		conn->owned = (char *) calloc(sizeof(char), conn->ownedSize);
+
+		pthread_mutex_lock(&_connLock);
+		if(pthread_create(&conn->thread, NULL, serveConnection, conn) != 0) {
+			pthread_mutex_unlock(&_connLock);
+			close(sock);
+			free(conn->owned);
+			free(conn);
+			continue;
+		}
+		conn->next = _connections;
+		_connections = conn;
+		pthread_mutex_unlock(&_connLock);
+	}
+
+	close(_listener);
+	unlink(socketPath);
+
+	// wake the connection threads and wait for them to tidy up
+	pthread_mutex_lock(&_connLock);
+	for(TConnection *conn = _connections; conn != NULL; conn = conn->next) {
+		if(!conn->finished) {
+			shutdown(conn->sock, SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(&_connLock);
+	reapConnections(1);
+
+	closeFS();
+	return 0;
+}
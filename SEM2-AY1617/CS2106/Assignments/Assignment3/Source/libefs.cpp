@@ -1,70 +1,281 @@
 #include "libefs.h"
 #include <fcntl.h>
+#include <pthread.h>
 
 // FS Descriptor
 TFileSystemStruct *_fs;
 
-// Open File Table
-TOpenFile *_oft;
+// Open File Table. Entries are allocated OFT_PAGE_ENTRIES at a time and
+// never move, so a pointer to one stays valid while the table grows.
+TOpenFile **_oftPages = NULL;
 
-// Open file table counter
-int _oftCount=0;
+// Pages in the open file table
+int _oftPageCount = 0;
 
-char **filenames;
+// Free entries, linked through next, and open entries, linked through
+// prev and next. -1 ends each list.
+int _oftFree = -1;
+int _oftOpen = -1;
+
+// Open inodes by inode number, NULL where the file is not open
+TOpenInode **_openInodes;
+
+// Guards the open file table, its lists and the open inodes
+pthread_mutex_t _oftLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Batch nesting depth. Directory and free list writes wait for endBatch
+// while it is nonzero. Guarded by the metadata lock.
+int _batchDepth = 0;
 
 // Mounts a paritition given in fsPartitionName. Must be called before all
 // other functions
-void initFS(const char *fsPartitionName, const char *fsPassword)
+void initFS(const char *fsPartitionName, const char *fsPassword, int ioMode)
 {
     if(strlen(fsPassword) > MAX_PWD_LEN) {
 		_result = FS_ERROR;
 		return;
 	}
 	
-    mountFS(fsPartitionName, fsPassword);
+    mountFS(fsPartitionName, fsPassword, ioMode);
     _fs = getFSInfo();
-    _oft = (TOpenFile *) calloc(sizeof(TOpenFile), _fs->maxFiles);
-    filenames = (char **) calloc(sizeof(char *), _fs->maxFiles);
-    for(int i = 0; i < _fs->maxFiles; i++){
-		filenames[i] = (char *) calloc(sizeof(char), MAX_FNAME_LEN);
+    _openInodes = (TOpenInode **) calloc(sizeof(TOpenInode *), _fs->maxFiles);
+}
+
+// Entry fp of the open file table. Called with _oftLock held.
+TOpenFile *oftEntry(int fp)
+{
+	return &_oftPages[fp / OFT_PAGE_ENTRIES][fp % OFT_PAGE_ENTRIES];
+}
+
+// Look up an open file. Returns NULL if fp is not open.
+TOpenFile *getOpenFile(int fp)
+{
+	TOpenFile *f = NULL;
+	
+	pthread_mutex_lock(&_oftLock);
+	if(fp >= 0 && fp < _oftPageCount * OFT_PAGE_ENTRIES && oftEntry(fp)->inode != -1) {
+		f = oftEntry(fp);
+	}
+	pthread_mutex_unlock(&_oftLock);
+	
+	return f;
+}
+
+// Add a page of entries to the open file table and put them on the free
+// list. Called with _oftLock held.
+void growOpenFileTable()
+{
+	_oftPages = (TOpenFile **) realloc(_oftPages, sizeof(TOpenFile *) * (_oftPageCount + 1));
+	TOpenFile *page = (TOpenFile *) calloc(sizeof(TOpenFile), OFT_PAGE_ENTRIES);
+	int first = _oftPageCount * OFT_PAGE_ENTRIES;
+	
+	// lowest descriptors are handed out first
+	for(int i = 0; i < OFT_PAGE_ENTRIES; i++) {
+		page[i].inode = -1;
+		page[i].next = (i + 1 < OFT_PAGE_ENTRIES ? first + i + 1 : _oftFree);
+	}
+	_oftPages[_oftPageCount++] = page;
+	_oftFree = first;
+}
+
+// Take a reference to the open inode for inode, loading it if the file is
+// not open yet. Called with _oftLock held.
+TOpenInode *acquireOpenInode(unsigned int inode)
+{
+	TOpenInode *shared = _openInodes[inode];
+	
+	if(shared == NULL) {
+		shared = (TOpenInode *) calloc(sizeof(TOpenInode), 1);
+		shared->inode = inode;
+		shared->inodeBuffer = makeInodeBuffer();
+		loadInode(shared->inodeBuffer, inode);
+		pthread_mutex_init(&shared->lock, NULL);
+		_openInodes[inode] = shared;
+	}
+	shared->refCount++;
+	
+	return shared;
+}
+
+// Wait for the read of a run read ahead and free it
+void freeReadAheadRun(TReadAhead *run)
+{
+	waitBlockRequest(&run->req);
+	free(run->req.buffer);
+	free(run);
+}
+
+// Discard every run read ahead on an open inode. Anything that writes to
+// the file calls this first, so a stale copy is never read. Called with the
+// file lock held.
+void dropReadAhead(TOpenInode *shared)
+{
+	while(shared->readAhead != NULL) {
+		TReadAhead *run = shared->readAhead;
+		shared->readAhead = run->next;
+		freeReadAheadRun(run);
+	}
+	shared->readAheadBlocks = 0;
+}
+
+// Copy block blockNum into buffer if it was read ahead, waiting for its read
+// to finish. A run is freed once every block has been taken from it.
+// Returns 1 if the block was copied, 0 if it has to be read. Called with
+// the file lock held.
+int takeReadAhead(TOpenFile *f, char *buffer, unsigned long blockNum)
+{
+	TReadAhead **link = &f->shared->readAhead;
+	
+	while(*link != NULL) {
+		TReadAhead *run = *link;
+		
+		if(blockNum < run->req.startBlock || blockNum >= run->req.startBlock + run->req.count) {
+			link = &run->next;
+			continue;
+		}
+		
+		waitBlockRequest(&run->req);
+		int ok = (run->req.result == FS_OK);
+		if(ok) {
+			memcpy(buffer, run->req.buffer + (blockNum - run->req.startBlock) * f->blockSize, f->blockSize);
+		}
+		
+		if(!ok || ++run->used == run->req.count) {
+			*link = run->next;
+			f->shared->readAheadBlocks -= run->req.count;
+			freeReadAheadRun(run);
+		}
+		return ok;
+	}
+	
+	return 0;
+}
+
+// Start reading count blocks from startBlock into a run of their own,
+// dropping the oldest runs to stay within READAHEAD_HELD_BLOCKS. Called
+// with the file lock held.
+void startReadAheadRun(TOpenFile *f, unsigned long startBlock, unsigned int count)
+{
+	TOpenInode *shared = f->shared;
+	
+	while(shared->readAhead != NULL && shared->readAheadBlocks + count > READAHEAD_HELD_BLOCKS) {
+		TReadAhead *oldest = shared->readAhead;
+		shared->readAhead = oldest->next;
+		shared->readAheadBlocks -= oldest->req.count;
+		freeReadAheadRun(oldest);
+	}
+	
+	TReadAhead *run = (TReadAhead *) calloc(sizeof(TReadAhead), 1);
+	run->req.buffer = (char *) malloc((unsigned long) count * f->blockSize);
+	run->req.startBlock = startBlock;
+	run->req.count = count;
+	submitBlockRead(&run->req);
+	
+	TReadAhead **link = &shared->readAhead;
+	while(*link != NULL) {
+		link = &(*link)->next;
 	}
-    _oftCount = 0;
+	*link = run;
+	shared->readAheadBlocks += count;
+}
+
+// Drop a reference to an open inode, freeing it with the last one. Called
+// with _oftLock held.
+void releaseOpenInode(TOpenInode *shared)
+{
+	if(--shared->refCount > 0) {
+		return;
+	}
+	
+	_openInodes[shared->inode] = NULL;
+	dropReadAhead(shared);
+	releaseInodeBuffer(shared->inodeBuffer);
+	pthread_mutex_destroy(&shared->lock);
+	free(shared->cluster);
+	free(shared->retired);
+	free(shared);
 }
 
 int createOpenFileEntry(const char *filename, int mode, unsigned int inode, unsigned long len) {
-	if (_oftCount >= _fs->maxFiles) {
-		_result = FS_ERROR;
-		return -1;
+	pthread_mutex_lock(&_oftLock);
+	
+	if (_oftFree == -1) {
+		growOpenFileTable();
 	}
 	
-	_oft[_oftCount].openMode = mode;
-	_oft[_oftCount].blockSize = _fs->blockSize;
-	_oft[_oftCount].inode = inode;
-	unsigned long* inodeBuffer = makeInodeBuffer();
-	loadInode(inodeBuffer, inode);
-	_oft[_oftCount].inodeBuffer = inodeBuffer;
-	_oft[_oftCount].buffer = makeDataBuffer();
-	_oft[_oftCount].writePtr = (mode == MODE_READ_APPEND ? (len % _fs->blockSize) : 0);
-	_oft[_oftCount].readPtr = 0;
-	_oft[_oftCount].filePtr = (mode == MODE_READ_APPEND ? len : 0);
-	memcpy(filenames[_oftCount], filename, strlen(filename));
-	_oftCount++;
+	int fp = _oftFree;
+	TOpenFile *f = oftEntry(fp);
+	_oftFree = f->next;
+	
+	// link onto the open list
+	f->prev = -1;
+	f->next = _oftOpen;
+	if (_oftOpen != -1) {
+		oftEntry(_oftOpen)->prev = fp;
+	}
+	_oftOpen = fp;
+	
+	f->openMode = mode;
+	f->blockSize = _fs->blockSize;
+	f->inode = inode;
+	f->shared = acquireOpenInode(inode);
+	f->inodeBuffer = f->shared->inodeBuffer;
+	f->lock = &f->shared->lock;
+	f->buffer = makeDataBuffer();
+	f->bufferBlock = 0;
+	f->bufferDirty = 0;
+	f->pending = NULL;
+	f->writePtr = (mode == MODE_READ_APPEND ? (len % _fs->blockSize) : 0);
+	f->readPtr = 0;
+	f->filePtr = (mode == MODE_READ_APPEND ? len : 0);
+	f->raNextPtr = f->filePtr;
+	f->raWindow = 0;
+	f->raEndBlock = 0;
+	strncpy(f->filename, filename, MAX_FNAME_LEN);
+	f->filename[MAX_FNAME_LEN] = 0;
+	pthread_mutex_unlock(&_oftLock);
 	_result = FS_OK;
-	return _oftCount - 1;
+	return fp;
 }
 
-// Opens a file in the partition. Depending on mode, a new file may be created
-// if it doesn't exist, or we may get FS_FILE_NOT_FOUND in _result. See the enum above for valid modes.
-// Return -1 if file open fails for some reason. E.g. file not found when mode is MODE_NORMAL, or
-// disk is full when mode is MODE_CREATE, etc.
-
-int openFile(const char *filename, unsigned char mode)
+// Write the directory and free list, unless a batch is deferring them.
+// Called with the metadata lock held.
+void commitMetadata()
 {
-	if (strlen(filename) > MAX_FNAME_LEN) {
-		_result = FS_ERROR;
-		return -1;
+	if(_batchDepth > 0) {
+		return;
 	}
 	
+	updateDirectory();
+	updateFreeList();
+}
+
+// Start a batch. See libefs.h.
+void beginBatch()
+{
+	lockMetadata(1);
+	_batchDepth++;
+	unlockMetadata();
+}
+
+// End a batch, writing the directory and free list once the outermost batch ends
+void endBatch()
+{
+	beginJournalOp();
+	flushBlockCache();
+	
+	lockMetadata(1);
+	if(_batchDepth > 0) {
+		_batchDepth--;
+	}
+	commitMetadata();
+	unlockMetadata();
+	endJournalOp();
+}
+
+// Open a file with the metadata lock held. See openFile.
+int openFileLocked(const char *filename, unsigned char mode)
+{
     unsigned int i = findFile(filename);
     switch (mode) {
         case MODE_NORMAL:
@@ -104,7 +315,7 @@ int openFile(const char *filename, unsigned char mode)
 					return -1;
 				}
 				
-				updateDirectory();
+				commitMetadata();
 				return createOpenFileEntry(filename, mode, i, 0); 
             }
             break;
@@ -134,103 +345,1049 @@ int openFile(const char *filename, unsigned char mode)
     }
 }
 
-// Write data to the file. File must be opened in MODE_NORMAL or MODE_CREATE modes. Does nothing
-// if file is opened in MODE_READ_ONLY mode.
-void writeFile(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount)
+// Opens a file in the partition. Depending on mode, a new file may be created
+// if it doesn't exist, or we may get FS_FILE_NOT_FOUND in _result. See the enum above for valid modes.
+// Return -1 if file open fails for some reason. E.g. file not found when mode is MODE_NORMAL, or
+// disk is full when mode is MODE_CREATE, etc.
+
+int openFile(const char *filename, unsigned char mode)
+{
+	if (strlen(filename) > MAX_FNAME_LEN) {
+		_result = FS_ERROR;
+		return -1;
+	}
+	
+	// only MODE_CREATE can change the directory
+	beginJournalOp();
+	lockMetadata(mode == MODE_CREATE);
+	int fp = openFileLocked(filename, mode);
+	unlockMetadata();
+	endJournalOp();
+	return fp;
+}
+
+// Allocate the blocks from firstBlock to lastBlock, none of which the file
+// has yet, in as few contiguous runs as possible. Returns 0, or -1 with
+// _result FS_FULL if they could not all be allocated.
+int reserveGap(TOpenFile *f, unsigned long firstBlock, unsigned long lastBlock)
+{
+	// create the indirect blocks for the gap first, so the data blocks
+	// allocated below stay contiguous and cannot starve them of space
+	for(unsigned long i = firstBlock; i <= lastBlock; i++) {
+		setBlockNumInInode(f->inodeBuffer, i * f->blockSize, 0);
+		
+		if(_result == FS_FULL) {
+			if(i == firstBlock) {
+				return -1;
+			}
+			lastBlock = i - 1;
+			break;
+		}
+	}
+	
+	unsigned long nextBlock = firstBlock;
+	while(nextBlock <= lastBlock) {
+		unsigned long runLen;
+		unsigned long startBlock = findFreeExtent(lastBlock - nextBlock + 1, &runLen);
+		
+		if(_result == FS_FULL) {
+			return -1;
+		}
+		
+		allocateRun(startBlock, runLen);
+		for(unsigned long i = 0; i < runLen; i++) {
+			setBlockNumInInode(f->inodeBuffer, (nextBlock + i) * f->blockSize, startBlock + i);
+			
+			// the inode is out of room; give back the rest of the run
+			if(_result == FS_FULL) {
+				freeRun(startBlock + i, runLen - i);
+				return -1;
+			}
+		}
+		nextBlock += runLen;
+	}
+	
+	return (_result == FS_FULL ? -1 : 0);
+}
+
+// Allocate every block that a write of len bytes at the file pointer needs
+// and the file does not have yet. Blocks already in the file are written in
+// place, so only the gaps between them are allocated, each in as few
+// contiguous runs as possible.
+void reserveBlocks(TOpenFile *f, unsigned int len)
+{
+	unsigned long firstBlock = f->filePtr / f->blockSize;
+	unsigned long lastBlock = (f->filePtr + len - 1) / f->blockSize;
+	
+	// an inode holds at most getMaxFileBlocks() blocks
+	if(lastBlock >= getMaxFileBlocks()) {
+		lastBlock = getMaxFileBlocks() - 1;
+	}
+	
+	unsigned long nextBlock = firstBlock;
+	while(nextBlock <= lastBlock) {
+		if(returnBlockNumFromInode(f->inodeBuffer, nextBlock * f->blockSize) != 0) {
+			nextBlock++;
+			continue;
+		}
+		
+		// the gap runs up to the next block the file has
+		unsigned long gapEnd = nextBlock;
+		while(gapEnd < lastBlock && returnBlockNumFromInode(f->inodeBuffer, (gapEnd + 1) * f->blockSize) == 0) {
+			gapEnd++;
+		}
+		
+		if(reserveGap(f, nextBlock, gapEnd) != 0) {
+			return;
+		}
+		nextBlock = gapEnd + 1;
+	}
+}
+
+// Check whether file data is compressed
+int compressing()
+{
+	return _fs->inodeFormat == INODE_BLOCKMAP_LZ;
+}
+
+// Bytes in a compression cluster
+unsigned long clusterBytes()
+{
+	return (unsigned long) COMPRESS_CLUSTER_BLOCKS * _fs->blockSize;
+}
+
+// Allocate the open inode's cluster buffers on first use
+void allocClusterBuffers(TOpenInode *shared)
+{
+	if(shared->cluster == NULL) {
+		shared->cluster = (char *) malloc(2 * clusterBytes());
+		shared->packed = shared->cluster + clusterBytes();
+	}
+}
+
+// Decompress a cluster into the open inode's cluster buffer. Returns 0, or
+// -1 if the compressed data is damaged.
+int loadCluster(TOpenFile *f, unsigned long cluster)
+{
+	TOpenInode *shared = f->shared;
+	
+	if(shared->clusterIndex == cluster + 1) {
+		return 0;
+	}
+	
+	allocClusterBuffers(shared);
+	shared->clusterIndex = 0;
+	
+	unsigned long len = getClusterLength(f->inodeBuffer, cluster);
+	unsigned long held = (len + f->blockSize - 1) / f->blockSize;
+	unsigned long blockNums[COMPRESS_CLUSTER_BLOCKS];
+	
+	if(held >= COMPRESS_CLUSTER_BLOCKS) {
+		return -1;
+	}
+	
+	getBlockNumsFromInode(f->inodeBuffer, cluster * COMPRESS_CLUSTER_BLOCKS, held, blockNums);
+	readBlocks(shared->packed, blockNums, held);
+	
+	long size = decompressData(shared->packed, len, shared->cluster, clusterBytes());
+	if(size < 0) {
+		return -1;
+	}
+	
+	memset(shared->cluster + size, 0, clusterBytes() - size);
+	shared->clusterIndex = cluster + 1;
+	shared->clusterBlocks = size / f->blockSize;
+	return 0;
+}
+
+// Write the open file's buffer to its block if it holds unwritten data
+void flushOpenFileBuffer(TOpenFile *f)
+{
+	if(f->bufferDirty && f->bufferBlock != 0) {
+		dropReadAhead(f->shared);
+		writeBlock(f->buffer, f->bufferBlock);
+	}
+	f->bufferDirty = 0;
+}
+
+/*
+
+   Entries open on the same file share its open inode, and its lock, but
+   each has a buffer of its own. A block is held in the buffer of at most
+   one of them, so no entry can read or write back a stale copy.
+
+   */
+
+// Write the buffer of every entry open on f's inode if it holds unwritten
+// data, so reads of the blocks underneath see it
+void flushSharedBuffers(TOpenFile *f)
+{
+	if(f->shared->refCount == 1) {
+		flushOpenFileBuffer(f);
+		return;
+	}
+	
+	pthread_mutex_lock(&_oftLock);
+	for(int fp = _oftOpen; fp != -1; fp = oftEntry(fp)->next) {
+		if(oftEntry(fp)->shared == f->shared) {
+			flushOpenFileBuffer(oftEntry(fp));
+		}
+	}
+	pthread_mutex_unlock(&_oftLock);
+}
+
+// Drop count blocks from startBlock from the buffer of every entry open on
+// f's inode, unwritten data included
+void forgetSharedBuffers(TOpenFile *f, unsigned long startBlock, unsigned long count)
+{
+	if(f->shared->refCount == 1) {
+		if(f->bufferBlock >= startBlock && f->bufferBlock < startBlock + count) {
+			f->bufferBlock = 0;
+			f->bufferDirty = 0;
+		}
+		return;
+	}
+	
+	pthread_mutex_lock(&_oftLock);
+	for(int fp = _oftOpen; fp != -1; fp = oftEntry(fp)->next) {
+		TOpenFile *entry = oftEntry(fp);
+		
+		if(entry->shared == f->shared && entry->bufferBlock >= startBlock && entry->bufferBlock < startBlock + count) {
+			entry->bufferBlock = 0;
+			entry->bufferDirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&_oftLock);
+}
+
+// Take blockNum out of the buffers of the other entries open on f's inode,
+// writing any unwritten data first, before f's buffer is given it
+void claimSharedBlock(TOpenFile *f, unsigned long blockNum)
+{
+	if(f->shared->refCount == 1) {
+		return;
+	}
+	
+	pthread_mutex_lock(&_oftLock);
+	for(int fp = _oftOpen; fp != -1; fp = oftEntry(fp)->next) {
+		TOpenFile *entry = oftEntry(fp);
+		
+		if(entry != f && entry->shared == f->shared && entry->bufferBlock == blockNum) {
+			flushOpenFileBuffer(entry);
+			entry->bufferBlock = 0;
+		}
+	}
+	pthread_mutex_unlock(&_oftLock);
+}
+
+// Keep a block a rewritten cluster no longer uses until the inode that
+// drops it is saved
+void retireBlock(TOpenInode *shared, unsigned long blockNum)
+{
+	if(shared->retiredCount == shared->retiredSize) {
+		shared->retiredSize = (shared->retiredSize == 0 ? COMPRESS_CLUSTER_BLOCKS : shared->retiredSize * 2);
+		shared->retired = (unsigned long *) realloc(shared->retired, shared->retiredSize * sizeof(unsigned long));
+	}
+	shared->retired[shared->retiredCount++] = blockNum;
+}
+
+// Free the blocks retired since the inode was last saved. Called with the
+// metadata lock held, after saveInode and in the same journal operation.
+void freeRetiredBlocks(TOpenInode *shared)
+{
+	for(unsigned long i = 0; i < shared->retiredCount; i++) {
+		markBlockFree(shared->retired[i]);
+	}
+	shared->retiredCount = 0;
+}
+
+// Store count blocks of data as a cluster, in fresh blocks, with len its
+// compressed length or 0 if it is stored as it is. The old blocks stay
+// allocated until flushFile saves the inode, so the saved inode never
+// points at blocks another file may have been given. Returns 0, or -1
+// with _result FS_FULL if there is no room.
+int replaceCluster(TOpenFile *f, unsigned long cluster, const char *data, unsigned long count, unsigned long len)
+{
+	unsigned long first = cluster * COMPRESS_CLUSTER_BLOCKS;
+	unsigned long oldBlocks[COMPRESS_CLUSTER_BLOCKS], newBlocks[COMPRESS_CLUSTER_BLOCKS];
+	unsigned long allocated = 0;
+	
+	getBlockNumsFromInode(f->inodeBuffer, first, COMPRESS_CLUSTER_BLOCKS, oldBlocks);
+	
+	lockMetadata(1);
+	while(allocated < count) {
+		unsigned long runLen;
+		unsigned long startBlock = findFreeExtent(count - allocated, &runLen);
+		
+		if(_result == FS_FULL) {
+			for(unsigned long i = 0; i < allocated; i++) {
+				markBlockFree(newBlocks[i]);
+			}
+			unlockMetadata();
+			return -1;
+		}
+		
+		allocateRun(startBlock, runLen);
+		for(unsigned long i = 0; i < runLen; i++) {
+			newBlocks[allocated++] = startBlock + i;
+		}
+	}
+	unlockMetadata();
+	
+	writeBlocks(data, newBlocks, count);
+	
+	lockMetadata(1);
+	for(unsigned long i = 0; i < COMPRESS_CLUSTER_BLOCKS; i++) {
+		if(i < count || oldBlocks[i] != 0) {
+			setBlockNumInInode(f->inodeBuffer, (first + i) * f->blockSize, i < count ? newBlocks[i] : 0);
+		}
+		
+		if(oldBlocks[i] != 0) {
+			cacheDrop(oldBlocks[i]);
+			retireBlock(f->shared, oldBlocks[i]);
+		}
+	}
+	setClusterLength(f->inodeBuffer, cluster, len);
+	unlockMetadata();
+	
+	// any entry on the file may hold one of the old blocks
+	for(unsigned long i = 0; i < COMPRESS_CLUSTER_BLOCKS; i++) {
+		if(oldBlocks[i] != 0) {
+			forgetSharedBuffers(f, oldBlocks[i], 1);
+		}
+	}
+	
+	f->shared->clusterIndex = 0;
+	_result = FS_OK;
+	return 0;
+}
+
+// Compress count blocks of data into a cluster. Returns 0, or -1 if the
+// data does not compress into fewer blocks or there is no room for it, in
+// which case the cluster is left as it was.
+int packCluster(TOpenFile *f, const char *data, unsigned long cluster, unsigned long count)
+{
+	TOpenInode *shared = f->shared;
+	
+	allocClusterBuffers(shared);
+	
+	unsigned long len = compressData(data, count * f->blockSize, shared->packed, (count - 1) * f->blockSize);
+	if(len == 0) {
+		return -1;
+	}
+	
+	unsigned long held = (len + f->blockSize - 1) / f->blockSize;
+	memset(shared->packed + len, 0, held * f->blockSize - len);
+	
+	if(replaceCluster(f, cluster, shared->packed, held, len) != 0) {
+		_result = FS_OK;
+		return -1;
+	}
+	return 0;
+}
+
+// Store the compressed clusters that a write of len bytes at startPtr lands
+// in as they are, so their blocks can be written in place. Returns 0, or -1
+// with _result set if one could not be.
+int expandClusters(TOpenFile *f, unsigned long startPtr, unsigned long len)
+{
+	unsigned long lastCluster = (startPtr + len - 1) / clusterBytes();
+	
+	flushSharedBuffers(f);
+	for(unsigned long cluster = startPtr / clusterBytes(); cluster <= lastCluster; cluster++) {
+		if(getClusterLength(f->inodeBuffer, cluster) == 0) {
+			continue;
+		}
+		
+		if(loadCluster(f, cluster) != 0) {
+			_result = FS_ERROR;
+			return -1;
+		}
+		
+		if(replaceCluster(f, cluster, f->shared->cluster, f->shared->clusterBlocks, 0) != 0) {
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+// Compress the clusters written since the last flush that are stored as
+// they are. Their data is read back, so whole clusters written in one go
+// are compressed on the way in instead.
+void packWrittenClusters(TOpenFile *f)
+{
+	TOpenInode *shared = f->shared;
+	
+	if(!compressing() || shared->packFrom == shared->packTo) {
+		return;
+	}
+	
+	lockMetadata(0);
+	unsigned long fileBlocks = (getFileLength(f->filename) + f->blockSize - 1) / f->blockSize;
+	unlockMetadata();
+	
+	flushSharedBuffers(f);
+	char *data = (char *) malloc(clusterBytes());
+	
+	for(unsigned long cluster = shared->packFrom; cluster < shared->packTo; cluster++) {
+		unsigned long first = cluster * COMPRESS_CLUSTER_BLOCKS;
+		unsigned long count = fileBlocks - first < COMPRESS_CLUSTER_BLOCKS ? fileBlocks - first : COMPRESS_CLUSTER_BLOCKS;
+		unsigned long blockNums[COMPRESS_CLUSTER_BLOCKS];
+		
+		// a single block cannot get any smaller
+		if(first >= fileBlocks || count < 2 || getClusterLength(f->inodeBuffer, cluster) != 0) {
+			continue;
+		}
+		
+		getBlockNumsFromInode(f->inodeBuffer, first, count, blockNums);
+		readBlocks(data, blockNums, count);
+		packCluster(f, data, cluster, count);
+	}
+	
+	free(data);
+	shared->packFrom = shared->packTo = 0;
+}
+
+// Collect the open file's finished block requests, waiting for all of them
+// if wait is set. Returns the number still in flight. _result is FS_ERROR
+// if any of the collected requests failed.
+int reapFileRequests(TOpenFile *f, int wait)
+{
+	TIORequest **link = &f->pending;
+	int inFlight = 0;
+	
+	_result = FS_OK;
+	pollBlockRequests();
+	
+	while(*link != NULL) {
+		TIORequest *req = *link;
+		
+		if(wait) {
+			waitBlockRequest(req);
+		}
+		
+		if(!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE)) {
+			inFlight++;
+			link = &req->next;
+			continue;
+		}
+		
+		if(req->result != FS_OK) {
+			_result = FS_ERROR;
+		}
+		*link = req->next;
+		free(req);
+	}
+	
+	return inFlight;
+}
+
+// Start reads for count blocks, numbered in blockNums, into consecutive
+// blocks of buffer. Adjacent block numbers share a request. Block 0 reads
+// as zeros.
+void queueBlockReads(TOpenFile *f, char *buffer, const unsigned long *blockNums, unsigned int count)
+{
+	unsigned int i = 0;
+	
+	while(i < count) {
+		char *target = buffer + (unsigned long) i * f->blockSize;
+		
+		if(blockNums[i] == 0) {
+			memset(target, 0, f->blockSize);
+			i++;
+			continue;
+		}
+		
+		if(takeReadAhead(f, target, blockNums[i]) || readCachedBlock(target, blockNums[i])) {
+			i++;
+			continue;
+		}
+		
+		unsigned int run = 1;
+		while(i + run < count && blockNums[i + run] == blockNums[i] + run) {
+			run++;
+		}
+		
+		TIORequest *req = (TIORequest *) calloc(sizeof(TIORequest), 1);
+		req->buffer = buffer + (unsigned long) i * f->blockSize;
+		req->startBlock = blockNums[i];
+		req->count = run;
+		submitBlockRead(req);
+		
+		req->next = f->pending;
+		f->pending = req;
+		i += run;
+	}
+}
+
+// Start reads for count file blocks from fileBlock into consecutive blocks
+// of buffer, as queueBlockReads does. Blocks of compressed clusters are
+// copied out of the decompressed cluster. Returns -1 if one is damaged.
+int queueFileReads(TOpenFile *f, char *buffer, unsigned long fileBlock, const unsigned long *blockNums, unsigned int count)
 {
-	TOpenFile f = _oft[fp];
-    if (f.openMode == MODE_READ_ONLY || f.inode == -1 || dataSize <= 0 || dataCount <= 0) {
+	unsigned int i = 0;
+	int damaged = 0;
+	
+	if(!compressing()) {
+		queueBlockReads(f, buffer, blockNums, count);
+		return 0;
+	}
+	
+	while(i < count) {
+		unsigned long cluster = (fileBlock + i) / COMPRESS_CLUSTER_BLOCKS;
+		unsigned int span = (cluster + 1) * COMPRESS_CLUSTER_BLOCKS - (fileBlock + i);
+		char *target = buffer + (unsigned long) i * f->blockSize;
+		
+		if(span > count - i) {
+			span = count - i;
+		}
+		
+		if(getClusterLength(f->inodeBuffer, cluster) == 0) {
+			// neighbouring clusters stored as they are are read together
+			unsigned int run = span;
+			while(i + run < count && getClusterLength(f->inodeBuffer, (fileBlock + i + run) / COMPRESS_CLUSTER_BLOCKS) == 0) {
+				run += COMPRESS_CLUSTER_BLOCKS;
+			}
+			if(run > count - i) {
+				run = count - i;
+			}
+			queueBlockReads(f, target, blockNums + i, run);
+			i += run;
+			continue;
+		}
+		
+		if(loadCluster(f, cluster) != 0) {
+			memset(target, 0, (unsigned long) span * f->blockSize);
+			damaged = 1;
+		} else {
+			memcpy(target, f->shared->cluster + ((fileBlock + i) % COMPRESS_CLUSTER_BLOCKS) * f->blockSize,
+			       (unsigned long) span * f->blockSize);
+		}
+		i += span;
+	}
+	
+	return damaged ? -1 : 0;
+}
+
+// Start writing data to the file. Whole blocks may still be in flight when
+// this returns.
+void submitWrite(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount)
+{
+	TOpenFile *f = getOpenFile(fp);
+	if (f == NULL) {
+		_result = FS_ERROR;
+		return;
+	}
+	
+	// pointer blocks written back while blocks are allocated commit with
+	// the free list that marks those blocks used
+	beginJournalOp();
+	pthread_mutex_lock(f->lock);
+    if (f->openMode == MODE_READ_ONLY || f->inode == -1 || dataSize <= 0 || dataCount <= 0) {
+		pthread_mutex_unlock(f->lock);
+		endJournalOp();
 		_result = FS_ERROR;
         return;
     }
+	
+	// earlier requests may cover the blocks this one touches
+	reapFileRequests(f, 1);
+	dropReadAhead(f->shared);
+	
+	// reads move the file pointer too
+	f->writePtr = f->filePtr % f->blockSize;
   
     unsigned int total = dataSize * dataCount;
     unsigned int remaining = total, lenToWriteIntoThisBlock;
     unsigned long blockNumber;
+	unsigned long startPtr = f->filePtr;
+	
+	// compressed clusters are written as they are until the next flush
+	if(compressing() && expandClusters(f, startPtr, total) != 0) {
+		lockMetadata(1);
+		updateFreeList();
+		unlockMetadata();
+		pthread_mutex_unlock(f->lock);
+		endJournalOp();
+		return;
+	}
+	
+	// only the first and last blocks can be written in part. If they are new
+	// they start out as zeros rather than being read.
+	unsigned long firstBlock = startPtr / f->blockSize;
+	unsigned long lastBlock = (startPtr + total - 1) / f->blockSize;
+	int firstIsNew = (firstBlock >= getMaxFileBlocks() || returnBlockNumFromInode(f->inodeBuffer, startPtr) == 0);
+	int lastIsNew = (lastBlock >= getMaxFileBlocks() || returnBlockNumFromInode(f->inodeBuffer, lastBlock * f->blockSize) == 0);
+	
+	// allocate the new blocks for this write up front so they are contiguous
+	lockMetadata(1);
+	reserveBlocks(f, total);
+	unlockMetadata();
+	_result = FS_OK;
 	
 	while(remaining > 0) {
-		blockNumber = returnBlockNumFromInode(f.inodeBuffer, f.filePtr);
+		blockNumber = returnBlockNumFromInode(f->inodeBuffer, f->filePtr);
 
 		if(blockNumber == 0){
-			blockNumber = findFreeBlock();
-			
-			if(_result == FS_FULL) {
-				// stop when there is no space in the disk
-				return;
+			// stop when there is no space in the disk
+			_result = FS_FULL;
+			break;
+		}
+		
+		unsigned long fileBlock = f->filePtr / f->blockSize;
+		
+		// a whole cluster is compressed on the way to the disk
+		if(compressing() && f->writePtr == 0 && fileBlock % COMPRESS_CLUSTER_BLOCKS == 0 &&
+		   remaining >= clusterBytes() && fileBlock + COMPRESS_CLUSTER_BLOCKS <= getMaxFileBlocks() &&
+		   packCluster(f, (char *)buffer + total - remaining, fileBlock / COMPRESS_CLUSTER_BLOCKS, COMPRESS_CLUSTER_BLOCKS) == 0) {
+			f->filePtr += clusterBytes();
+			remaining -= clusterBytes();
+			continue;
+		}
+		
+		if(f->writePtr == 0 && remaining >= f->blockSize) {
+			// whole blocks replace what is on disk, so there is nothing to read.
+			// blocks that are contiguous on disk go out in one write.
+			unsigned long runLen = 1;
+			while((runLen + 1) * f->blockSize <= remaining &&
+			      returnBlockNumFromInode(f->inodeBuffer, (fileBlock + runLen) * f->blockSize) == blockNumber + runLen) {
+				runLen++;
 			}
 			
-			markBlockBusy(blockNumber);
-			setBlockNumInInode(f.inodeBuffer, f.filePtr, blockNumber);
-		} else {
-			readBlock(f.buffer, blockNumber);
+			TIORequest *req = (TIORequest *) calloc(sizeof(TIORequest), 1);
+			req->buffer = (char *)buffer + total - remaining;
+			req->startBlock = blockNumber;
+			req->count = runLen;
+			submitBlockWrite(req);
+			
+			req->next = f->pending;
+			f->pending = req;
+			
+			// any entry on the file may hold an older copy of one of these blocks
+			forgetSharedBuffers(f, blockNumber, runLen);
+			
+			f->filePtr += runLen * f->blockSize;
+			remaining -= runLen * f->blockSize;
+			continue;
+		}
+		
+		// partial blocks are assembled in the file buffer
+		if(f->bufferBlock != blockNumber) {
+			flushOpenFileBuffer(f);
+			claimSharedBlock(f, blockNumber);
+			
+			if((fileBlock == firstBlock && firstIsNew) || (fileBlock == lastBlock && lastIsNew)) {
+				memset(f->buffer, 0, f->blockSize);
+			} else {
+				readBlock(f->buffer, blockNumber);
+			}
+			f->bufferBlock = blockNumber;
 		}
 
-		lenToWriteIntoThisBlock = (f.blockSize - f.writePtr) < remaining ?
-								  (f.blockSize - f.writePtr) : remaining;
-		memcpy(f.buffer + f.writePtr, 
+		lenToWriteIntoThisBlock = (f->blockSize - f->writePtr) < remaining ?
+								  (f->blockSize - f->writePtr) : remaining;
+		memcpy(f->buffer + f->writePtr, 
 		       (char *)buffer + total - remaining, 
 		       lenToWriteIntoThisBlock);
-		f.filePtr = f.filePtr + lenToWriteIntoThisBlock;
-		f.writePtr = (f.writePtr + lenToWriteIntoThisBlock) % f.blockSize;
+		f->bufferDirty = 1;
+		f->filePtr = f->filePtr + lenToWriteIntoThisBlock;
+		f->writePtr = (f->writePtr + lenToWriteIntoThisBlock) % f->blockSize;
 		remaining -= lenToWriteIntoThisBlock;
-		writeBlock(f.buffer, blockNumber);
-		if (f.filePtr > getFileLength(filenames[fp])) {
-			printf("aaa");
-			updateDirectoryFileLength(filenames[fp], f.filePtr);
+	}
+	
+	unsigned long result = _result;
+	lockMetadata(1);
+	if (f->filePtr > getFileLength(f->filename)) {
+		updateDirectoryFileLength(f->filename, f->filePtr);
+	}
+	updateFreeList();
+	unlockMetadata();
+	
+	// clusters not compressed on the way in are tried again at the next flush
+	if(compressing() && f->filePtr > startPtr) {
+		TOpenInode *shared = f->shared;
+		unsigned long firstCluster = startPtr / clusterBytes();
+		unsigned long endCluster = (f->filePtr - 1) / clusterBytes() + 1;
+		
+		if(shared->packFrom == shared->packTo) {
+			shared->packFrom = firstCluster;
+			shared->packTo = endCluster;
+		} else {
+			shared->packFrom = firstCluster < shared->packFrom ? firstCluster : shared->packFrom;
+			shared->packTo = endCluster > shared->packTo ? endCluster : shared->packTo;
 		}
 	}
 	
-	_oft[fp] = f;
+	// send the whole-block writes to the device together
+	pollBlockRequests();
+	_result = result;
+	
+	pthread_mutex_unlock(f->lock);
+	endJournalOp();
+}
+
+// Collect the file's finished asynchronous requests. See libefs.h.
+int pollFile(int fp, int wait)
+{
+	TOpenFile *f = getOpenFile(fp);
+	if(f == NULL) {
+		_result = FS_ERROR;
+		return 0;
+	}
+	
+	pthread_mutex_lock(f->lock);
+	int inFlight = reapFileRequests(f, wait);
+	pthread_mutex_unlock(f->lock);
+	
+	return inFlight;
+}
+
+// Write data to the file. File must be opened in MODE_NORMAL or MODE_CREATE modes. Does nothing
+// if file is opened in MODE_READ_ONLY mode.
+void writeFile(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount)
+{
+	submitWrite(fp, buffer, dataSize, dataCount);
+	
+	unsigned long result = _result;
+	pollFile(fp, 1);
+	if(_result == FS_OK) {
+		_result = result;
+	}
 }
 
 // Flush the file data to the disk. Writes all data buffers, updates directory,
 // free list and inode for this file.
 void flushFile(int fp)
 {
-	TOpenFile f = _oft[fp];
-    if (f.openMode == MODE_READ_ONLY || f.inode == -1) {
+	TOpenFile *f = getOpenFile(fp);
+	if (f == NULL) {
+		_result = FS_ERROR;
+		return;
+	}
+	
+	// the inode, directory and free list commit together
+	beginJournalOp();
+	pthread_mutex_lock(f->lock);
+    if (f->openMode == MODE_READ_ONLY || f->inode == -1) {
+		pthread_mutex_unlock(f->lock);
+		endJournalOp();
 		_result = FS_ERROR;
         return;
     }
 	
-    updateDirectory();
-	updateFreeList();
-	saveInode(f.inodeBuffer, f.inode);
+	// the last partial block is still in the file buffer
+	reapFileRequests(f, 1);
+	flushOpenFileBuffer(f);
+	packWrittenClusters(f);
+	
+	flushBlockCache();
+	saveInode(f->inodeBuffer, f->inode);
+	lockMetadata(1);
+	freeRetiredBlocks(f->shared);
+	commitMetadata();
+	unlockMetadata();
+	pthread_mutex_unlock(f->lock);
+	endJournalOp();
 }
 
-// Read data from the file.
-void readFile(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount)
+// Track sequential reads and start reading the blocks that follow the file
+// pointer, to be collected by the reads that reach them. Called at the end
+// of each read.
+void readAhead(TOpenFile *f, unsigned long startPtr)
+{
+	if(startPtr != f->raNextPtr) {
+		// a seek; start over
+		f->raWindow = 0;
+		f->raEndBlock = 0;
+	} else if(f->raWindow == 0) {
+		f->raWindow = READAHEAD_MIN_BLOCKS;
+	} else if(f->raWindow < READAHEAD_MAX_BLOCKS) {
+		f->raWindow *= 2;
+	}
+	f->raNextPtr = f->filePtr;
+	
+	if(f->raWindow == 0) {
+		return;
+	}
+	
+	// top the window up once half of it has been consumed
+	unsigned long fileBlock = f->filePtr / f->blockSize;
+	unsigned long firstBlock = f->raEndBlock > fileBlock ? f->raEndBlock : fileBlock;
+	unsigned long lastBlock = fileBlock + f->raWindow;
+	
+	if(lastBlock > getMaxFileBlocks()) {
+		lastBlock = getMaxFileBlocks();
+	}
+	if(firstBlock >= lastBlock || f->raEndBlock >= fileBlock + f->raWindow / 2) {
+		return;
+	}
+	
+	unsigned long blockNums[READAHEAD_MAX_BLOCKS];
+	unsigned int count = lastBlock - firstBlock;
+	getBlockNumsFromInode(f->inodeBuffer, firstBlock, count, blockNums);
+	
+	// packed clusters are left to loadCluster
+	for(unsigned int i = 0; compressing() && i < count; i++) {
+		if(getClusterLength(f->inodeBuffer, (firstBlock + i) / COMPRESS_CLUSTER_BLOCKS) != 0) {
+			blockNums[i] = 0;
+		}
+	}
+	
+	// adjacent blocks are read together
+	for(unsigned int i = 0; i < count; ) {
+		unsigned int run = 1;
+		
+		if(blockNums[i] == 0) {
+			i++;
+			continue;
+		}
+		while(i + run < count && blockNums[i + run] == blockNums[i] + run) {
+			run++;
+		}
+		startReadAheadRun(f, blockNums[i], run);
+		i += run;
+	}
+	
+	pollBlockRequests();
+	f->raEndBlock = lastBlock;
+}
+
+// Load the block holding the file pointer into the open file's buffer.
+// Unallocated blocks read as zeros. Returns -1 if the block is in a damaged
+// compressed cluster.
+int stageBlock(TOpenFile *f)
+{
+	unsigned long fileBlock = f->filePtr / f->blockSize;
+	unsigned long blockNumber = 0;
+	
+	if(fileBlock < getMaxFileBlocks()) {
+		blockNumber = returnBlockNumFromInode(f->inodeBuffer, f->filePtr);
+	}
+	
+	// blocks of a compressed cluster have no block of their own to hold
+	if(compressing() && getClusterLength(f->inodeBuffer, fileBlock / COMPRESS_CLUSTER_BLOCKS) != 0) {
+		f->bufferBlock = 0;
+		if(loadCluster(f, fileBlock / COMPRESS_CLUSTER_BLOCKS) != 0) {
+			memset(f->buffer, 0, f->blockSize);
+			return -1;
+		}
+		memcpy(f->buffer, f->shared->cluster + (fileBlock % COMPRESS_CLUSTER_BLOCKS) * f->blockSize, f->blockSize);
+		return 0;
+	}
+	
+	if(blockNumber == f->bufferBlock && blockNumber != 0) {
+		return 0;
+	}
+	
+	if(blockNumber == 0) {
+		memset(f->buffer, 0, f->blockSize);
+	} else {
+		claimSharedBlock(f, blockNumber);
+		if(!takeReadAhead(f, f->buffer, blockNumber)) {
+			readBlock(f->buffer, blockNumber);
+		}
+	}
+	f->bufferBlock = blockNumber;
+	return 0;
+}
+
+// Start reading data from the file. Whole blocks may still be in flight
+// when this returns.
+void submitRead(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount)
 {
-	TOpenFile f = _oft[fp];
-    if (dataSize <= 0 || f.inode == -1) {
+	TOpenFile *f = getOpenFile(fp);
+	if (f == NULL) {
+		_result = FS_ERROR;
+		return;
+	}
+	
+	pthread_mutex_lock(f->lock);
+    if (dataSize <= 0 || f->inode == -1) {
+		pthread_mutex_unlock(f->lock);
 		_result = FS_ERROR;
         return;
     }
+	
+	// earlier writes must land before their blocks are read back
+	reapFileRequests(f, 1);
+	_result = FS_OK;
   
     unsigned int total = dataSize * dataCount;
     unsigned int remaining = total, lenToReadFromThisBlock;
-    unsigned long blockNumber;
+	char *target = (char *) buffer;
+	unsigned long startPtr = f->filePtr;
+	int damaged = 0;
 	
-	while(remaining > 0) {
-		blockNumber = returnBlockNumFromInode(f.inodeBuffer, f.filePtr);
-		if(blockNumber == 0){
-			memset((char *)buffer + total - remaining, 0, f.blockSize);
-		}else{
-			readBlock(f.buffer, blockNumber);
+	// blocks read below must see data still sitting in any entry's buffer
+	flushSharedBuffers(f);
+	
+	// unaligned head of the request goes through the file buffer
+	f->readPtr = f->filePtr % f->blockSize;
+	if(f->readPtr != 0 && remaining > 0) {
+		damaged |= stageBlock(f);
+		lenToReadFromThisBlock = f->blockSize - f->readPtr < remaining ?
+								  (f->blockSize - f->readPtr) : remaining;
+		memcpy(target, f->buffer + f->readPtr, lenToReadFromThisBlock);
+		
+		target += lenToReadFromThisBlock;
+		f->filePtr += lenToReadFromThisBlock;
+		remaining -= lenToReadFromThisBlock;
+	}
+	
+	// whole blocks are read straight into the caller's buffer
+	unsigned long fileBlock = f->filePtr / f->blockSize;
+	unsigned long wholeBlocks = remaining / f->blockSize;
+	if(wholeBlocks > 0) {
+		unsigned long mappedBlocks = 0;
+		if(fileBlock < getMaxFileBlocks()) {
+			mappedBlocks = getMaxFileBlocks() - fileBlock < wholeBlocks ?
+						   getMaxFileBlocks() - fileBlock : wholeBlocks;
+		}
+		
+		// resolve the block numbers a batch at a time
+		unsigned long blockNums[READ_BATCH_BLOCKS];
+		for(unsigned long done = 0; done < mappedBlocks; ) {
+			unsigned int batch = mappedBlocks - done < READ_BATCH_BLOCKS ?
+								 mappedBlocks - done : READ_BATCH_BLOCKS;
+			getBlockNumsFromInode(f->inodeBuffer, fileBlock + done, batch, blockNums);
+			damaged |= queueFileReads(f, target + done * f->blockSize, fileBlock + done, blockNums, batch);
+			done += batch;
 		}
 		
-		lenToReadFromThisBlock = f.blockSize - f.readPtr < remaining ?
-								  (f.blockSize - f.readPtr) : remaining;
-		memcpy((char *)buffer + total - remaining, 
-		       f.buffer, 
-		       lenToReadFromThisBlock);
+		// past the end of the inode there is nothing but zeros
+		memset(target + mappedBlocks * f->blockSize, 0, (wholeBlocks - mappedBlocks) * f->blockSize);
+		
+		target += wholeBlocks * f->blockSize;
+		f->filePtr += wholeBlocks * f->blockSize;
+		remaining -= wholeBlocks * f->blockSize;
+	}
+	
+	// unaligned tail
+	if(remaining > 0) {
+		damaged |= stageBlock(f);
+		memcpy(target, f->buffer, remaining);
+		f->filePtr += remaining;
+	}
+	
+	f->readPtr = f->filePtr % f->blockSize;
+	pollBlockRequests();
+	
+	// blocks that could not be read leave _result FS_ERROR; readahead cannot
+	unsigned long result = (damaged ? FS_ERROR : _result);
+	readAhead(f, startPtr);
+	pthread_mutex_unlock(f->lock);
+	_result = result;
+}
 
-		f.filePtr = f.filePtr + lenToReadFromThisBlock;
-		f.readPtr = (f.readPtr + lenToReadFromThisBlock) % f.blockSize;
-		remaining -= lenToReadFromThisBlock;
+// Read data from the file.
+void readFile(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount)
+{
+	submitRead(fp, buffer, dataSize, dataCount);
+	
+	// reads already queued into buffer must land even if one failed
+	unsigned long result = _result;
+	pollFile(fp, 1);
+	if(_result == FS_OK) {
+		_result = result;
 	}
 }
 
+// Copy a host stream into the file through two buffers. See libefs.h.
+void streamToFile(int fp, FILE *source)
+{
+	unsigned long chunkSize = STREAM_CHUNK_BLOCKS * _fs->blockSize;
+	char *buffers[2] = {(char *) malloc(chunkSize), (char *) malloc(chunkSize)};
+	unsigned long result = FS_OK;
+	int current = 0;
+	size_t len;
+	
+	// submitWrite collects the previous chunk before it starts the next
+	while((len = fread(buffers[current], sizeof(char), chunkSize, source)) > 0) {
+		submitWrite(fp, (void *) buffers[current], sizeof(char), len);
+		if(_result != FS_OK) {
+			result = _result;
+			break;
+		}
+		current = 1 - current;
+	}
+	
+	_result = FS_OK;
+	pollFile(fp, 1);
+	if(result == FS_OK) {
+		result = _result;
+	}
+	
+	free(buffers[0]);
+	free(buffers[1]);
+	_result = result;
+}
+
+// Copy the file out to a host stream through two buffers. See libefs.h.
+void streamFromFile(int fp, FILE *target, unsigned long len)
+{
+	unsigned long chunkSize = STREAM_CHUNK_BLOCKS * _fs->blockSize;
+	char *buffers[2] = {(char *) malloc(chunkSize), (char *) malloc(chunkSize)};
+	unsigned long done = 0, pendingLen = 0;
+	unsigned long result = FS_OK;
+	int current = 0;
+	
+	while(done < len) {
+		unsigned long chunk = len - done < chunkSize ? len - done : chunkSize;
+		
+		// collect the previous chunk first; submitRead would drop its errors
+		_result = FS_OK;
+		pollFile(fp, 1);
+		if(_result != FS_OK) {
+			result = FS_ERROR;
+		}
+		
+		submitRead(fp, (void *) buffers[current], sizeof(char), chunk);
+		if(_result != FS_OK) {
+			result = FS_ERROR;
+		}
+		if(pendingLen > 0 && fwrite(buffers[1 - current], sizeof(char), pendingLen, target) != pendingLen) {
+			result = FS_ERROR;
+		}
+		
+		pendingLen = chunk;
+		done += chunk;
+		current = 1 - current;
+	}
+	
+	_result = FS_OK;
+	pollFile(fp, 1);
+	if(_result != FS_OK) {
+		result = FS_ERROR;
+	}
+	if(pendingLen > 0 && fwrite(buffers[1 - current], sizeof(char), pendingLen, target) != pendingLen) {
+		result = FS_ERROR;
+	}
+	
+	free(buffers[0]);
+	free(buffers[1]);
+	_result = result;
+}
+
+// Set the attribute field of the file's directory entry
+void setFileAttr(const char *filename, unsigned int attr)
+{
+	if (strlen(filename) > MAX_FNAME_LEN) {
+		_result = FS_ERROR;
+		return;
+	}
+	
+	beginJournalOp();
+	lockMetadata(1);
+	findFile(filename);
+	if (_result == FS_OK) {
+		setAttr(filename, attr);
+		commitMetadata();
+	}
+	unlockMetadata();
+	endJournalOp();
+}
+
 // Delete the file. Read-only flag (bit 2 of the attr field) in directory listing must not be set. 
 // See TDirectory structure.
 void delFile(const char *filename) {
@@ -239,59 +1396,104 @@ void delFile(const char *filename) {
 		return;
 	}
 	
+	beginJournalOp();
+	lockMetadata(1);
     unsigned int index = findFile(filename);
     if (_result == FS_OK) {
 		unsigned int attr = getAttr(filename);
 		bool isReadOnly = attr & 0x04;
-		if(isReadOnly) {
+		
+		// an open entry would save its inode over whatever file takes it next.
+		// Opening takes the metadata lock, so none can start until this ends.
+		pthread_mutex_lock(&_oftLock);
+		bool isOpen = (_openInodes[index] != NULL);
+		pthread_mutex_unlock(&_oftLock);
+		
+		if(isReadOnly || isOpen) {
 			_result = FS_ERROR;
-			return;
 		} else {
 			unsigned long *inodeBuffer = makeInodeBuffer();
-			// make an empty buffer
-			char * dataBuffer = makeDataBuffer();
 			loadInode(inodeBuffer, index);
-			for(int i = 0;i < _fs->numInodeEntries; i++){
-				if(inodeBuffer[i] != 0) {			
-					// clear this block
-					writeBlock(dataBuffer, inodeBuffer[i]);
-					markBlockFree(inodeBuffer[i]);
-					inodeBuffer[i] = 0;
-				}
-			}
-			updateFreeList();
+			// clear and free every block of the file
+			releaseInodeBlocks(inodeBuffer, 1);
+			flushBlockCache();
 			saveInode(inodeBuffer, index);
 			delDirectoryEntry(filename);
-			updateDirectory();
+			commitMetadata();
+			releaseInodeBuffer(inodeBuffer);
 		}
 	} 
 	
-	return;
+	unlockMetadata();
+	endJournalOp();
+	
+	// freed blocks are zeroed only once the delete has committed
+	unsigned long result = _result;
+	waitForScrub();
+	_result = result;
 }
 
 // Close a file. Flushes all data buffers, updates inode, directory, etc.
 void closeFile(int fp) {
-	flushFile(fp);
+	TOpenFile *f = getOpenFile(fp);
+	if (f == NULL) {
+		_result = FS_ERROR;
+		return;
+	}
+	
+	// read-only files are not flushed but may still have reads in flight
+	_result = FS_OK;
+	pollFile(fp, 1);
+	unsigned long result = _result;
+	if(f->openMode != MODE_READ_ONLY) {
+		flushFile(fp);
+		if(result == FS_OK) {
+			result = _result;
+		}
+	}
+	
+	pthread_mutex_lock(f->lock);
+	releaseDataBuffer(f->buffer);
+	f->buffer = NULL;
+	pthread_mutex_unlock(f->lock);
 	
-	// mark as closed
-	_oft[fp].inode = -1;
+	// return the entry to the free list
+	pthread_mutex_lock(&_oftLock);
+	if (f->prev != -1) {
+		oftEntry(f->prev)->next = f->next;
+	} else {
+		_oftOpen = f->next;
+	}
+	if (f->next != -1) {
+		oftEntry(f->next)->prev = f->prev;
+	}
+	
+	releaseOpenInode(f->shared);
+	f->shared = NULL;
+	f->inodeBuffer = NULL;
+	f->lock = NULL;
+	f->inode = -1;
+	f->next = _oftFree;
+	_oftFree = fp;
+	pthread_mutex_unlock(&_oftLock);
+	_result = result;
 }
 
 
 // Unmount file system.
 void closeFS() {
-	for(int i = 0; i < _oftCount; i++){
-		if (_oft[i].inode != -1) {
-			closeFile(i);
-		}
+	while(_oftOpen != -1) {
+		closeFile(_oftOpen);
 	}
 	
-    for(int i = 0; i < _fs->maxFiles; i++){
-		free(filenames[i]);
+	for(int i = 0; i < _oftPageCount; i++) {
+		free(_oftPages[i]);
 	}
-	free(filenames);
-	
-    free(_oft);
+	free(_oftPages);
+	free(_openInodes);
+	_oftPages = NULL;
+	_oftPageCount = 0;
+	_oftFree = -1;
     
     unmountFS();
 }
@@ -1,4 +1,24 @@
 #include "efs.h"
+#include <pthread.h>
+
+// Number of block numbers readFile resolves from the inode at a time
+#define READ_BATCH_BLOCKS 256
+
+// Blocks in each of the two buffers streamToFile and streamFromFile copy files through
+#define STREAM_CHUNK_BLOCKS 128
+
+// Readahead window in blocks. It starts at the minimum on sequential reads,
+// doubles with each further sequential read up to the maximum, and closes
+// on a seek.
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 64
+
+// Blocks an open inode may hold read ahead; the oldest runs are dropped
+// beyond this
+#define READAHEAD_HELD_BLOCKS (2 * READAHEAD_MAX_BLOCKS)
+
+// Open file table entries added each time the table runs out
+#define OFT_PAGE_ENTRIES 64
 
 /* FILE MODES for opening a file */
 enum
@@ -11,22 +31,58 @@ enum
   MODE_READ_APPEND=3 // New data will be appended to the back of the file
 };
 
+/* A run of blocks read ahead of a sequential reader */
+typedef struct readAheadRun
+{
+  TIORequest req; // Read of the run into a buffer of its own
+  unsigned long used; // Blocks of the run taken so far
+  struct readAheadRun *next; // Next run, in the order they were started
+} TReadAhead;
+
+/* An open inode, shared by every open file entry on the same file */
+typedef struct openInode
+{
+  unsigned long inode; // Inode pointer
+  unsigned long *inodeBuffer; // Inode buffer
+  int refCount; // Open file entries using it
+  pthread_mutex_t lock; // Serialises operations on the file through any entry
+  char *cluster; // Decompressed cluster, allocated on first use
+  char *packed; // Compressed cluster, in the same allocation
+  unsigned long clusterIndex; // Cluster held in cluster plus one, 0 if none
+  unsigned long clusterBlocks; // Blocks of data in cluster
+  unsigned long packFrom, packTo; // Clusters written since the last flush, packTo one past the last
+  TReadAhead *readAhead; // Runs read ahead and not yet used up, oldest first
+  unsigned long readAheadBlocks; // Blocks held by readAhead
+  unsigned long *retired; // Blocks of clusters rewritten since the inode was last saved
+  unsigned long retiredCount, retiredSize; // Entries used and allocated in retired
+} TOpenInode;
+
 /* Open File Table structure. Feel free to modify */
 typedef struct oft
 {
   unsigned char openMode; // Mode selected
   unsigned int blockSize; // Size of each block
-  unsigned long inode; // Inode pointer
-  unsigned long *inodeBuffer; // Inode buffer
+  unsigned long inode; // Inode pointer, -1 if the entry is free
+  char filename[MAX_FNAME_LEN + 1]; // Name the file was opened with
+  TOpenInode *shared; // Inode shared with other entries on the file
+  unsigned long *inodeBuffer; // Inode buffer, shared->inodeBuffer
   char *buffer; // Data buffer
+  unsigned long bufferBlock; // Block held in buffer, 0 if none
+  char bufferDirty; // Set if buffer holds data not yet written to bufferBlock
   unsigned int writePtr; // Buffer index for writing data
   unsigned int readPtr; // Buffer index for reading data
-  unsigned int filePtr; // File pointer. Points relative to ALL data in a file, not just the current buffer
+  unsigned long filePtr; // File pointer. Points relative to ALL data in a file, not just the current buffer
+  unsigned long raNextPtr; // File pointer a sequential read would start at
+  unsigned int raWindow; // Readahead window in blocks, 0 if closed
+  unsigned long raEndBlock; // First file block past those prefetched
+  TIORequest *pending; // Asynchronous block requests not yet collected
+  pthread_mutex_t *lock; // shared->lock
+  int prev, next; // Neighbours on the list of open entries, or next on the free list
 } TOpenFile;
 
 // Mounts a paritition given in fsPartitionName. Must be called before all
-// other functions
-void initFS(const char *fsPartitionName, const char *fsPassword);
+// other functions. ioMode selects the partition I/O backend, see efs.h.
+void initFS(const char *fsPartitionName, const char *fsPassword, int ioMode = IO_PREAD);
 
 // Opens a file in the partition. Depending on mode, a new file may be created
 // if it doesn't exist, or we may get FS_FILE_NOT_FOUND in _result. See the enum above for valid modes.
@@ -42,6 +98,18 @@ int openFile(const char *filename, unsigned char mode);
 // Note dataSize * dataCount can exceed the size of one block.
 void writeFile(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount);
 
+// Start a write like writeFile, leaving whole blocks in flight. buffer must not change
+// until pollFile reports nothing pending.
+void submitWrite(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount);
+
+// Start a read like readFile, leaving whole blocks in flight. buffer is not complete
+// until pollFile reports nothing pending.
+void submitRead(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount);
+
+// Collect the file's finished submitWrite/submitRead requests, waiting for all of them
+// if wait is nonzero. Returns the number still pending. _result is FS_ERROR if any failed.
+int pollFile(int fp, int wait);
+
 // Flush the file data to the disk. Writes all data buffers, updates directory,
 // free list and inode for this file.
 void flushFile(int fp);
@@ -52,11 +120,33 @@ void flushFile(int fp);
 // Note dataSize * dataCount can exceed the size of one block.
 void readFile(int fp, void *buffer, unsigned int dataSize, unsigned int dataCount);
 
+// Write everything left in the host stream source to the file. The next chunk is read
+// from the host while the previous one is still being written. _result is FS_OK, or the
+// error of the write that failed, in which case the rest of source is not copied.
+void streamToFile(int fp, FILE *source);
+
+// Copy len bytes of the file to the host stream target. Each chunk is written to the host
+// while the next one is being read. _result is FS_ERROR if a read or a host write failed.
+void streamFromFile(int fp, FILE *target, unsigned long len);
+
+// Set the attribute field of the file's directory entry, see TDirectory. _result is
+// FS_FILE_NOT_FOUND if there is no such file.
+void setFileAttr(const char *filename, unsigned int attr);
+
 // Delete the file. Read-only flag (bit 2 of the attr field) in directory listing must not be set. 
-// See TDirectory structure.
+// See TDirectory structure. _result is FS_ERROR if the file is still open.
 void delFile(const char *filename);
 
-// Close a file. Flushes all data buffers, updates inode, directory, etc.
+// Start a batch of operations. Until the matching endBatch, flushFile, closeFile,
+// delFile and file creation leave the directory and free list to be written once
+// at the end. Batches nest.
+void beginBatch();
+
+// End a batch, writing the directory and free list if it is the outermost one
+void endBatch();
+
+// Close a file. Flushes all data buffers, updates inode, directory, etc. _result is
+// FS_ERROR if a request still in flight or the flush failed.
 void closeFile(int fp);
 
 // Unmount file system.
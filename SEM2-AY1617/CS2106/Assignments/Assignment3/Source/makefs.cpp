@@ -30,8 +30,40 @@ int main(int ac, char **av)
   fscanf(fp, "%lu\n", &fs.fsSize);
   fscanf(fp, "%d\n", &fs.blockSize);
   fscanf(fp, "%d\n", &fs.maxFiles);
+
+  // Optional settings: the inode format, "blockmap" (the default),
+  // "extent" or "direct" for the layout without indirect blocks that
+  // older partitions have, "journal <blocks>" to size the metadata
+  // journal, 0 for none, and "compress" to compress file data
+  char option[16];
+  long journalBlocks = -1;
+  int compress = 0;
+  fs.inodeFormat = INODE_BLOCKMAP;
+  while(fscanf(fp, "%15s", option) == 1)
+  {
+    if(!strcmp(option, "extent"))
+      fs.inodeFormat = INODE_EXTENT;
+    else if(!strcmp(option, "blockmap"))
+      fs.inodeFormat = INODE_BLOCKMAP;
+    else if(!strcmp(option, "direct"))
+      fs.inodeFormat = INODE_DIRECT;
+    else if(!strcmp(option, "journal"))
+      fscanf(fp, "%ld", &journalBlocks);
+    else if(!strcmp(option, "compress"))
+      compress = 1;
+  }
   fclose(fp);
 
+  // Compressed clusters are recorded in block map entries
+  if(compress && fs.inodeFormat != INODE_BLOCKMAP)
+  {
+    fprintf(stderr, "Compression needs the block map inode format.\n");
+    return -1;
+  }
+
+  if(compress)
+    fs.inodeFormat = INODE_BLOCKMAP_LZ;
+
   directory = (TDirectory *) calloc(sizeof(TDirectory), fs.maxFiles);
 
   for(i = 0; i<fs.maxFiles; i++)
@@ -68,8 +100,21 @@ int main(int ac, char **av)
   // inode table begins after bitmaps
   fs.inodeByteIndex = fs.bitmapByteIndex + fs.bitmapLen;
 
-  // Data table begins after inode table. There is one inode per file, and each inode is one block
-  fs.dataByteIndex = fs.inodeByteIndex + fs.blockSize * fs.maxFiles;
+  // Journal begins after inode table. There is one inode per file, and each inode is one block
+  unsigned long journalByteIndex = fs.inodeByteIndex + fs.blockSize * fs.maxFiles;
+
+  // By default the journal holds the whole directory and bitmap twice over, plus spare blocks.
+  // Its first block is the journal header.
+  if(journalBlocks < 0)
+  {
+    unsigned long metaLen = sizeof(TDirectory) * fs.maxFiles + fs.bitmapLen;
+    journalBlocks = 1 + 2 * ((metaLen + fs.blockSize - 1) / fs.blockSize) + JOURNAL_SPARE_BLOCKS;
+  }
+  else if(journalBlocks == 1)
+    journalBlocks = 2;
+
+  // Data table begins after the journal
+  fs.dataByteIndex = journalByteIndex + fs.blockSize * journalBlocks;
 
   // Usable data space
   unsigned long usableSpace = fs.fsSize - fs.dataByteIndex + 1;
@@ -82,24 +127,36 @@ int main(int ac, char **av)
   fwrite(&fs, sizeof(fs), 1, outfp);
 
   // Write out the directory
-  fseek(fp, fs.dirByteIndex, SEEK_SET);
-  fwrite(directory, sizeof(TDirectory), fs.maxFiles, fp);
+  fseek(outfp, fs.dirByteIndex, SEEK_SET);
+  fwrite(directory, sizeof(TDirectory), fs.maxFiles, outfp);
 
   // Seek to start of bitmap table
-  fseek(fp, fs.bitmapByteIndex, SEEK_SET);
+  fseek(outfp, fs.bitmapByteIndex, SEEK_SET);
 
   // Write the bitmap
   fwrite(bitmap, fs.bitmapLen, 1, outfp);
 
   // Write the inode table
-  fseek(fp, fs.inodeByteIndex, SEEK_SET);
+  fseek(outfp, fs.inodeByteIndex, SEEK_SET);
   for(i=0; i<fs.maxFiles; i++)
-    fwrite(inodeTable[i], sizeof(unsigned long), fs.numInodeEntries, fp);
+    fwrite(inodeTable[i], sizeof(unsigned long), fs.numInodeEntries, outfp);
+
+  // Write the journal header. The journal starts empty.
+  if(journalBlocks > 0)
+  {
+    TJournalHeader header = {JOURNAL_MAGIC, 1};
+    char *journalBlock = (char *) calloc(sizeof(char), fs.blockSize);
+
+    memcpy(journalBlock, &header, sizeof(header));
+    fseek(outfp, journalByteIndex, SEEK_SET);
+    fwrite(journalBlock, fs.blockSize, 1, outfp);
+    free(journalBlock);
+  }
 
   // Write out the data
-  fseek(fp, fs.fsSize, SEEK_SET);
-  fprintf(fp, "!");
-  fclose(fp);
+  fseek(outfp, fs.fsSize, SEEK_SET);
+  fprintf(outfp, "!");
+  fclose(outfp);
 
   printf("\nFILE SYSTEM SUMMARY\n");
   printf(  "===================\n\n");
@@ -110,6 +167,10 @@ int main(int ac, char **av)
   printf("Bitmap Length: %u bytes\n", fs.bitmapLen);
   printf("Usable Data Space: %lu bytes\n", usableSpace);
   printf("Number of pointers per inode block: %u\n", fs.numInodeEntries);
+  printf("Inode format: %s\n", fs.inodeFormat == INODE_EXTENT ? "extent" :
+      (fs.inodeFormat == INODE_DIRECT ? "direct" : "block map"));
+  printf("Journal: %ld blocks\n", journalBlocks);
+  printf("Compression: %s\n", fs.inodeFormat == INODE_BLOCKMAP_LZ ? "lz" : "none");
   printf("Percentage Usable Data Space: %3.2g%%\n", (double) usableSpace / fs.fsSize * 100.0);
 
   printf("\nByte Indexes:\n\n");
@@ -117,6 +178,7 @@ int main(int ac, char **av)
   printf("Directory Index: %u\n", fs.dirByteIndex);
   printf("Bitmap Index: %u\n", fs.bitmapByteIndex);
   printf("Inode Index: %u\n", fs.inodeByteIndex);
+  printf("Journal Index: %lu\n", journalByteIndex);
   printf("Data Index: %u\n\n", fs.dataByteIndex);
 
   free(directory);
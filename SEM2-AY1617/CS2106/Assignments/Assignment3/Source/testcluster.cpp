@@ -0,0 +1,145 @@
+#include "testutil.h"
+
+/*
+
+   Overwrites of files on a partition that compresses file data. Each
+   overwrite expands the clusters it lands in and packs them again on
+   flush; the file must read back as written, and deleting it must give
+   back every block it held.
+
+   */
+
+// Fill len bytes with text-like data that compresses well
+void fillText(char *buffer, unsigned long len, int seed)
+{
+	static const char *words[] = {"block ", "cluster ", "inode ", "journal ", "extent ", "\n"};
+	unsigned long i = 0;
+	
+	for(unsigned long n = seed; i < len; n = n * 7 + 3) {
+		const char *word = words[n % 6];
+		for(unsigned long j = 0; word[j] != 0 && i < len; j++) {
+			buffer[i++] = word[j];
+		}
+	}
+}
+
+// Write len bytes of data from the start of the file through a new entry
+int writeFront(const char *name, unsigned char mode, const char *data, unsigned long len)
+{
+	int fp = openFile(name, mode);
+	writeFile(fp, (void *) data, sizeof(char), len);
+	int ok = (_result == FS_OK);
+	closeFile(fp);
+
+	return ok && _result == FS_OK;
+}
+
+// Returns nonzero if the file reads back as len bytes of expected
+int readsBack(const char *name, const char *expected, unsigned long len)
+{
+	char *data = (char *) malloc(len);
+
+	lockMetadata(0);
+	int ok = (getFileLength(name) == len);
+	unlockMetadata();
+
+	int fp = openFile(name, MODE_READ_ONLY);
+	readFile(fp, data, sizeof(char), len);
+	ok = ok && _result == FS_OK && memcmp(data, expected, len) == 0;
+	closeFile(fp);
+
+	free(data);
+	return ok;
+}
+
+// Overwrite the front of a compressed file with unaligned writes of
+// different sizes, through one entry and then through two sharing it
+void overwrite(const char *name)
+{
+	unsigned long blockSize = getFSInfo()->blockSize;
+	unsigned long clusterLen = COMPRESS_CLUSTER_BLOCKS * blockSize;
+	unsigned long len = 5 * clusterLen + 300;
+	char *expected = (char *) malloc(len);
+	char *update = (char *) malloc(len);
+	unsigned long freeBefore = committedFreeBlocks();
+
+	fillText(expected, len, 1);
+	int ok = writeFront(name, MODE_CREATE, expected, len);
+	ok = ok && readsBack(name, expected, len);
+
+	// the data must take fewer blocks than it spans
+	ok = ok && freeBefore - committedFreeBlocks() < (len + blockSize - 1) / blockSize;
+	check("compressed write", ok);
+
+	unsigned long sizes[] = {100, blockSize + 10, clusterLen + 3 * blockSize + 17};
+	for(unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fillText(update, sizes[i], i + 2);
+		memcpy(expected, update, sizes[i]);
+
+		ok = writeFront(name, MODE_NORMAL, update, sizes[i]);
+		ok = ok && readsBack(name, expected, len);
+		check("overwrite", ok);
+	}
+
+	delFile(name);
+	check("delete", committedFreeBlocks() == freeBefore);
+
+	free(expected);
+	free(update);
+}
+
+// Rewrite a cluster through one entry while another sharing the file holds
+// unwritten data for one of its blocks. That data must be kept, and must
+// not later be written to the cluster's old blocks.
+void sharedOverwrite(const char *name)
+{
+	unsigned long blockSize = getFSInfo()->blockSize;
+	unsigned long len = COMPRESS_CLUSTER_BLOCKS * blockSize - 100;
+	char *expected = (char *) malloc(len + 50);
+	char *update = (char *) malloc(len);
+	unsigned long freeBefore = committedFreeBlocks();
+
+	fillText(expected, len + 50, 1);
+	int ok = writeFront(name, MODE_CREATE, expected, len);
+
+	int appender = openFile(name, MODE_READ_APPEND);
+	writeFile(appender, expected + len, sizeof(char), 50);
+	ok = ok && _result == FS_OK;
+
+	fillText(update, len - 100, 5);
+	memcpy(expected, update, len - 100);
+	ok = ok && writeFront(name, MODE_NORMAL, update, len - 100);
+
+	closeFile(appender);
+	ok = ok && _result == FS_OK && readsBack(name, expected, len + 50);
+	check("overwrite beside an appending entry", ok);
+
+	delFile(name);
+	check("delete", committedFreeBlocks() == freeBefore);
+
+	free(expected);
+	free(update);
+}
+
+int main(int ac, char **av)
+{
+	if(ac != 2)
+	{
+		printf("\nUsage: %s <partition file>\n\n", av[0]);
+		return -1;
+	}
+
+	initFS(av[1], "cs2106");
+
+	if(getFSInfo()->inodeFormat != INODE_BLOCKMAP_LZ) {
+		printf("%s: the partition does not compress file data\n", av[1]);
+		closeFS();
+		return 1;
+	}
+
+	overwrite("clustered");
+	sharedOverwrite("shared");
+
+	closeFS();
+	return _failures > 0 ? 1 : 0;
+}
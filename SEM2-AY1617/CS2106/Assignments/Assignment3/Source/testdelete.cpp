@@ -0,0 +1,154 @@
+#include "testutil.h"
+
+/*
+
+   Deletes under each scrub policy. Every delete must give back the blocks
+   the file held once it commits, and under SCRUB_IMMEDIATE those blocks
+   must read back as zeros as soon as delFile returns.
+
+   */
+
+#define FILE_BLOCKS 40
+
+// Write a file of FILE_BLOCKS blocks of nonzero data and return the blocks it
+// was given in blockNums
+void makeFile(const char *name, unsigned long *blockNums)
+{
+	unsigned long blockSize = getFSInfo()->blockSize;
+	unsigned long len = FILE_BLOCKS * blockSize;
+	char *data = (char *) malloc(len);
+
+	for(unsigned long i = 0; i < len; i++) {
+		data[i] = (char) (i % 251 + 1);
+	}
+
+	int fp = openFile(name, MODE_CREATE);
+	writeFile(fp, data, sizeof(char), len);
+	closeFile(fp);
+	free(data);
+
+	lockMetadata(0);
+	unsigned long *inode = makeInodeBuffer();
+	loadInode(inode, getInodeForFile(name));
+	getBlockNumsFromInode(inode, 0, FILE_BLOCKS, blockNums);
+	releaseInodeBuffer(inode);
+	unlockMetadata();
+}
+
+// Returns nonzero if every block in blockNums reads back as zeros
+int allZero(unsigned long *blockNums)
+{
+	unsigned long blockSize = getFSInfo()->blockSize;
+	char *buffer = makeDataBuffer();
+	int zero = 1;
+
+	for(unsigned int i = 0; i < FILE_BLOCKS && zero; i++) {
+		readBlock(buffer, blockNums[i]);
+		for(unsigned long j = 0; j < blockSize; j++) {
+			zero = zero && buffer[j] == 0;
+		}
+	}
+
+	releaseDataBuffer(buffer);
+	return zero;
+}
+
+// Create and delete a file under policy
+void deleteUnder(const char *name, int policy)
+{
+	unsigned long blockNums[FILE_BLOCKS];
+	unsigned long freeBefore = committedFreeBlocks();
+
+	setScrubPolicy(policy);
+	makeFile(name, blockNums);
+
+	delFile(name);
+	int ok = (_result == FS_OK);
+
+	if(policy == SCRUB_IMMEDIATE) {
+		ok = ok && allZero(blockNums);
+	}
+
+	ok = ok && committedFreeBlocks() == freeBefore;
+	check(name, ok);
+}
+
+// Delete several files in one batch, so their frees commit together
+void deleteBatch(const char *name, int policy)
+{
+	unsigned long blockNums[3][FILE_BLOCKS];
+	unsigned long freeBefore = committedFreeBlocks();
+	char names[3][MAX_FNAME_LEN + 1];
+
+	setScrubPolicy(policy);
+	for(int i = 0; i < 3; i++) {
+		snprintf(names[i], sizeof(names[i]), "%s-%d", name, i);
+		makeFile(names[i], blockNums[i]);
+	}
+
+	int ok = 1;
+	beginBatch();
+	for(int i = 0; i < 3; i++) {
+		delFile(names[i]);
+		ok = ok && _result == FS_OK;
+	}
+	endBatch();
+
+	for(int i = 0; i < 3 && policy == SCRUB_IMMEDIATE; i++) {
+		ok = ok && allZero(blockNums[i]);
+	}
+
+	ok = ok && committedFreeBlocks() == freeBefore;
+	check(name, ok);
+}
+
+// A file cannot be deleted while it is open. Once closed it can be, and
+// gives back its blocks, including those written through the open entry.
+void deleteWhileOpen(const char *name)
+{
+	unsigned long blockNums[FILE_BLOCKS];
+	unsigned long freeBefore = committedFreeBlocks();
+	char data[100];
+
+	setScrubPolicy(SCRUB_DEFERRED);
+	makeFile(name, blockNums);
+
+	int fp = openFile(name, MODE_READ_APPEND);
+	memset(data, 1, sizeof(data));
+	writeFile(fp, data, sizeof(char), sizeof(data));
+
+	delFile(name);
+	int ok = (_result == FS_ERROR);
+
+	lockMetadata(0);
+	findFile(name);
+	ok = ok && _result == FS_OK;
+	unlockMetadata();
+
+	closeFile(fp);
+	delFile(name);
+	ok = ok && _result == FS_OK && committedFreeBlocks() == freeBefore;
+	check(name, ok);
+}
+
+int main(int ac, char **av)
+{
+	if(ac != 2)
+	{
+		printf("\nUsage: %s <partition file>\n\n", av[0]);
+		return -1;
+	}
+
+	initFS(av[1], "cs2106");
+
+	deleteUnder("immediate", SCRUB_IMMEDIATE);
+	deleteUnder("deferred", SCRUB_DEFERRED);
+	deleteUnder("none", SCRUB_NONE);
+	deleteBatch("immediate-batch", SCRUB_IMMEDIATE);
+	deleteBatch("deferred-batch", SCRUB_DEFERRED);
+	deleteWhileOpen("open");
+
+	// blocks still queued are zeroed before this returns
+	closeFS();
+	return _failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+#include "testutil.h"
+
+/*
+
+   Round trips of files whose size puts their last block either side of
+   where the direct inode entries end and where each indirect block begins.
+   Deleting each file must give back every block it held, pointer blocks
+   included.
+
+   */
+
+// Write a file of len bytes, read it back, delete it and check that the
+// free block count is what it was before
+void roundTrip(const char *name, unsigned long len)
+{
+	unsigned long blockSize = getFSInfo()->blockSize;
+	unsigned long blocks = (len + blockSize - 1) / blockSize;
+	char *expected = (char *) malloc(len);
+	char *data = (char *) malloc(len);
+	unsigned long freeBefore = committedFreeBlocks();
+
+	fillPattern(expected, len, (int) blocks);
+
+	int fp = openFile(name, MODE_CREATE);
+	writeFile(fp, expected, sizeof(char), len);
+	int ok = (_result == FS_OK);
+	closeFile(fp);
+
+	fp = openFile(name, MODE_READ_ONLY);
+	readFile(fp, data, sizeof(char), len);
+	ok = ok && _result == FS_OK && memcmp(data, expected, len) == 0;
+	closeFile(fp);
+
+	delFile(name);
+	ok = ok && committedFreeBlocks() == freeBefore;
+
+	char label[64];
+	snprintf(label, sizeof(label), "%s, %lu blocks", name, blocks);
+	check(label, ok);
+	free(expected);
+	free(data);
+}
+
+// A write past the last block an inode can address fills the file up to
+// that block and fails with FS_FULL
+void pastLastBlock(const char *name)
+{
+	unsigned long blockSize = getFSInfo()->blockSize;
+	unsigned long maxBlocks = getMaxFileBlocks();
+	unsigned long len = (maxBlocks + 1) * blockSize;
+	char *data = (char *) malloc(len);
+
+	fillPattern(data, len, 7);
+
+	int fp = openFile(name, MODE_CREATE);
+	writeFile(fp, data, sizeof(char), len);
+	int ok = (_result == FS_FULL);
+	closeFile(fp);
+
+	lockMetadata(0);
+	ok = ok && getFileLength(name) == maxBlocks * blockSize;
+	unlockMetadata();
+
+	delFile(name);
+	char label[64];
+	snprintf(label, sizeof(label), "%s, %lu blocks", name, maxBlocks + 1);
+	check(label, ok);
+	free(data);
+}
+
+int main(int ac, char **av)
+{
+	if(ac != 2)
+	{
+		printf("\nUsage: %s <partition file>\n\n", av[0]);
+		return -1;
+	}
+
+	initFS(av[1], "cs2106");
+
+	TFileSystemStruct *fs = getFSInfo();
+	unsigned long entries = fs->numInodeEntries;
+	unsigned long blockSize = fs->blockSize;
+	unsigned long direct = (fs->inodeFormat == INODE_DIRECT ? entries : entries - 2);
+
+	// file sizes in blocks around each boundary
+	unsigned long sizes[] = {
+		direct - 1, direct, direct + 1,
+		entries - 1, entries, entries + 1,
+		direct + entries - 1, direct + entries, direct + entries + 1
+	};
+
+	for(unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int seen = 0;
+		for(unsigned int j = 0; j < i; j++) {
+			seen |= (sizes[j] == sizes[i]);
+		}
+		
+		if(seen || sizes[i] > getMaxFileBlocks()) {
+			continue;
+		}
+
+		roundTrip("whole-blocks", sizes[i] * blockSize);
+		roundTrip("partial-block", sizes[i] * blockSize - 10);
+	}
+
+	if(fs->inodeFormat == INODE_DIRECT) {
+		pastLastBlock("past-last-block");
+	}
+
+	closeFS();
+	return _failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+#include "testutil.h"
+
+/*
+
+   Round trips of reads followed by writes on one open file. Reads and
+   writes share the file pointer, so a write lands where the last read
+   stopped. Each case is run with both partition I/O backends.
+
+   */
+
+// Create filename holding len bytes of expected
+void makeFile(const char *filename, const char *expected, unsigned long len)
+{
+	int fp = openFile(filename, MODE_CREATE);
+	writeFile(fp, (void *) expected, sizeof(char), len);
+	closeFile(fp);
+}
+
+// Check that filename holds exactly len bytes of expected
+int fileMatches(const char *filename, const char *expected, unsigned long len)
+{
+	lockMetadata(0);
+	unsigned long fileLen = getFileLength(filename);
+	unlockMetadata();
+
+	if(fileLen != len) {
+		return 0;
+	}
+
+	char *data = (char *) malloc(len);
+	int fp = openFile(filename, MODE_READ_ONLY);
+	readFile(fp, data, sizeof(char), len);
+	int ok = (_result == FS_OK && memcmp(data, expected, len) == 0);
+	closeFile(fp);
+	free(data);
+
+	return ok;
+}
+
+// Read readLen bytes from the start of a file of fileLen bytes, write
+// writeLen bytes, and check that they land straight after the read
+void readThenWrite(const char *name, unsigned long fileLen, unsigned long readLen, unsigned long writeLen)
+{
+	unsigned long finalLen = readLen + writeLen > fileLen ? readLen + writeLen : fileLen;
+	char *expected = (char *) malloc(finalLen);
+	char *data = (char *) malloc(finalLen);
+
+	fillPattern(expected, fileLen, 1);
+	makeFile(name, expected, fileLen);
+
+	int fp = openFile(name, MODE_NORMAL);
+	readFile(fp, data, sizeof(char), readLen);
+	int readOk = (memcmp(data, expected, readLen) == 0);
+
+	fillPattern(data, writeLen, 2);
+	writeFile(fp, data, sizeof(char), writeLen);
+	closeFile(fp);
+
+	memcpy(expected + readLen, data, writeLen);
+	check(name, readOk && fileMatches(name, expected, finalLen));
+	delFile(name);
+
+	free(expected);
+	free(data);
+}
+
+// Write a block, read on past the end of the file, write another block
+// there, then overwrite the whole range. The blocks already written in the
+// range must be written in place, not replaced.
+void writeOverHole(const char *name)
+{
+	unsigned long blockSize = getFSInfo()->blockSize;
+	unsigned long len = 5 * blockSize + 100;
+	char *expected = (char *) malloc(6 * blockSize);
+	char *data = (char *) malloc(6 * blockSize);
+
+	int fp = openFile(name, MODE_CREATE);
+	fillPattern(data, blockSize, 3);
+	writeFile(fp, data, sizeof(char), blockSize);
+	readFile(fp, data, sizeof(char), 4 * blockSize);
+	fillPattern(data, blockSize, 4);
+	writeFile(fp, data, sizeof(char), blockSize);
+	closeFile(fp);
+
+	memcpy(expected + 5 * blockSize, data, blockSize);
+	fillPattern(expected, len, 5);
+
+	fp = openFile(name, MODE_NORMAL);
+	writeFile(fp, expected, sizeof(char), len);
+	closeFile(fp);
+
+	check(name, fileMatches(name, expected, 6 * blockSize));
+	delFile(name);
+
+	free(expected);
+	free(data);
+}
+
+// Two entries open on one file. Each must see what the other wrote, and
+// neither may write a stale copy of a block back over it.
+void twoEntries(const char *name)
+{
+	unsigned long blockSize = getFSInfo()->blockSize;
+	unsigned long len = 2 * blockSize;
+	char *expected = (char *) malloc(len);
+	char *data = (char *) malloc(len);
+
+	memset(expected, 'A', len);
+	makeFile(name, expected, len);
+
+	int first = openFile(name, MODE_NORMAL);
+	int second = openFile(name, MODE_NORMAL);
+	readFile(first, data, sizeof(char), 10);
+
+	// a whole block written through the second entry replaces the block
+	// the first has read
+	memset(expected, 'B', blockSize);
+	writeFile(second, expected, sizeof(char), blockSize);
+	flushFile(second);
+	closeFile(second);
+
+	readFile(first, data, sizeof(char), 10);
+	int ok = (memcmp(data, expected + 10, 10) == 0);
+
+	// a byte left in the first entry's buffer is seen by another
+	expected[20] = 'C';
+	writeFile(first, expected + 20, sizeof(char), 1);
+
+	second = openFile(name, MODE_READ_ONLY);
+	readFile(second, data, sizeof(char), 30);
+	ok = ok && memcmp(data, expected, 30) == 0;
+	closeFile(second);
+
+	closeFile(first);
+	check(name, ok && fileMatches(name, expected, len));
+	delFile(name);
+
+	free(expected);
+	free(data);
+}
+
+// Run every case on the mounted partition
+void runCases()
+{
+	unsigned long blockSize = getFSInfo()->blockSize;
+
+	readThenWrite("mid-block", 3000, 1500, 10);
+	readThenWrite("across-blocks", 3 * blockSize, blockSize - 100, blockSize + 200);
+	readThenWrite("block-aligned", 4 * blockSize, blockSize, 2 * blockSize);
+	readThenWrite("past-end", blockSize + 10, blockSize + 10, 3 * blockSize);
+	writeOverHole("over-hole");
+	twoEntries("two-entries");
+}
+
+int main(int ac, char **av)
+{
+	if(ac != 2)
+	{
+		printf("\nUsage: %s <partition file>\n\n", av[0]);
+		return -1;
+	}
+
+	initFS(av[1], "cs2106");
+	runCases();
+	closeFS();
+
+	initFS(av[1], "cs2106", IO_MMAP);
+	runCases();
+	closeFS();
+
+	return _failures > 0 ? 1 : 0;
+}
@@ -51,8 +51,8 @@ int main(int ac, char **av)
 	// Close the file
 	fclose(fp);
 	
-	free(inode);
-	free(buffer);
+	releaseInodeBuffer(inode);
+	releaseDataBuffer(buffer);
 	return 0;
 }
 
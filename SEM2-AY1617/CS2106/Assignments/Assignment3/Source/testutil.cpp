@@ -0,0 +1,32 @@
+#include "testutil.h"
+
+int _failures = 0;
+
+// Report a case, counting it as a failure unless ok is set
+void check(const char *name, int ok)
+{
+	printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+	if(!ok) {
+		_failures++;
+	}
+}
+
+// Fill len bytes with a pattern that differs for each seed and offset
+void fillPattern(char *buffer, unsigned long len, int seed)
+{
+	for(unsigned long i = 0; i < len; i++) {
+		buffer[i] = (char) (i * 7 + seed * 31 + (i >> 8));
+	}
+}
+
+// Free blocks once every delete so far has committed
+unsigned long committedFreeBlocks()
+{
+	commitJournal();
+
+	lockMetadata(0);
+	unsigned long count = getFreeBlockCount();
+	unlockMetadata();
+
+	return count;
+}
@@ -0,0 +1,19 @@
+#include "libefs.h"
+
+/*
+
+   Helpers shared by the round trip tests
+
+   */
+
+// Cases that have failed so far
+extern int _failures;
+
+// Report a case, counting it as a failure unless ok is set
+void check(const char *name, int ok);
+
+// Fill len bytes with a pattern that differs for each seed and offset
+void fillPattern(char *buffer, unsigned long len, int seed);
+
+// Free blocks once every delete so far has committed
+unsigned long committedFreeBlocks();
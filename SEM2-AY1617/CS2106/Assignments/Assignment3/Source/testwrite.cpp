@@ -64,8 +64,8 @@ int main(int ac, char **av)
 	unmountFS();
 
 	// Free data and inode buffer
-	free(buffer);
-	free(inode);
+	releaseDataBuffer(buffer);
+	releaseInodeBuffer(inode);
 	return 0;
 }
 